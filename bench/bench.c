@@ -0,0 +1,233 @@
+/* @file bench.c
+**
+** microbenchmarks of the hot-path stages, without the real-time pacing of a full simulation
+** built as a single translation unit with slowion.c so that its static functions can be called
+** @@
+******************************************************************************/
+
+#include "../src/slowion.c"
+
+opt_t *opt = NULL;
+
+#define BENCH_SEED 5
+#define BENCH_CHAN 256 //channels with a long read each
+#define BENCH_CHUNKS 16 //chunks per long read
+
+//bytes is what the stage consumes or produces (0 if not meaningful)
+static void report(const char *name, double sec, int64_t n, const char *unit, int64_t bytes){
+    printf("%-28s %12ld %-7s %10.2f ns/%-7s", name, n, unit, sec*1e9/n, unit);
+    if(bytes > 0){
+        printf(" %10.2f MB/s", bytes/(1024.0*1024.0)/sec);
+    }
+    printf("\n");
+}
+
+static void bench_rng(int64_t n){
+    int16_t *buf = (int16_t *)malloc(n * sizeof(int16_t));
+    MALLOC_CHK(buf);
+    int64_t x = BENCH_SEED;
+    int16_t st = 500;
+    double t0 = realtime();
+    for(int64_t i=0; i<n; i++){ //as in aq_chan
+        buf[i] = st+round(rng(&x)*1000-500);
+    }
+    double t = realtime() - t0;
+    int64_t sum = 0;
+    for(int64_t i=0; i<n; i++) sum += buf[i]; //keep the loop from being optimised away
+    report("rng (signal)", t, n, "sample", n*sizeof(int16_t));
+    LOG_DEBUG("checksum %ld", sum);
+    free(buf);
+}
+
+static void bench_grng(int64_t n){
+    rlen_t *r = init_rlen(BENCH_SEED);
+    int64_t sum = 0;
+    double t0 = realtime();
+    for(int64_t i=0; i<n; i++){
+        sum += rlen_next(r);
+    }
+    double t = realtime() - t0;
+    report("grng (read length)", t, n, "draw", 0);
+    LOG_DEBUG("mean read length %.1f samples", (double)sum/n);
+    free_rlen(r);
+}
+
+static void bench_xxh64(int64_t n){
+    int16_t *buf = (int16_t *)malloc(n * sizeof(int16_t));
+    MALLOC_CHK(buf);
+    int64_t x = BENCH_SEED;
+    for(int64_t i=0; i<n; i++){
+        buf[i] = 500+round(rng(&x)*1000-500);
+    }
+    double t0 = realtime();
+    uint64_t sum = xxh64_signal(buf, n);
+    double t = realtime() - t0;
+    report("xxh64 (checksum)", t, n, "sample", n*sizeof(int16_t));
+    LOG_DEBUG("checksum %016lx", sum);
+    free(buf);
+}
+
+//every channel gets the same fixed signal, so that all stages see the same data
+static void fill_signal(pos_t *pos){
+    int64_t x = BENCH_SEED;
+    for(int i=0; i<pos->nchan; i++){
+        for(int j=0; j<opt->cz; j++){
+            pos->c[i]->raw_signal[j] = 500+round(rng(&x)*1000-500);
+        }
+    }
+}
+
+//single-chunk reads written straight to the output, as in aquisition
+static void bench_append_read(pos_t *pos, int64_t nrec){
+    out_t *out = out_open(pos, 0, 0);
+    char name[64];
+    sprintf(name, "append_read [%s]", out->ops->name);
+    double t0 = realtime();
+    for(int64_t k=0; k<nrec; k++){
+        int i = k % pos->nchan;
+        wmeta_t m = {i, pos->c[i]->read_number++};
+        out_append_read(out, &m, pos->c[i]->raw_signal, opt->cz, xxh64_signal(pos->c[i]->raw_signal, opt->cz));
+    }
+    out_flush(out);
+    double t = realtime() - t0;
+    LOG_DEBUG("%.2f MB written", out->bytes/(1024.0*1024.0));
+    out_close(out);
+    pos->c_direct = nrec;
+    report(name, t, nrec*opt->cz, "sample", nrec*opt->cz*sizeof(int16_t));
+}
+
+//each round writes a long read per channel, with the chunks interleaved across channels as in aquisition
+static void bench_chunk_write(pos_t *pos, int rounds){
+    fdc_t fdc = {0};
+    fdc.head = fdc.tail = -1;
+    double t0 = realtime();
+    for(int r=0; r<rounds; r++){
+        for(int i=0; i<pos->nchan; i++){
+            islow5_open(&fdc, pos, 0, i);
+            xxh64_reset(&pos->c[i]->sum, 0);
+        }
+        for(int k=0; k<BENCH_CHUNKS; k++){
+            for(int i=0; i<pos->nchan; i++){
+                xxh64_update(&pos->c[i]->sum, pos->c[i]->raw_signal, opt->cz*sizeof(int16_t));
+                islow5_chunk_write(&fdc, pos, 0, i, opt->cz);
+            }
+        }
+        for(int i=0; i<pos->nchan; i++){
+            islow5_chunk_write(&fdc, pos, 0, i, 0); //end of read
+            islow5_sum_write(pos, i, xxh64_digest(&pos->c[i]->sum));
+            islow5_close(&fdc, pos, i);
+            pos->c[i]->c_islow5++;
+        }
+    }
+    double t = realtime() - t0;
+    int64_t n = (int64_t)rounds*pos->nchan*BENCH_CHUNKS*opt->cz;
+    report("islow5_chunk_write", t, n, "sample", n*sizeof(int16_t));
+}
+
+static void bench_to_slow5(pos_t *pos){
+    out_t *out = out_open(pos, 0, 1);
+    char name[64];
+    sprintf(name, "islow5_to_slow5 [%s]", out->ops->name);
+    int64_t nread = 0;
+    double t0 = realtime();
+    for(int i=0; i<pos->nchan; i++){
+        for(int32_t j=0; j<pos->c[i]->c_islow5; j++){
+            islow5_to_slow5(out, 0, i, j);
+            nread++;
+        }
+    }
+    out_flush(out);
+    double t = realtime() - t0;
+    out_close(out);
+    pos->c_s = nread;
+    int64_t n = nread*BENCH_CHUNKS*opt->cz;
+    report(name, t, n, "sample", n*sizeof(int16_t));
+}
+
+static void bench_get_next(pos_t *pos, int type, int64_t nrec){
+    in_t in;
+    in_open(&in, pos, 0, type);
+    char name[64];
+    sprintf(name, "get_next%s [%s]", type ? " (long)" : "", in.ops->name);
+    const int16_t *sig;
+    int64_t len, n = 0;
+    double t0 = realtime();
+    for(int64_t k=0; k<nrec; k++){
+        if(in_next(&in, &sig, &len) < 0){
+            ERROR("%s","Error reading the output!");
+            exit(EXIT_FAILURE);
+        }
+        n += len;
+    }
+    double t = realtime() - t0;
+    in_close(&in);
+    report(name, t, n, "sample", in.bytes);
+}
+
+//outputs of every format, so that the next one starts from scratch
+static void remove_outputs(const char *out){
+    static const char *ext[] = {".raw", ".ridx", ".col", ".meta"};
+    char path[4200];
+    for(int t=0; t<2; t++){
+        seg_path(path, 0, t, 0, 0);
+        remove(path);
+        for(int e=0; e<4; e++){
+            sprintf(path, "%s/pos0_%d%s", out, t, ext[e]);
+            remove(path);
+        }
+    }
+}
+
+int main(int argc, char *argv[]){
+    int scale = argc > 1 ? atoi(argv[1]) : 1; //multiplies the work of every benchmark
+    if(scale < 1){
+        fprintf(stderr, "Usage: %s [scale]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char dir[] = "/tmp/slowion_bench_XXXXXX";
+    if(mkdtemp(dir) == NULL){
+        ERROR("Could not create a temporary directory: %s", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    char out[4096];
+    sprintf(out, "%s/out", dir);
+
+    opt = init_opt();
+    opt->npos = 1;
+    opt->nchan = BENCH_CHAN;
+    opt->dir = out;
+    opt->seed = BENCH_SEED;
+    opt->chunk_ms = 1000;
+    cal_opt(opt);
+    prom_t *prom = init_prom();
+    pos_t *pos = prom->pos[0];
+    fill_signal(pos);
+
+    printf("chunk %d samples, %d channels, %d chunks per long read, scale %d\n", opt->cz, opt->nchan, BENCH_CHUNKS, scale);
+    bench_rng(50*1000*1000LL*scale);
+    bench_grng(10*1000*1000LL*scale);
+    bench_xxh64(50*1000*1000LL*scale);
+    int64_t nrec = 5000LL*scale;
+    for(int f=FMT_BLOW5; f<=FMT_COLUMNAR; f++){ //the same workload through every output format
+        opt->format = f;
+        for(int i=0; i<pos->nchan; i++){
+            pos->c[i]->c_islow5 = 0;
+        }
+        bench_append_read(pos, nrec);
+        bench_get_next(pos, 0, nrec);
+        bench_chunk_write(pos, scale);
+        bench_to_slow5(pos);
+        bench_get_next(pos, 1, (int64_t)pos->nchan*scale);
+        remove_outputs(out);
+    }
+
+    char path[4200];
+    sprintf(path, "%s/pos0", out);
+    rmdir(path);
+    rmdir(out);
+    rmdir(dir);
+    free_prom(prom);
+    free_opt(opt);
+    return 0;
+}
@@ -0,0 +1,133 @@
+/* @file checksum.h
+**
+** streaming XXH64, for per-read checksums of the signal from aquisition to read-back
+** @@
+******************************************************************************/
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+
+typedef struct{
+    uint64_t v[4];
+    uint64_t total;
+    uint8_t mem[32];
+    uint32_t memsize;
+} xxh64_t;
+
+static inline uint64_t xxh_rotl(uint64_t x, int r){
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_read64(const uint8_t *p){
+    uint64_t v;
+    memcpy(&v, p, sizeof(v)); //little-endian hosts only, as for the intermediate files
+    return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t in){
+    acc += in * XXH_P2;
+    acc = xxh_rotl(acc, 31);
+    return acc * XXH_P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t v){
+    acc ^= xxh_round(0, v);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+static inline void xxh64_reset(xxh64_t *h, uint64_t seed){
+    h->v[0] = seed + XXH_P1 + XXH_P2;
+    h->v[1] = seed + XXH_P2;
+    h->v[2] = seed;
+    h->v[3] = seed - XXH_P1;
+    h->total = 0;
+    h->memsize = 0;
+}
+
+static inline void xxh64_stripe(xxh64_t *h, const uint8_t *p){
+    h->v[0] = xxh_round(h->v[0], xxh_read64(p));
+    h->v[1] = xxh_round(h->v[1], xxh_read64(p+8));
+    h->v[2] = xxh_round(h->v[2], xxh_read64(p+16));
+    h->v[3] = xxh_round(h->v[3], xxh_read64(p+24));
+}
+
+static inline void xxh64_update(xxh64_t *h, const void *data, size_t len){
+    const uint8_t *p = (const uint8_t *)data;
+    const uint8_t *end = p + len;
+    h->total += len;
+    if(h->memsize + len < 32){
+        memcpy(h->mem + h->memsize, p, len);
+        h->memsize += len;
+        return;
+    }
+    if(h->memsize){
+        memcpy(h->mem + h->memsize, p, 32 - h->memsize);
+        xxh64_stripe(h, h->mem);
+        p += 32 - h->memsize;
+        h->memsize = 0;
+    }
+    while(p + 32 <= end){
+        xxh64_stripe(h, p);
+        p += 32;
+    }
+    h->memsize = end - p;
+    memcpy(h->mem, p, h->memsize);
+}
+
+static inline uint64_t xxh64_digest(const xxh64_t *h){
+    uint64_t r;
+    if(h->total >= 32){
+        r = xxh_rotl(h->v[0], 1) + xxh_rotl(h->v[1], 7) + xxh_rotl(h->v[2], 12) + xxh_rotl(h->v[3], 18);
+        for(int i=0; i<4; i++){
+            r = xxh_merge(r, h->v[i]);
+        }
+    } else {
+        r = h->v[2] + XXH_P5; //v[2] is the seed
+    }
+    r += h->total;
+
+    const uint8_t *p = h->mem;
+    const uint8_t *end = p + h->memsize;
+    while(p + 8 <= end){
+        r ^= xxh_round(0, xxh_read64(p));
+        r = xxh_rotl(r, 27) * XXH_P1 + XXH_P4;
+        p += 8;
+    }
+    if(p + 4 <= end){
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        r ^= (uint64_t)v * XXH_P1;
+        r = xxh_rotl(r, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    while(p < end){
+        r ^= (*p) * XXH_P5;
+        r = xxh_rotl(r, 11) * XXH_P1;
+        p++;
+    }
+    r ^= r >> 33;
+    r *= XXH_P2;
+    r ^= r >> 29;
+    r *= XXH_P3;
+    r ^= r >> 32;
+    return r;
+}
+
+//checksum of a whole signal in one go
+static inline uint64_t xxh64_signal(const int16_t *s, int64_t n){
+    xxh64_t h;
+    xxh64_reset(&h, 0);
+    xxh64_update(&h, s, n * sizeof(int16_t));
+    return xxh64_digest(&h);
+}
+
+#endif
@@ -30,10 +30,17 @@ SOFTWARE.
 #include <getopt.h>
 #include <assert.h>
 #include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 #include "slowion.h"
 #include "misc.h"
 #include "error.h"
+#include "stream.h"
+#include "metrics.h"
+#include "sysmon.h"
+#include "trace.h"
 
 opt_t *opt = NULL;
 
@@ -47,11 +54,48 @@ static struct option long_options[] = {
     {"sample-rate", required_argument, 0, 'f'},    //6
     {"rlen", required_argument, 0, 'r'},           //7
     {"output", required_argument, 0, 'd'},         //8
+    {"chunk-ms", required_argument, 0, 0},         //9 chunk duration in ms
+    {"stagger", required_argument, 0, 0},          //10 timer-wheel slots for staggered channels
+    {"rlen-dist", required_argument, 0, 0},        //11 read length distribution
+    {"rlen-shape", required_argument, 0, 0},       //12 shape of the read length distribution
+    {"rlen-file", required_argument, 0, 0},        //13 read lengths for the empirical distribution
+    {"occupancy", required_argument, 0, 0},        //14 pore occupancy
+    {"pore-halflife", required_argument, 0, 0},    //15 pore half-life in hours
+    {"mux-scan", required_argument, 0, 0},         //16 mux scan interval in seconds
+    {"bw-timeline", required_argument, 0, 0},      //17 bandwidth timeline bin width
+    {"sink", required_argument, 0, 0},             //18 stream output to a receiver
+    {"sink-dir", required_argument, 0, 0},         //19 receiver's output directory for reading back
+    {"placement", required_argument, 0, 0},        //20 placement of files across output directories
+    {"stage", required_argument, 0, 0},            //21 fast staging directory
+    {"seg-time", required_argument, 0, 0},         //22 BLOW5 segment duration in seconds
+    {"seg-reads", required_argument, 0, 0},        //23 records per BLOW5 segment
+    {"seg-mb", required_argument, 0, 0},           //24 BLOW5 segment size in MB
+    {"shared", required_argument, 0, 0},           //25 number of shared BLOW5 files
+    {"ring-mb", required_argument, 0, 0},          //26 shared-memory ring size per output in MB
+    {"procs", required_argument, 0, 0},            //27 worker processes
+    {"fd-cap", required_argument, 0, 0},           //28 open intermediate files per position
+    {"backpressure", no_argument, 0, 0},           //29 adapt to storage falling behind
+    {"adapt-press", no_argument, 0, 0},            //30 adaptive compression per segment
+    {"metrics", required_argument, 0, 0},          //31 per-iteration metrics file
+    {"prometheus", required_argument, 0, 0},       //32 Prometheus text-format file
+    {"prometheus-interval", required_argument, 0, 0}, //33 seconds between Prometheus file rewrites
+    {"sysmon", required_argument, 0, 0},           //34 kernel counter sampling interval
+    {"sysmon-file", required_argument, 0, 0},      //35 kernel counter samples
+    {"trace", required_argument, 0, 0},            //36 Chrome trace file
+    {"trace-spans", required_argument, 0, 0},      //37 spans kept per thread
+    {"no-checksum", no_argument, 0, 0},            //38 disable per-read checksums
+    {"format", required_argument, 0, 0},           //39 output format
+    {"mmap-mb", required_argument, 0, 0},          //40 memory-mapped window size in MB
+    {"reclaim-batch", required_argument, 0, 0},    //41 intermediate files unlinked per batch
+    {"fadvise", required_argument, 0, 0},          //42 page-cache window in MB
+    {"cold-read", no_argument, 0, 0},              //43 evict written data before reading it back
     {0, 0, 0, 0}};
 
 
 static inline void print_help_msg(FILE *fp_help, opt_t *opt){
     fprintf(fp_help,"Usage: slowion [OPTIONS]\n");
+    fprintf(fp_help,"       slowion recv [OPTIONS]     receiver for --sink\n");
+    fprintf(fp_help,"       slowion recover [OPTIONS]  convert intermediate files left by an interrupted run\n");
     fprintf(fp_help,"\nboptions:\n");
     fprintf(fp_help,"   -p INT                     number of positions [%d]\n",opt->npos);
     fprintf(fp_help,"   -c INT                     channels per position [%d]\n",opt->nchan);
@@ -59,7 +103,46 @@ static inline void print_help_msg(FILE *fp_help, opt_t *opt){
     fprintf(fp_help,"   -r INT                     mean read length (num bases) [%d]\n",opt->mean_rlen);
     fprintf(fp_help,"   -f INT                     sample rate [%d]\n",opt->freq);
     fprintf(fp_help,"   -b INT                     average translocation speed (bases per second) [%d]\n",opt->bps);
-    fprintf(fp_help,"   -d DIR                     output directory [%s]\n",opt->dir);
+    fprintf(fp_help,"   -d DIR[,DIR...]            output directories, e.g., one per disk [%s]\n",opt->dir);
+    fprintf(fp_help,"   --format STR               output format: blow5, raw (samples with a per-read index) or columnar\n"
+                    "                              (signal blocks per batch, metadata in a separate table) [blow5]\n");
+    fprintf(fp_help,"   --placement STR            rr: positions round-robin across directories, tiered: intermediate files\n"
+                    "                              on the first directory and BLOW5 round-robin on the rest [rr]\n");
+    fprintf(fp_help,"   --stage DIR                write to a fast staging directory and migrate closed segments to -d in the background\n");
+    fprintf(fp_help,"   --seg-time FLOAT           start a new BLOW5 segment every FLOAT seconds (0: no limit) [60 with --stage, else 0]\n");
+    fprintf(fp_help,"   --seg-reads INT            start a new BLOW5 segment every INT records (0: no limit) [0]\n");
+    fprintf(fp_help,"   --seg-mb FLOAT             start a new BLOW5 segment when the current one reaches FLOAT MB (0: no limit) [0]\n");
+    fprintf(fp_help,"   --shared INT               write all positions into INT shared BLOW5 files (0: a file per position and stream) [%d]\n",opt->shared);
+    fprintf(fp_help,"   --ring-mb FLOAT            read back completed reads from a shared-memory ring of FLOAT MB per output, falling back to the file (0: off) [0]\n");
+    fprintf(fp_help,"   --mmap-mb FLOAT            write BLOW5 through a memory-mapped window of FLOAT MB of a preallocated file (0: stdio) [0]\n");
+    fprintf(fp_help,"   --fadvise FLOAT            page-cache hints: read ahead FLOAT MB of each BLOW5 output and drop what is more than FLOAT MB\n"
+                    "                              behind the writer and reader (0: off) [0]\n");
+    fprintf(fp_help,"   --cold-read                evict written BLOW5 data from the page cache before reading it back\n");
+    fprintf(fp_help,"   --reclaim-batch INT        unlink converted intermediate files from a background thread, INT at a time (0: during conversion) [%d]\n",opt->reclaim_batch);
+    fprintf(fp_help,"   --procs INT                run positions in INT forked worker processes, position p in worker p %% INT (0: threads only) [%d]\n",opt->procs);
+    fprintf(fp_help,"   --fd-cap INT               keep at most INT intermediate files open per position, reopening in append mode (0: no limit) [%d]\n",opt->fd_cap);
+    fprintf(fp_help,"   --backpressure             batch flushes and defer conversion while storage falls behind\n");
+    fprintf(fp_help,"   --adapt-press              compress each new BLOW5 segment harder or lighter depending on the writer's spare time\n");
+    fprintf(fp_help,"   --chunk-ms INT             chunk duration in milliseconds, can be sub-second [derived from -r]\n");
+    fprintf(fp_help,"   --stagger INT              stagger channels over INT time slots per chunk period (0: lockstep) [%d]\n",opt->stagger);
+    fprintf(fp_help,"   --rlen-dist STR            read length distribution: gamma, lognormal or empirical [gamma]\n");
+    fprintf(fp_help,"   --rlen-shape FLOAT         gamma shape or lognormal sigma [2.0 for gamma, 1.0 for lognormal]\n");
+    fprintf(fp_help,"   --rlen-file FILE           read lengths in bases (one per line, optionally followed by a count) for empirical\n");
+    fprintf(fp_help,"   --occupancy FLOAT          fraction of time a live pore is sequencing [%.2f]\n",opt->occupancy);
+    fprintf(fp_help,"   --pore-halflife FLOAT      pore half-life in hours (0: pores never die) [%.1f]\n",opt->pore_halflife);
+    fprintf(fp_help,"   --mux-scan INT             seconds between mux scans that pause sequencing and replace dead pores (0: none) [%d]\n",opt->mux_scan);
+    fprintf(fp_help,"   --metrics FILE             write per-iteration metrics of each position and stage to FILE (CSV if it ends in .csv, else JSON lines)\n");
+    fprintf(fp_help,"   --prometheus FILE          rewrite FILE with live counters in the Prometheus text format during the run\n");
+    fprintf(fp_help,"   --prometheus-interval FLOAT\n"
+                    "                              seconds between rewrites of the --prometheus file [%.1f]\n",opt->prometheus_interval);
+    fprintf(fp_help,"   --sysmon FLOAT             sample kernel I/O, CPU and I/O pressure counters every FLOAT seconds and report at the end (0: off) [%.1f]\n",opt->sysmon);
+    fprintf(fp_help,"   --sysmon-file FILE         write the --sysmon samples to FILE as CSV\n");
+    fprintf(fp_help,"   --trace FILE               record spans of each stage per thread and write them to FILE as a Chrome trace at exit\n");
+    fprintf(fp_help,"   --trace-spans INT          spans kept per thread, older ones are overwritten [%ld]\n",opt->trace_spans);
+    fprintf(fp_help,"   --no-checksum              do not checksum reads at aquisition and verify them after conversion and on read-back\n");
+    fprintf(fp_help,"   --bw-timeline INT          print aquisition bandwidth over time in bins of INT seconds (0: off) [%d]\n",opt->bw_timeline);
+    fprintf(fp_help,"   --sink ADDR                stream BLOW5 output to a receiver (unix:PATH or tcp:HOST:PORT) instead of files\n");
+    fprintf(fp_help,"   --sink-dir DIR             directory the receiver writes to, for reading back (default: no read back)\n");
     fprintf(fp_help,"   -h                         help\n");
     fprintf(fp_help,"   --verbose INT              verbosity level [%d]\n",(int)get_log_level());
     fprintf(fp_help,"   --version                  print version\n");
@@ -76,8 +159,184 @@ void set_max_open_files(){
     LOG_TRACE("max open files curr:%ld, max:%ld ", rlp.rlim_cur, rlp.rlim_max);
 }
 
+//run the three threads of every position in group k of nproc (all positions if nproc is 0)
+static void run_positions(prom_t *prom, ptarg_t *arg, int nproc, int k){
+    reclaim_start();
+    seg_finaliser_start();
+    mapper_start();
+    metrics_start();
+    pthread_t *wp = (pthread_t *)malloc(prom->npos * sizeof(pthread_t)); //sequence aquisition, dwrite and iwrite
+    MALLOC_CHK(wp);
+
+    for(int t=0; t<prom->npos; t++){
+        if(nproc && t % nproc != k) continue;
+        int ret = pthread_create(&wp[t], NULL, seq_aq_w,(void*)(&arg[t]));
+        NEG_CHK(ret);
+    }
+
+    pthread_t *sz = (pthread_t *)malloc(prom->npos * sizeof(pthread_t)); //iwrite->dwrite
+    MALLOC_CHK(sz);
+    for(int t=0; t<prom->npos; t++){
+        if(nproc && t % nproc != k) continue;
+        int ret = pthread_create(&sz[t], NULL, iwrite2dwrite,(void*)(&arg[t]));
+        NEG_CHK(ret);
+    }
+
+    int readback = !(opt->sink && opt->sink_dir == NULL); //streamed output can only be read back if we know where it lands
+    pthread_t *b = (pthread_t *)malloc(prom->npos * sizeof(pthread_t));  //slow5 basecall
+    MALLOC_CHK(b);
+    for(int t=0; t<prom->npos && readback; t++){
+        if(nproc && t % nproc != k) continue;
+        int ret = pthread_create(&b[t], NULL, pseudobasecaller, (void*)(&arg[t]));
+        NEG_CHK(ret);
+    }
+
+    for (int t = 0; t < prom->npos && readback; t++) {
+        if(nproc && t % nproc != k) continue;
+        int ret = pthread_join(b[t], NULL);
+        NEG_CHK(ret);
+    }
+
+    for (int t = 0; t < prom->npos; t++) {
+        if(nproc && t % nproc != k) continue;
+        int ret = pthread_join(sz[t], NULL);
+        NEG_CHK(ret);
+    }
+
+    for (int t = 0; t < prom->npos; t++) {
+        if(nproc && t % nproc != k) continue;
+        int ret = pthread_join(wp[t], NULL);
+        NEG_CHK(ret);
+    }
+
+    metrics_stop();
+    mapper_stop();
+    seg_finaliser_stop();
+    reclaim_stop();
+    free(wp);
+    free(sz);
+    free(b);
+}
+
+static pthread_t exporter_thread;
+static int exporter_on = 0;
+static sysmon_t *sysmon = NULL;
+
+//threads that watch the run from the main process. pids are the processes doing the work
+static void start_monitors(prom_t *prom, const pid_t *pids, int npid){
+    if(opt->prometheus){
+        int ret = pthread_create(&exporter_thread, NULL, exporter, (void*)prom);
+        NEG_CHK(ret);
+        exporter_on = 1;
+    }
+    if(opt->sysmon > 0){
+        sysmon = sysmon_start(opt->sysmon_file, opt->sysmon, opt->dirs, opt->ndir, pids, npid);
+    }
+}
+
+//can be called again once stopped
+static void stop_monitors(){
+    if(exporter_on){
+        exporter_stop();
+        int ret = pthread_join(exporter_thread, NULL);
+        NEG_CHK(ret);
+        exporter_on = 0;
+    }
+    if(sysmon){
+        sysmon_stop(sysmon, dir_written_total());
+        sysmon = NULL;
+    }
+}
+
+//fork one worker process per group of positions. Progress and stats come back through the position
+//state, which init_prom placed in shared memory. Returns the number of workers that did not exit cleanly
+static int run_workers(prom_t *prom, ptarg_t *arg){
+    double realtime0 = realtime();
+    int nproc = opt->procs;
+    pid_t *pids = (pid_t *)malloc(nproc * sizeof(pid_t));
+    MALLOC_CHK(pids);
+
+    fflush(NULL); //do not let the children inherit and repeat buffered output
+    for(int k=0; k<nproc; k++){
+        pids[k] = fork();
+        if(pids[k] < 0){
+            ERROR("fork failed: %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if(pids[k] == 0){
+            run_positions(prom, arg, nproc, k);
+            trace_dump();
+            fflush(NULL);
+            _exit(EXIT_SUCCESS);
+        }
+        VERBOSE("worker %d (pid %d) started", k, (int)pids[k]);
+    }
+    start_monitors(prom, pids, nproc); //only after forking, a child must not inherit a thread that may hold a lock
+
+    //exited workers are left unreaped until the monitors have taken their last sample: a zombie still has its
+    //counters in /proc/PID, and its pid cannot be reused by another process in the meantime
+    int8_t *exited = (int8_t *)calloc(nproc, sizeof(int8_t));
+    MALLOC_CHK(exited);
+    int running = nproc;
+    struct timespec dl;
+    deadline_init(&dl);
+    while(running > 0){
+        for(int k=0; k<nproc; k++){
+            siginfo_t si;
+            si.si_pid = 0;
+            if(!exited[k] && waitid(P_PID, pids[k], &si, WEXITED | WNOHANG | WNOWAIT) == 0 && si.si_pid == pids[k]){
+                exited[k] = 1;
+                running--;
+            }
+        }
+        if(running == 0) break;
+
+        int64_t written = 0, read_back = 0;
+        for(int i=0; i<prom->npos; i++){
+            written += prom->pos[i]->c_direct + prom->pos[i]->c_s;
+            read_back += prom->pos[i]->c_bd + prom->pos[i]->c_bs;
+        }
+        fprintf(stderr,"[%.3f] workers: %d/%d running, %ld reads written, %ld read back\n", realtime()-realtime0, running, nproc, written, read_back);
+        deadline_add(&dl, opt->ct > 1 ? opt->ct : 1);
+        sleep_until(&dl);
+    }
+    stop_monitors();
+
+    int failed = 0;
+    for(int k=0; k<nproc; k++){
+        int status;
+        if(waitpid(pids[k], &status, 0) < 0){
+            ERROR("waitpid failed: %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if(WIFEXITED(status) && WEXITSTATUS(status) == 0){
+            VERBOSE("worker %d (pid %d) done", k, (int)pids[k]);
+        } else if (WIFSIGNALED(status)){
+            ERROR("worker %d (pid %d) killed by signal %d", k, (int)pids[k], WTERMSIG(status));
+            failed++;
+        } else {
+            ERROR("worker %d (pid %d) exited with status %d", k, (int)pids[k], WEXITSTATUS(status));
+            failed++;
+        }
+    }
+
+    free(exited);
+    free(pids);
+    return failed;
+}
+
 int main(int argc, char* argv[]){
 
+    if(argc > 1 && strcmp(argv[1], "recv") == 0){
+        return recv_main(argc-1, argv+1);
+    }
+    if(argc > 1 && strcmp(argv[1], "recover") == 0){
+        opt = init_opt();
+        int ret = recover_main(argc-1, argv+1);
+        free_opt(opt);
+        return ret;
+    }
+
     double realtime0 = realtime();
     const char* optstring = "p:c:T:f:r:d:b:hVv";
 
@@ -134,6 +393,190 @@ int main(int argc, char* argv[]){
             if(opt->bps<50 || opt->bps>500 ){
                 WARNING("%s","translocation speed must be between 50 and 500. Continuing anyway. May crash.");
             }
+        } else if (c == 0 && longindex == 9){ //chunk duration in ms
+            opt->chunk_ms = atoi(optarg);
+            if(opt->chunk_ms<=0){
+                ERROR("%s","chunk duration must be > 0 ms.");
+                exit(EXIT_FAILURE);
+            }
+            if(opt->chunk_ms<100){
+                WARNING("%s","chunk duration below 100 ms. Per-record overheads will dominate. Continuing anyway.");
+            }
+        } else if (c == 0 && longindex == 10){ //staggered channels
+            opt->stagger = atoi(optarg);
+            if(opt->stagger<0){
+                ERROR("%s","number of stagger slots must be >= 0.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (c == 0 && longindex == 11){ //read length distribution
+            if(strcmp(optarg, "gamma") == 0){
+                opt->rlen_dist = RLEN_GAMMA;
+            } else if (strcmp(optarg, "lognormal") == 0){
+                opt->rlen_dist = RLEN_LOGNORMAL;
+            } else if (strcmp(optarg, "empirical") == 0){
+                opt->rlen_dist = RLEN_EMPIRICAL;
+            } else {
+                ERROR("Unknown read length distribution '%s'. Must be gamma, lognormal or empirical.", optarg);
+                exit(EXIT_FAILURE);
+            }
+        } else if (c == 0 && longindex == 12){ //shape of the read length distribution
+            opt->rlen_shape = atof(optarg);
+            if(opt->rlen_shape<=0){
+                ERROR("%s","read length distribution shape must be > 0.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (c == 0 && longindex == 13){ //read lengths for the empirical distribution
+            opt->rlen_file = optarg;
+            opt->rlen_dist = RLEN_EMPIRICAL;
+        } else if (c == 0 && longindex == 14){ //pore occupancy
+            opt->occupancy = atof(optarg);
+            if(opt->occupancy<=0 || opt->occupancy>1){
+                ERROR("%s","occupancy must be in (0,1].");
+                exit(EXIT_FAILURE);
+            }
+        } else if (c == 0 && longindex == 15){ //pore half-life
+            opt->pore_halflife = atof(optarg);
+            if(opt->pore_halflife<0){
+                ERROR("%s","pore half-life must be >= 0.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (c == 0 && longindex == 16){ //mux scan interval
+            opt->mux_scan = atoi(optarg);
+            if(opt->mux_scan<0){
+                ERROR("%s","mux scan interval must be >= 0.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (c == 0 && longindex == 17){ //bandwidth timeline
+            opt->bw_timeline = atoi(optarg);
+            if(opt->bw_timeline<0){
+                ERROR("%s","bandwidth timeline bin width must be >= 0.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (c == 0 && longindex == 18){ //stream output to a receiver
+            opt->sink = optarg;
+        } else if (c == 0 && longindex == 19){ //receiver's output directory
+            opt->sink_dir = optarg;
+        } else if (c == 0 && longindex == 20){ //placement across directories
+            if(strcmp(optarg, "rr") == 0){
+                opt->placement = PLACE_RR;
+            } else if (strcmp(optarg, "tiered") == 0){
+                opt->placement = PLACE_TIERED;
+            } else {
+                ERROR("Unknown placement '%s'. Must be rr or tiered.", optarg);
+                exit(EXIT_FAILURE);
+            }
+        } else if (c == 0 && longindex == 21){ //staging directory
+            opt->stage = optarg;
+        } else if (c == 0 && longindex == 22){ //segment duration
+            opt->seg_time = atof(optarg);
+            if(opt->seg_time<0){
+                ERROR("%s","segment duration must be >= 0.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (c == 0 && longindex == 23){ //records per segment
+            opt->seg_reads = atol(optarg);
+            if(opt->seg_reads<0){
+                ERROR("%s","records per segment must be >= 0.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (c == 0 && longindex == 24){ //segment size
+            double mb = atof(optarg);
+            if(mb<0){
+                ERROR("%s","segment size must be >= 0.");
+                exit(EXIT_FAILURE);
+            }
+            opt->seg_bytes = (int64_t)(mb*1024*1024);
+        } else if (c == 0 && longindex == 26){ //shared-memory ring
+            double mb = atof(optarg);
+            if(mb<0){
+                ERROR("%s","ring size must be >= 0.");
+                exit(EXIT_FAILURE);
+            }
+            opt->ring_bytes = (int64_t)(mb*1024*1024);
+        } else if (c == 0 && longindex == 27){ //worker processes
+            opt->procs = atoi(optarg);
+            if(opt->procs<0){
+                ERROR("%s","number of worker processes must be >= 0.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (c == 0 && longindex == 28){ //fd cache
+            opt->fd_cap = atoi(optarg);
+            if(opt->fd_cap<0){
+                ERROR("%s","fd cap must be >= 0.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (c == 0 && longindex == 29){ //backpressure
+            opt->backpressure = 1;
+        } else if (c == 0 && longindex == 30){ //adaptive compression
+            opt->adapt_press = 1;
+        } else if (c == 0 && longindex == 31){ //metrics
+            opt->metrics = optarg;
+        } else if (c == 0 && longindex == 32){ //Prometheus exporter
+            opt->prometheus = optarg;
+        } else if (c == 0 && longindex == 33){
+            opt->prometheus_interval = atof(optarg);
+            if(opt->prometheus_interval<=0){
+                ERROR("%s","Prometheus interval must be > 0.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (c == 0 && longindex == 34){ //kernel counters
+            opt->sysmon = atof(optarg);
+            if(opt->sysmon<0){
+                ERROR("%s","sysmon interval must be >= 0.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (c == 0 && longindex == 35){
+            opt->sysmon_file = optarg;
+        } else if (c == 0 && longindex == 38){ //checksums
+            opt->checksum = 0;
+        } else if (c == 0 && longindex == 39){ //output format
+            if(strcmp(optarg, "blow5") == 0){
+                opt->format = FMT_BLOW5;
+            } else if (strcmp(optarg, "raw") == 0){
+                opt->format = FMT_RAW;
+            } else if (strcmp(optarg, "columnar") == 0){
+                opt->format = FMT_COLUMNAR;
+            } else {
+                ERROR("Unknown output format '%s'. Must be blow5, raw or columnar.", optarg);
+                exit(EXIT_FAILURE);
+            }
+        } else if (c == 0 && longindex == 40){ //memory-mapped output
+            double mb = atof(optarg);
+            if(mb<0){
+                ERROR("%s","window size must be >= 0.");
+                exit(EXIT_FAILURE);
+            }
+            int64_t page = sysconf(_SC_PAGESIZE);
+            opt->mmap_win = ((int64_t)(mb*1024*1024) + page - 1) / page * page; //windows start at page-aligned offsets
+        } else if (c == 0 && longindex == 41){ //deferred unlinks
+            opt->reclaim_batch = mm_parse_num(optarg);
+            if(opt->reclaim_batch<0){
+                ERROR("%s","Reclaim batch must be >= 0.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (c == 0 && longindex == 42){ //page-cache hints
+            double mb = atof(optarg);
+            if(mb<0){
+                ERROR("%s","page-cache window must be >= 0.");
+                exit(EXIT_FAILURE);
+            }
+            opt->fadvise = (int64_t)(mb*1024*1024);
+        } else if (c == 0 && longindex == 43){
+            opt->cold_read = 1;
+        } else if (c == 0 && longindex == 36){ //Chrome trace
+            opt->trace = optarg;
+        } else if (c == 0 && longindex == 37){
+            opt->trace_spans = mm_parse_num(optarg);
+            if(opt->trace_spans<1){
+                ERROR("%s","spans per thread must be >= 1.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (c == 0 && longindex == 25){ //shared output files
+            opt->shared = atoi(optarg);
+            if(opt->shared<0){
+                ERROR("%s","number of shared files must be >= 0.");
+                exit(EXIT_FAILURE);
+            }
         }
         // } else if(c == 0 && longindex == 7){ //debug break
         //     opt.debug_break = atoi(optarg);
@@ -148,64 +591,112 @@ int main(int argc, char* argv[]){
         exit(EXIT_FAILURE);
     }
 
+    if(opt->rlen_dist == RLEN_EMPIRICAL && opt->rlen_file == NULL){
+        ERROR("%s","--rlen-file is required for the empirical read length distribution.");
+        exit(EXIT_FAILURE);
+    }
+
+    if(opt->sink && (opt->stage || opt->seg_time > 0 || opt->seg_reads > 0 || opt->seg_bytes > 0)){
+        ERROR("%s","--stage and segment options cannot be used with --sink.");
+        exit(EXIT_FAILURE);
+    }
+    if(opt->shared > 0 && (opt->sink || opt->stage || opt->seg_time > 0 || opt->seg_reads > 0 || opt->seg_bytes > 0)){
+        ERROR("%s","--shared cannot be used with --sink, --stage or segment options.");
+        exit(EXIT_FAILURE);
+    }
+    if(opt->format != FMT_BLOW5 && (opt->sink || opt->stage || opt->shared > 0 || opt->adapt_press ||
+            opt->seg_time > 0 || opt->seg_reads > 0 || opt->seg_bytes > 0)){
+        ERROR("%s","--sink, --stage, --shared, --adapt-press and segment options need --format blow5.");
+        exit(EXIT_FAILURE);
+    }
+    if(opt->mmap_win > 0 && (opt->format != FMT_BLOW5 || opt->sink || opt->stage || opt->shared > 0 || opt->adapt_press ||
+            opt->seg_time > 0 || opt->seg_reads > 0 || opt->seg_bytes > 0)){
+        ERROR("%s","--mmap-mb cannot be used with --format raw/columnar, --sink, --stage, --shared, --adapt-press or segment options.");
+        exit(EXIT_FAILURE);
+    }
+    if((opt->fadvise > 0 || opt->cold_read) && opt->format != FMT_BLOW5){
+        ERROR("%s","--fadvise and --cold-read need --format blow5.");
+        exit(EXIT_FAILURE);
+    }
+    if(opt->cold_read && opt->mmap_win > 0){ //the preallocated file size says nothing about what has been written
+        ERROR("%s","--cold-read cannot be used with --mmap-mb.");
+        exit(EXIT_FAILURE);
+    }
+    if(opt->procs > 0 && (opt->stage || opt->shared > 0)){
+        ERROR("%s","--procs cannot be used with --stage or --shared.");
+        exit(EXIT_FAILURE);
+    }
+    if(opt->procs > opt->npos){
+        opt->procs = opt->npos;
+    }
+    if(opt->adapt_press && (opt->sink || opt->shared > 0)){
+        ERROR("%s","--adapt-press cannot be used with --sink or --shared.");
+        exit(EXIT_FAILURE);
+    }
+    if((opt->stage || opt->adapt_press) && opt->seg_time == 0 && opt->seg_reads == 0 && opt->seg_bytes == 0){ //segments are the unit of migration and of compression changes
+        opt->seg_time = 60;
+        INFO("No segment limit given, using %.0f s segments", opt->seg_time);
+    }
+
     cal_opt(opt);
     VERBOSE("positions: %d, channels: %d, sample_rate: %d Hz, avg speed: %d bases/s, avg readlen: %d bases", opt->npos, opt->nchan, opt->freq, opt->bps, opt->mean_rlen);
-    VERBOSE("simulation time : %d seconds, ct: %d, cz: %d, iterations: %d, memreq %.2f GiB", opt->sim_time, opt->ct, opt->cz, opt->iterations, (double)opt->cz*opt->npos*opt->nchan*2.0/(1024*1024*1024));
+    VERBOSE("simulation time : %d seconds, ct: %.3f, cz: %d, iterations: %d, memreq %.2f GiB", opt->sim_time, opt->ct, opt->cz, opt->iterations, (double)opt->cz*opt->npos*opt->nchan*2.0/(1024*1024*1024));
 
     set_max_open_files();
 
     prom_t *prom = init_prom();
+    metrics_open(opt->metrics, opt->ct);
+    trace_open(opt->trace, opt->trace_spans);
 
-    pthread_t *wp = (pthread_t *)malloc(prom->npos * sizeof(pthread_t)); //sequence aquisition, dwrite and iwrite
-    MALLOC_CHK(wp);
     ptarg_t *arg = (ptarg_t *)malloc(prom->npos * sizeof(ptarg_t));
     MALLOC_CHK(arg);
-
     for(int t=0; t<prom->npos; t++){
         arg[t].prom = prom;
         arg[t].mypos = t;
-        int ret = pthread_create(&wp[t], NULL, seq_aq_w,(void*)(&arg[t]));
-        NEG_CHK(ret);
     }
 
-    pthread_t *sz = (pthread_t *)malloc(prom->npos * sizeof(pthread_t)); //iwrite->dwrite
-    MALLOC_CHK(sz);
-    for(int t=0; t<prom->npos; t++){
-        int ret = pthread_create(&sz[t], NULL, iwrite2dwrite,(void*)(&arg[t]));
-        NEG_CHK(ret);
-    }
-
-    pthread_t *b = (pthread_t *)malloc(prom->npos * sizeof(pthread_t));  //slow5 basecall
-    MALLOC_CHK(b);
-    for(int t=0; t<prom->npos; t++){
-        int ret = pthread_create(&b[t], NULL, pseudobasecaller, (void*)(&arg[t]));
-        NEG_CHK(ret);
-    }
-
-    for (int t = 0; t < prom->npos; t++) {
-        int ret = pthread_join(b[t], NULL);
-        NEG_CHK(ret);
-    }
-
-    for (int t = 0; t < prom->npos; t++) {
-        int ret = pthread_join(sz[t], NULL);
-        NEG_CHK(ret);
-    }
-
-    for (int t = 0; t < prom->npos; t++) {
-        int ret = pthread_join(wp[t], NULL);
-        NEG_CHK(ret);
+    int failed = 0;
+    if(opt->procs == 0){
+        pid_t self = getpid();
+        start_monitors(prom, &self, 1);
+        pthread_t mover;
+        if(opt->stage){
+            int ret = pthread_create(&mover, NULL, stage_mover, (void*)prom);
+            NEG_CHK(ret);
+        }
+        run_positions(prom, arg, 0, 0);
+        if(opt->stage){
+            int ret = pthread_join(mover, NULL);
+            NEG_CHK(ret);
+        }
+    } else {
+        failed = run_workers(prom, arg);
     }
-
-
-    free(wp);
-    free(sz);
-    free(b);
     free(arg);
+    metrics_close();
+    trace_dump(); //threads of this process, if any
+    trace_close();
+    stop_monitors();
+
+    print_run_stats(prom);
+    int64_t sum_bad = 0;
+    for(int i=0; i<prom->npos; i++){
+        sum_bad += prom->pos[i]->sum_bad;
+    }
 
+    print_bw_timeline(prom);
+    print_dir_stats(realtime() - realtime0);
     free_prom(prom);
 
     free_opt(opt);
+    if(failed){
+        ERROR("%d worker processes failed", failed);
+        exit(EXIT_FAILURE);
+    }
+    if(sum_bad){
+        ERROR("%ld reads failed checksum verification", sum_bad);
+        exit(EXIT_FAILURE);
+    }
 
     fprintf(stderr,"[%s] Version: %s\n", __func__, SLOWION_VERSION);
     fprintf(stderr, "[%s] CMD:", __func__);
@@ -0,0 +1,189 @@
+/* @file metrics.c
+**
+** per-iteration metrics of each position and stage, as a JSON lines or CSV time series
+** @@
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "metrics.h"
+#include "error.h"
+#include "misc.h"
+
+static int metrics_fd = -1;
+static int metrics_csv = 0;
+static double metrics_t0 = 0;
+static double metrics_ct = 0;
+
+static const char *stage_name[] = {"aq", "conv", "readback"};
+
+//full batches handed over by the hot threads, formatted and written by the writer thread of the process
+typedef struct metrics_blk_s{
+    metrics_t mt;
+    struct metrics_blk_s *next;
+} metrics_blk_t;
+
+static struct{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    metrics_blk_t *head, *tail; //queued batches
+    metrics_blk_t *free; //written batches, reused so that a hand over does not allocate
+    int on;
+    int done;
+    pthread_t th;
+} mw = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+void metrics_open(const char *path, double ct){
+    metrics_t0 = realtime(); //also the time base of other samplers
+    if(path == NULL){
+        return;
+    }
+    //O_APPEND so that each batch lands whole even with several threads and processes writing
+    metrics_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if(metrics_fd < 0){
+        ERROR("Could not open metrics file %s: %s", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    size_t len = strlen(path);
+    metrics_csv = len >= 4 && strcmp(path + len - 4, ".csv") == 0;
+    if(metrics_csv){
+        const char hdr[] = "t,pos,stage,it,elapsed,ct,slack,reads,samples,bytes,conv_backlog,rb_backlog_direct,rb_backlog_conv\n";
+        if(write(metrics_fd, hdr, sizeof(hdr)-1) != (ssize_t)(sizeof(hdr)-1)){
+            ERROR("Error writing metrics header: %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    metrics_ct = ct;
+}
+
+void metrics_close(void){
+    if(metrics_fd >= 0){
+        close(metrics_fd);
+        metrics_fd = -1;
+    }
+}
+
+int metrics_enabled(void){
+    return metrics_fd >= 0;
+}
+
+double metrics_time(void){
+    return realtime() - metrics_t0;
+}
+
+void metrics_init(metrics_t *mt, int pos, int stage){
+    mt->pos = pos;
+    mt->stage = stage;
+    mt->n = 0;
+}
+
+//format a batch and write it with a single append
+static void metrics_write(metrics_t *mt){
+    char buf[METRICS_BATCH*320];
+    size_t len = 0;
+    for(int k=0; k<mt->n; k++){
+        metric_t *m = &mt->m[k];
+        const char *fmt = metrics_csv ?
+            "%.3f,%d,%s,%d,%.6f,%.6f,%.6f,%ld,%ld,%ld,%ld,%ld,%ld\n" :
+            "{\"t\":%.3f,\"pos\":%d,\"stage\":\"%s\",\"it\":%d,\"elapsed\":%.6f,\"ct\":%.6f,\"slack\":%.6f,"
+            "\"reads\":%ld,\"samples\":%ld,\"bytes\":%ld,\"conv_backlog\":%ld,\"rb_backlog_direct\":%ld,\"rb_backlog_conv\":%ld}\n";
+        len += snprintf(buf + len, sizeof(buf) - len, fmt, m->t, mt->pos, stage_name[mt->stage], m->it, m->elapsed, metrics_ct, m->slack,
+            m->reads, m->samples, m->bytes, m->conv_backlog, m->rb_backlog_direct, m->rb_backlog_conv);
+    }
+    if(write(metrics_fd, buf, len) != (ssize_t)len){
+        WARNING("Error writing metrics: %s", strerror(errno));
+    }
+}
+
+static void *metrics_writer(void *arg){
+    pthread_mutex_lock(&mw.lock);
+    while(1){
+        while(mw.head == NULL && !mw.done){
+            pthread_cond_wait(&mw.cond, &mw.lock);
+        }
+        metrics_blk_t *b = mw.head;
+        if(b == NULL){
+            break;
+        }
+        mw.head = mw.tail = NULL;
+        pthread_mutex_unlock(&mw.lock);
+
+        metrics_blk_t *last = b;
+        for(metrics_blk_t *p = b; p != NULL; p = p->next){
+            metrics_write(&p->mt);
+            last = p;
+        }
+
+        pthread_mutex_lock(&mw.lock);
+        last->next = mw.free;
+        mw.free = b;
+    }
+    pthread_mutex_unlock(&mw.lock);
+    return NULL;
+}
+
+void metrics_start(void){
+    if(metrics_fd < 0){
+        return;
+    }
+    mw.done = 0;
+    int ret = pthread_create(&mw.th, NULL, metrics_writer, NULL);
+    NEG_CHK(ret);
+    mw.on = 1;
+}
+
+void metrics_stop(void){
+    if(!mw.on){
+        return;
+    }
+    pthread_mutex_lock(&mw.lock);
+    mw.done = 1;
+    pthread_cond_signal(&mw.cond);
+    pthread_mutex_unlock(&mw.lock);
+    int ret = pthread_join(mw.th, NULL);
+    NEG_CHK(ret);
+    mw.on = 0;
+    while(mw.free != NULL){
+        metrics_blk_t *next = mw.free->next;
+        free(mw.free);
+        mw.free = next;
+    }
+}
+
+void metrics_flush(metrics_t *mt){
+    if(metrics_fd < 0 || mt->n == 0){
+        mt->n = 0;
+        return;
+    }
+    if(!mw.on){ //no writer thread in this process
+        metrics_write(mt);
+        mt->n = 0;
+        return;
+    }
+    pthread_mutex_lock(&mw.lock);
+    metrics_blk_t *b = mw.free;
+    if(b != NULL){
+        mw.free = b->next;
+    } else {
+        b = (metrics_blk_t *)malloc(sizeof(metrics_blk_t));
+        MALLOC_CHK(b);
+    }
+    memcpy(&b->mt, mt, sizeof(metrics_t));
+    b->next = NULL;
+    if(mw.tail != NULL){
+        mw.tail->next = b;
+    } else {
+        mw.head = b;
+    }
+    mw.tail = b;
+    pthread_cond_signal(&mw.cond);
+    pthread_mutex_unlock(&mw.lock);
+    mt->n = 0;
+}
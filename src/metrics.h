@@ -0,0 +1,65 @@
+/* @file metrics.h
+**
+** per-iteration metrics of each position and stage, as a JSON lines or CSV time series
+** @@
+******************************************************************************/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+//stages of a position
+#define METRICS_AQ 0 //aquisition (seq_aq_w)
+#define METRICS_CONV 1 //intermediate to BLOW5 conversion (iwrite2dwrite)
+#define METRICS_READBACK 2 //read-back (pseudobasecaller)
+
+#define METRICS_BATCH 32 //iterations kept by a thread before they are handed to the writer
+
+//one iteration of one stage. Counters are cumulative
+typedef struct{
+    double t; //end of the iteration, seconds since metrics_open
+    int32_t it;
+    double elapsed; //time spent working in the iteration
+    double slack; //time left before the deadline, negative when lagging
+    int64_t reads;
+    int64_t samples;
+    int64_t bytes;
+    int64_t conv_backlog; //intermediate reads complete but not yet converted
+    int64_t rb_backlog_direct; //direct reads written but not yet read back
+    int64_t rb_backlog_conv; //converted reads written but not yet read back
+} metric_t;
+
+//owned by one thread, so recording an iteration takes no lock and does no I/O
+typedef struct{
+    int pos;
+    int stage;
+    int n;
+    metric_t m[METRICS_BATCH];
+} metrics_t;
+
+//path ending in .csv gives CSV, anything else JSON lines. NULL disables metrics. ct is the chunk period, reported
+//alongside each iteration. Must be called before worker processes are forked, they share the descriptor
+void metrics_open(const char *path, double ct);
+void metrics_close(void);
+
+void metrics_init(metrics_t *mt, int pos, int stage);
+int metrics_enabled(void);
+double metrics_time(void); //seconds since metrics_open
+
+//the writer thread of a process, which formats and appends the batches handed over by metrics_flush. Without it,
+//metrics_flush writes the batch itself
+void metrics_start(void);
+void metrics_stop(void); //after the last metrics_flush of the process
+
+//hand the recorded iterations over to the writer, which appends each batch with a single write
+void metrics_flush(metrics_t *mt);
+
+static inline metric_t *metrics_next(metrics_t *mt){
+    if(mt->n == METRICS_BATCH){
+        metrics_flush(mt);
+    }
+    return &mt->m[mt->n++];
+}
+
+#endif
@@ -4,6 +4,7 @@
 ** @@
 ******************************************************************************/
 
+#define _GNU_SOURCE //copy_file_range
 #include <sys/resource.h>
 #include <sys/time.h>
 #include <stdint.h>
@@ -11,6 +12,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 
 /*
@@ -129,3 +139,135 @@ void print_size(const char* name, uint64_t bytes)
         fprintf(stderr, "[%s] %s : %.1f %s\n", __func__, name, count, suffixes[s]);
 }
 
+//set the deadline to now
+void deadline_init(struct timespec *dl){
+    clock_gettime(CLOCK_MONOTONIC, dl);
+}
+
+//push the deadline forward by sec seconds (can be fractional)
+void deadline_add(struct timespec *dl, double sec){
+    int64_t ns = (int64_t)(sec * 1e9 + 0.5);
+    dl->tv_sec += ns / 1000000000;
+    dl->tv_nsec += ns % 1000000000;
+    if (dl->tv_nsec >= 1000000000) {
+        dl->tv_sec++;
+        dl->tv_nsec -= 1000000000;
+    }
+}
+
+//seconds left until the deadline (negative if already passed)
+double deadline_slack(const struct timespec *dl){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (dl->tv_sec - now.tv_sec) + (dl->tv_nsec - now.tv_nsec) * 1e-9;
+}
+
+//sleep until the absolute deadline, returns immediately if it has already passed
+void sleep_until(const struct timespec *dl){
+#ifdef __APPLE__
+    //no clock_nanosleep on macOS, so sleep for the remaining relative time
+    double s = deadline_slack(dl);
+    if (s <= 0) return;
+    struct timespec req;
+    req.tv_sec = (time_t)s;
+    req.tv_nsec = (long)((s - req.tv_sec) * 1e9);
+    while (nanosleep(&req, &req) == -1 && errno == EINTR);
+#else
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, dl, NULL) == EINTR);
+#endif
+}
+
+//copy src to dst with copy_file_range, then sendfile, then read/write, whichever works first
+int64_t copy_file(const char *src, const char *dst){
+    int in = open(src, O_RDONLY);
+    if (in < 0) return -1;
+    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        close(in);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(in, &st) < 0) {
+        close(in);
+        close(out);
+        return -1;
+    }
+    int64_t left = st.st_size;
+
+#ifdef __linux__
+    while (left > 0) {
+        ssize_t n = copy_file_range(in, NULL, out, NULL, left, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break; //e.g., EXDEV on older kernels, fall through to sendfile
+        left -= n;
+    }
+    while (left > 0) {
+        ssize_t n = sendfile(out, in, NULL, left);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        left -= n;
+    }
+#endif
+    if (left > 0) {
+        char *buf = (char *)malloc(1024*1024);
+        if (buf == NULL) {
+            close(in);
+            close(out);
+            return -1;
+        }
+        lseek(in, st.st_size - left, SEEK_SET);
+        lseek(out, st.st_size - left, SEEK_SET);
+        while (left > 0) {
+            ssize_t n = read(in, buf, 1024*1024);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            ssize_t w = 0;
+            while (w < n) {
+                ssize_t m = write(out, buf + w, n - w);
+                if (m < 0 && errno == EINTR) continue;
+                if (m < 0) break;
+                w += m;
+            }
+            if (w < n) break;
+            left -= n;
+        }
+        free(buf);
+    }
+    close(in);
+    if (close(out) < 0 || left > 0) return -1;
+    return st.st_size;
+}
+
+//anonymous shared mapping, with its size stored in front for shm_free
+void *shm_calloc(size_t n, size_t size){
+    size_t bytes = n*size + 16;
+    void *mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    if (mem == MAP_FAILED) {
+        fprintf(stderr, "[%s] mmap failed: %s\n", __func__, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    *(size_t *)mem = bytes;
+    return (char *)mem + 16;
+}
+
+void shm_free(void *p){
+    if (p == NULL) return;
+    void *mem = (char *)p - 16;
+    munmap(mem, *(size_t *)mem);
+}
+
+//bytes the calling thread passed through read calls and bytes it caused to be fetched from storage.
+//Needs task I/O accounting (Linux), returns -1 without it
+int thread_io(int64_t *rchar, int64_t *read_bytes){
+    FILE *fp = fopen("/proc/thread-self/io", "r");
+    if (fp == NULL) return -1;
+    char key[64];
+    long long v;
+    int found = 0;
+    while (fscanf(fp, "%63[^:]: %lld\n", key, &v) == 2) {
+        if (strcmp(key, "rchar") == 0) { *rchar = v; found++; }
+        else if (strcmp(key, "read_bytes") == 0) { *read_bytes = v; found++; }
+    }
+    fclose(fp);
+    return found == 2 ? 0 : -1;
+}
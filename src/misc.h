@@ -11,6 +11,7 @@
 #include <sys/time.h>
 #include <stdint.h>
 #include <math.h>
+#include <time.h>
 
 double realtime(void);
 
@@ -25,4 +26,20 @@ int64_t mm_parse_num(const char* str);
 
 void yes_or_no(uint64_t* flag_a, uint64_t flag, const char* opt_name, const char* arg, int yes_to_set);
 
+// absolute deadlines on the monotonic clock, so that periodic loops do not drift
+void deadline_init(struct timespec *dl);
+void deadline_add(struct timespec *dl, double sec);
+double deadline_slack(const struct timespec *dl);
+void sleep_until(const struct timespec *dl);
+
+// copy a whole file in the kernel where possible, returns the number of bytes copied or -1
+int64_t copy_file(const char *src, const char *dst);
+
+// zeroed memory that stays shared with processes forked after the allocation
+void *shm_calloc(size_t n, size_t size);
+void shm_free(void *p);
+
+// read and storage I/O of the calling thread so far, -1 if not available
+int thread_io(int64_t *rchar, int64_t *read_bytes);
+
 #endif
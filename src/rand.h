@@ -40,9 +40,31 @@ typedef struct{
 typedef struct{
     double a;
     double b;
+    double d; //Marsaglia-Tsang constants derived from a
+    double c;
+    double n2; //spare normal deviate from the last Box-Muller draw
+    int has_n2;
     int64_t x;
 } grng_t;
 
+typedef struct{
+    double mu;
+    double sigma;
+    int64_t x;
+} lrng_t;
+
+//empirical distribution given as a histogram of values and their (cumulative) counts
+typedef struct{
+    int64_t n;
+    double *v;
+    int64_t *cum;
+} ehist_t;
+
+typedef struct{
+    const ehist_t *h;
+    int64_t x;
+} erng_t;
+
 static inline nrng_t* init_nrng(int64_t seed,double mean, double std){
     nrng_t *rng = (nrng_t *)malloc(sizeof(nrng_t));
     rng->m = mean;
@@ -55,6 +77,27 @@ static inline grng_t* init_grng(int64_t seed,double alpha, double beta){
     grng_t *rng = (grng_t *)malloc(sizeof(grng_t));
     rng->a = alpha;
     rng->b = beta;
+    double a1 = alpha < 1.0 ? alpha + 1.0 : alpha; //shape<1 is sampled as shape+1 and then boosted
+    rng->d = a1 - 1.0/3.0;
+    rng->c = 1.0/sqrt(9.0*rng->d);
+    rng->n2 = 0.0;
+    rng->has_n2 = 0;
+    rng->x = seed;
+    return rng;
+}
+
+//log-normal parameterised by its mean and the sigma of the underlying normal
+static inline lrng_t* init_lrng(int64_t seed,double mean, double sigma){
+    lrng_t *rng = (lrng_t *)malloc(sizeof(lrng_t));
+    rng->sigma = sigma;
+    rng->mu = log(mean) - sigma*sigma/2.0;
+    rng->x = seed;
+    return rng;
+}
+
+static inline erng_t* init_erng(int64_t seed,const ehist_t *h){
+    erng_t *rng = (erng_t *)malloc(sizeof(erng_t));
+    rng->h = h;
     rng->x = seed;
     return rng;
 }
@@ -67,6 +110,14 @@ static inline void free_grng(grng_t *rng){
     free(rng);
 }
 
+static inline void free_lrng(lrng_t *rng){
+    free(rng);
+}
+
+static inline void free_erng(erng_t *rng){
+    free(rng);
+}
+
 static inline double rng(int64_t *xp){
     int64_t x = *xp;
     int64_t x_new = (16807 * (x % 127773)) - (2836 * (x / 127773));
@@ -84,12 +135,51 @@ static inline double nrng(nrng_t *r){
     return ((x * r->s) + r->m);
 }
 
+//Marsaglia and Tsang (2000) gamma sampler, works for any shape > 0
 static inline double grng(grng_t *r){
-    double s = 0.0;
-    for(int i=0; i<r->a; i++){
-        s += -log(1-rng(&r->x));
+    double x, v, u;
+    while(1){
+        do {
+            if(r->has_n2){ //Box-Muller gives two deviates, use the spare one first
+                x = r->n2;
+                r->has_n2 = 0;
+            } else {
+                double u1 = rng(&r->x);
+                double u2 = rng(&r->x);
+                double m = sqrt(-2.0 * log(u1));
+                x = m * cos(2.0 * 3.14159265358979 * u2);
+                r->n2 = m * sin(2.0 * 3.14159265358979 * u2);
+                r->has_n2 = 1;
+            }
+            v = 1.0 + r->c * x;
+        } while (v <= 0.0);
+        v = v * v * v;
+        u = rng(&r->x);
+        if (u < 1.0 - 0.0331 * x * x * x * x) break; //squeeze, avoids the log most of the time
+        if (log(u) < 0.5 * x * x + r->d * (1.0 - v + log(v))) break;
+    }
+    double g = r->d * v;
+    if (r->a < 1.0) g *= pow(rng(&r->x), 1.0 / r->a);
+    return g*(r->b);
+}
+
+static inline double lrng(lrng_t *r){
+    double u = rng(&r->x);
+    double t = 2.0 * 3.14159265358979 * rng(&r->x);
+    double z = sqrt(-2.0 * log(u)) * cos(t);
+    return exp(r->mu + r->sigma * z);
+}
+
+//inverse CDF lookup on the cumulative counts
+static inline double erng(erng_t *r){
+    const ehist_t *h = r->h;
+    double t = rng(&r->x) * h->cum[h->n-1];
+    int64_t lo = 0, hi = h->n-1;
+    while (lo < hi) {
+        int64_t mid = (lo + hi) / 2;
+        if (h->cum[mid] < t) lo = mid + 1; else hi = mid;
     }
-    return s*(r->b);
+    return h->v[lo];
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,156 @@
+/* @file ring.c
+**
+** bounded shared-memory ring of completed reads, from the writer to the read-back consumer
+** @@
+******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "ring.h"
+#include "error.h"
+
+#define RING_NSLOT 65536 //recent records that can be looked up by sequence number
+#define RING_EMPTY UINT64_MAX
+
+//lives in the shared mapping, so that a ring can be used across processes
+typedef struct{
+    uint64_t cap; //data bytes
+    uint64_t reserve; //end of the entry being written. Anything before reserve-cap may be overwritten
+    uint64_t head; //end of the last complete entry
+    int64_t hits;
+    int64_t misses;
+    int64_t bytes; //sample bytes handed to the consumer
+    uint64_t slot[RING_NSLOT]; //ring position of record seq at seq % RING_NSLOT
+} ring_shm_t;
+
+typedef struct{
+    int64_t seq;
+    int64_t n; //samples
+    int64_t file_bytes;
+} ring_entry_t;
+
+struct ring_s{
+    ring_shm_t *shm;
+    uint8_t *data;
+    size_t map_size;
+};
+
+static inline uint64_t entry_size(int64_t n){
+    return sizeof(ring_entry_t) + (((uint64_t)n*sizeof(int16_t) + 7) & ~(uint64_t)7);
+}
+
+ring_t *ring_create(size_t bytes){
+    ring_t *ring = (ring_t *)malloc(sizeof(ring_t));
+    MALLOC_CHK(ring);
+    bytes = (bytes + 7) & ~(size_t)7;
+    ring->map_size = sizeof(ring_shm_t) + bytes;
+
+#ifdef __linux__
+    //a memfd can be handed to another process; a forked child inherits the mapping
+    int fd = memfd_create("slowion-ring", 0);
+    if(fd < 0 || ftruncate(fd, ring->map_size) != 0){
+        ERROR("Error creating shared memory for the ring: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    void *mem = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+#else
+    void *mem = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+#endif
+    if(mem == MAP_FAILED){
+        ERROR("Error mapping the ring: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    ring->shm = (ring_shm_t *)mem;
+    ring->data = (uint8_t *)mem + sizeof(ring_shm_t);
+    ring->shm->cap = bytes;
+    ring->shm->reserve = ring->shm->head = 0;
+    ring->shm->hits = ring->shm->misses = ring->shm->bytes = 0;
+    for(int i=0; i<RING_NSLOT; i++){
+        ring->shm->slot[i] = RING_EMPTY;
+    }
+    return ring;
+}
+
+void ring_destroy(ring_t *ring){
+    munmap(ring->shm, ring->map_size);
+    free(ring);
+}
+
+void ring_put(ring_t *ring, int64_t seq, const int16_t *samples, int64_t n, int64_t file_bytes){
+    ring_shm_t *shm = ring->shm;
+    uint64_t size = entry_size(n);
+    if(size > shm->cap){ //never fits, the consumer will read it from the file
+        __atomic_store_n(&shm->slot[seq % RING_NSLOT], RING_EMPTY, __ATOMIC_RELEASE);
+        return;
+    }
+
+    uint64_t start = shm->head;
+    uint64_t off = start % shm->cap;
+    if(off + size > shm->cap){ //entries are contiguous, skip the tail of the buffer
+        start += shm->cap - off;
+        off = 0;
+    }
+    uint64_t end = start + size;
+
+    //seqlock style: announce the range about to be overwritten before touching it
+    __atomic_store_n(&shm->reserve, end, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    ring_entry_t e = {seq, n, file_bytes};
+    memcpy(ring->data + off, &e, sizeof(e));
+    memcpy(ring->data + off + sizeof(e), samples, n*sizeof(int16_t));
+
+    __atomic_store_n(&shm->head, end, __ATOMIC_RELEASE);
+    __atomic_store_n(&shm->slot[seq % RING_NSLOT], start, __ATOMIC_RELEASE);
+}
+
+int ring_get(ring_t *ring, int64_t seq, int16_t **buf, int64_t *buf_cap, int64_t *n, int64_t *file_bytes){
+    ring_shm_t *shm = ring->shm;
+    uint64_t p = __atomic_load_n(&shm->slot[seq % RING_NSLOT], __ATOMIC_ACQUIRE);
+    if(p == RING_EMPTY || __atomic_load_n(&shm->reserve, __ATOMIC_RELAXED) > p + shm->cap){
+        shm->misses++;
+        return -1;
+    }
+
+    uint64_t off = p % shm->cap;
+    ring_entry_t e;
+    memcpy(&e, ring->data + off, sizeof(e));
+    if(e.seq != seq || e.n < 0 || off + entry_size(e.n) > shm->cap){ //slot reused by a later record
+        shm->misses++;
+        return -1;
+    }
+    if(e.n > *buf_cap){
+        *buf_cap = e.n;
+        *buf = (int16_t *)realloc(*buf, e.n * sizeof(int16_t));
+        MALLOC_CHK(*buf);
+    }
+    memcpy(*buf, ring->data + off + sizeof(e), e.n*sizeof(int16_t));
+
+    //the copy is only valid if the producer did not get to this range in the meantime
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&shm->reserve, __ATOMIC_RELAXED) > p + shm->cap){
+        shm->misses++;
+        return -1;
+    }
+
+    *n = e.n;
+    *file_bytes = e.file_bytes;
+    shm->hits++;
+    shm->bytes += e.n*sizeof(int16_t);
+    return 0;
+}
+
+void ring_stats(ring_t *ring, int64_t *hits, int64_t *misses, int64_t *bytes){
+    *hits = ring->shm->hits;
+    *misses = ring->shm->misses;
+    *bytes = ring->shm->bytes;
+}
@@ -0,0 +1,29 @@
+/* @file ring.h
+**
+** bounded shared-memory ring of completed reads, from the writer to the read-back consumer
+** @@
+******************************************************************************/
+
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//one producer and one consumer. The producer never waits: old entries are overwritten,
+//and a consumer that falls behind gets a miss and reads the record from the file instead
+typedef struct ring_s ring_t;
+
+ring_t *ring_create(size_t bytes);
+void ring_destroy(ring_t *ring);
+
+//publish record seq (records of an output are numbered from 0 in write order)
+//file_bytes is the size of the record in the file, so that a consumer can skip over it
+void ring_put(ring_t *ring, int64_t seq, const int16_t *samples, int64_t n, int64_t file_bytes);
+
+//copy record seq into *buf (grown as needed). Returns 0 on success, -1 if it is no longer (or never was) in the ring
+int ring_get(ring_t *ring, int64_t seq, int16_t **buf, int64_t *buf_cap, int64_t *n, int64_t *file_bytes);
+
+void ring_stats(ring_t *ring, int64_t *hits, int64_t *misses, int64_t *bytes);
+
+#endif
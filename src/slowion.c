@@ -31,6 +31,11 @@ SOFTWARE.
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <getopt.h>
 #include <assert.h>
 #include <pthread.h>
 
@@ -40,20 +45,45 @@ SOFTWARE.
 #include "error.h"
 #include "misc.h"
 #include "rand.h"
+#include "stream.h"
+#include "metrics.h"
+#include "trace.h"
+#include "checksum.h"
+#include "writer.h"
 
 
 extern opt_t *opt;
 
+#define ISLOW5_MAGIC "ISLOW5\1"
+#define ISLOW5_HDR_SIZE (7 + sizeof(int32_t)) //magic + read_number
+#define ISLOW5_END 0 //a zero length chunk marks a complete read, so that files left behind by a crash can be told apart
+#define BW_WINDOWS 10 //bandwidth accounting windows per chunk period
+#define MUX_SCAN_FRAC 18.0 //a mux scan takes 1/18 of the scan interval (5 min every 1.5 h)
+#define BP_WINDOW 4 //under pressure when conversion is this many iterations slower than usual and its backlog grows
+#define BP_CALM 5 //healthy iterations before stepping down a level
+#define BP_BATCH_ITERS 4 //iterations between flushes of the direct output when batching
+#define BP_DEFER_BUDGET 0.25 //fraction of the chunk period conversion may use when deferring
+#define PRESS_LEVELS 4
+#define PRESS_DEFAULT 2 //what a BLOW5 output uses without --adapt-press
+#define PRESS_UP 0.5 //spare fraction of the period above which the next segment compresses harder
+#define PRESS_DOWN 0.2 //spare fraction below which the next segment compresses less
+#define MMAP_EXTENT_WINDOWS 4 //windows preallocated at a time by a memory-mapped output
+
 void cal_opt(opt_t *opt){
 
     opt->mean_slen = opt->mean_rlen*opt->freq/opt->bps;
-    assert(opt->mean_slen*2>opt->freq);
 
-    opt->cz = ((opt->mean_slen*2));
-    opt->ct = (opt->cz/opt->freq);
+    if(opt->chunk_ms > 0){ //fixed chunk duration, can be sub-second
+        opt->ct = opt->chunk_ms/1000.0;
+        opt->cz = (int)ceil(opt->ct*opt->freq);
+    } else {
+        assert(opt->mean_slen*2>opt->freq);
+        opt->cz = ((opt->mean_slen*2));
+        opt->ct = (opt->cz/opt->freq);
+    }
     assert(opt->sim_time>opt->ct);
 
-    opt->iterations = (opt->sim_time/opt->ct);
+    opt->iterations = (int)(opt->sim_time/opt->ct);
     assert(opt->ct>0);
     assert(opt->sim_time>opt->ct);
     assert(opt->iterations>0);
@@ -71,7 +101,46 @@ opt_t *init_opt(){
     opt->nchan = 512; //number of channels
     opt->freq = 4000; //sampling frequency in Hz
     opt->dir = "./output/"; //output directory
+    opt->dirs = NULL; //split from opt->dir in init_prom
+    opt->ndir = 0;
+    opt->placement = PLACE_RR;
+    opt->nout = 0;
+    opt->stage = NULL; //no staging tier
+    opt->stage_dir = -1;
+    opt->seg_time = 0; //a single BLOW5 file per output
+    opt->seg_reads = 0;
+    opt->seg_bytes = 0;
+    opt->shared = 0; //a BLOW5 file per output
+    opt->ring_bytes = 0; //read back from the files only
+    opt->procs = 0; //all positions as threads of this process
+    opt->fd_cap = 0; //intermediate files stay open until the read is complete
+    opt->backpressure = 0;
+    opt->adapt_press = 0; //every segment uses PRESS_DEFAULT
+    opt->metrics = NULL;
+    opt->prometheus = NULL;
+    opt->prometheus_interval = 5;
+    opt->sysmon = 0;
+    opt->sysmon_file = NULL;
+    opt->trace = NULL;
+    opt->trace_spans = 1 << 16;
+    opt->checksum = 1;
+    opt->format = FMT_BLOW5;
+    opt->mmap_win = 0; //BLOW5 through stdio
+    opt->reclaim_batch = 0; //unlink intermediate files during conversion
+    opt->fadvise = 0; //no page-cache hints
+    opt->cold_read = 0;
     opt->seed = 5; //seed for random number generator
+    opt->chunk_ms = 0; //derive the chunk duration from the mean read length
+    opt->stagger = 0; //all channels in lockstep
+    opt->rlen_dist = RLEN_GAMMA; //read length distribution
+    opt->rlen_shape = 0; //use the default shape of the distribution
+    opt->rlen_file = NULL;
+    opt->occupancy = 1.0; //every channel sequences all the time
+    opt->pore_halflife = 0; //pores never die
+    opt->mux_scan = 0; //no mux scans
+    opt->bw_timeline = 0;
+    opt->sink = NULL; //write to local files
+    opt->sink_dir = NULL;
 
     cal_opt(opt);
 
@@ -80,9 +149,257 @@ opt_t *init_opt(){
 
 
 void free_opt(opt_t *opt){
+    for(int i=0; i<opt->ndir; i++){
+        free(opt->dirs[i]);
+    }
+    free(opt->dirs);
     free(opt);
 }
 
+//state that the parent reads after the workers are done lives in shared memory in multi-process mode
+static void *ctl_calloc(size_t n, size_t size){
+    if(opt->procs > 0){
+        return shm_calloc(n, size);
+    }
+    void *p = calloc(n, size);
+    MALLOC_CHK(p);
+    return p;
+}
+
+static void ctl_free(void *p){
+    if(opt->procs > 0){
+        shm_free(p);
+    } else {
+        free(p);
+    }
+}
+
+static int64_t *dir_wbytes = NULL; //bytes written to each output directory
+static int64_t *dir_rbytes = NULL; //bytes read from each output directory
+static int64_t *dir_used = NULL; //bytes currently held in each output directory
+static int64_t *dir_peak = NULL; //peak of dir_used
+static int *dir_dev = NULL; //first directory on the same device as each directory, which holds the device's usage
+static int64_t *dev_used = NULL; //bytes currently held on each device, indexed by dir_dev
+static int64_t *dev_peak = NULL; //peak of dev_used
+
+static inline void peak_max(int64_t *peak, int64_t used){
+    int64_t p = __atomic_load_n(peak, __ATOMIC_RELAXED);
+    while(used > p && !__atomic_compare_exchange_n(peak, &p, used, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static inline void dir_io(int d, int64_t written, int64_t read){
+    if(written){
+        __atomic_fetch_add(&dir_wbytes[d], written, __ATOMIC_RELAXED);
+        peak_max(&dir_peak[d], __atomic_add_fetch(&dir_used[d], written, __ATOMIC_RELAXED));
+        peak_max(&dev_peak[dir_dev[d]], __atomic_add_fetch(&dev_used[dir_dev[d]], written, __ATOMIC_RELAXED));
+    }
+    if(read) __atomic_fetch_add(&dir_rbytes[d], read, __ATOMIC_RELAXED);
+}
+
+//bytes deleted from a directory
+static inline void dir_release(int d, int64_t bytes){
+    __atomic_fetch_sub(&dir_used[d], bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&dev_used[dir_dev[d]], bytes, __ATOMIC_RELAXED);
+}
+
+//for the backends in writer.c
+void dir_account(int d, int64_t written, int64_t read){
+    dir_io(d, written, read);
+}
+
+//directory index for the intermediate files of a position
+static inline int tmp_dir(int mypos){
+    if(opt->stage_dir >= 0){
+        return opt->stage_dir;
+    }
+    return opt->placement == PLACE_TIERED ? 0 : mypos % opt->nout;
+}
+
+//directory index for the final BLOW5 files of a position
+static inline int out_dir(int mypos){
+    if(opt->placement == PLACE_TIERED){
+        return opt->nout > 1 ? 1 + mypos % (opt->nout-1) : 0;
+    }
+    return mypos % opt->nout;
+}
+
+//BLOW5 output is split into rolling segments
+static inline int segmented(){
+    return opt->seg_time > 0 || opt->seg_reads > 0 || opt->seg_bytes > 0;
+}
+
+//path of a BLOW5 segment, on the staging tier or in its final directory
+static void seg_path(char *path, int mypos, int type, int32_t seg, int staged){
+    const char *dir = staged ? opt->dirs[opt->stage_dir] : opt->dirs[out_dir(mypos)];
+    if(segmented()){
+        sprintf(path, "%s/pos%d_%d.seg%d.blow5", dir, mypos, type, seg);
+    } else {
+        sprintf(path, "%s/pos%d_%d.blow5", dir, mypos, type);
+    }
+}
+
+static void split_dirs(opt_t *opt){
+    char *s = strdup(opt->dir);
+    MALLOC_CHK(s);
+    opt->ndir = 0;
+    opt->dirs = NULL;
+    for(char *tok = strtok(s, ","); tok != NULL; tok = strtok(NULL, ",")){
+        opt->dirs = (char **)realloc(opt->dirs, (opt->ndir+1) * sizeof(char *));
+        MALLOC_CHK(opt->dirs);
+        opt->dirs[opt->ndir] = strdup(tok);
+        MALLOC_CHK(opt->dirs[opt->ndir]);
+        opt->ndir++;
+    }
+    free(s);
+    if(opt->ndir == 0){
+        ERROR("%s","No output directory given.");
+        exit(EXIT_FAILURE);
+    }
+    opt->nout = opt->ndir;
+    if(opt->stage){
+        opt->dirs = (char **)realloc(opt->dirs, (opt->ndir+1) * sizeof(char *));
+        MALLOC_CHK(opt->dirs);
+        opt->dirs[opt->ndir] = strdup(opt->stage);
+        MALLOC_CHK(opt->dirs[opt->ndir]);
+        opt->stage_dir = opt->ndir;
+        opt->ndir++;
+    }
+}
+
+//bytes the application has written to all directories
+int64_t dir_written_total(void){
+    int64_t total = 0;
+    for(int d=0; d<opt->ndir; d++){
+        total += __atomic_load_n(&dir_wbytes[d], __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+//bandwidth and usage per device, since directories on the same device share its bandwidth and space
+void print_dir_stats(double elapsed){
+    double mb = 1024.0*1024.0;
+    for(int d=0; d<opt->ndir; d++){
+        if(dir_dev[d] != d){ //counted with the first directory on its device
+            continue;
+        }
+        struct stat st = {0};
+        stat(opt->dirs[d], &st);
+        int64_t w = 0, r = 0;
+        fprintf(stderr, "[%s] dev %u:%u (", __func__, major(st.st_dev), minor(st.st_dev));
+        for(int e=d; e<opt->ndir; e++){
+            if(dir_dev[e] != d) continue;
+            fprintf(stderr, "%s%s%s", e == d ? "" : ", ", opt->dirs[e], e == opt->stage_dir ? " staging" : "");
+            w += dir_wbytes[e];
+            r += dir_rbytes[e];
+        }
+        fprintf(stderr, "): written %.2f MB (%.2f MB/s), read %.2f MB (%.2f MB/s), peak usage %.2f MB\n",
+            w/mb, w/mb/elapsed, r/mb, r/mb/elapsed, dev_peak[d]/mb);
+    }
+}
+
+
+static ehist_t *rlen_hist = NULL; //loaded from opt->rlen_file, shared by all positions
+
+//load read lengths (bases) for the empirical distribution. Each line is a length optionally followed by a count
+static ehist_t *load_rlen_hist(const char *path){
+    FILE *fp = fopen(path, "r");
+    F_CHK(fp, path);
+
+    ehist_t *h = (ehist_t *)malloc(sizeof(ehist_t));
+    MALLOC_CHK(h);
+    int64_t cap = 1024;
+    h->n = 0;
+    h->v = (double *)malloc(cap * sizeof(double));
+    MALLOC_CHK(h->v);
+    h->cum = (int64_t *)malloc(cap * sizeof(int64_t));
+    MALLOC_CHK(h->cum);
+
+    char line[1024];
+    int64_t total = 0;
+    double sum = 0;
+    double max = 0;
+    while(fgets(line, sizeof(line), fp)){
+        if(line[0] == '#' || line[0] == '\n') continue;
+        double len = 0;
+        int64_t count = 1;
+        int n = sscanf(line, "%lf %ld", &len, &count);
+        if(n < 1 || len <= 0 || count <= 0){
+            ERROR("Malformed line in read length file %s: %s", path, line);
+            exit(EXIT_FAILURE);
+        }
+        if(h->n == cap){
+            cap *= 2;
+            h->v = (double *)realloc(h->v, cap * sizeof(double));
+            MALLOC_CHK(h->v);
+            h->cum = (int64_t *)realloc(h->cum, cap * sizeof(int64_t));
+            MALLOC_CHK(h->cum);
+        }
+        total += count;
+        sum += len*count;
+        if(len > max) max = len;
+        h->v[h->n] = len*opt->freq/opt->bps; //bases to samples
+        h->cum[h->n] = total;
+        h->n++;
+    }
+    fclose(fp);
+
+    if(h->n == 0){
+        ERROR("No read lengths found in %s", path);
+        exit(EXIT_FAILURE);
+    }
+    VERBOSE("loaded %ld read lengths (%ld distinct) from %s: mean %.0f bases, max %.0f bases", total, h->n, path, sum/total, max);
+    return h;
+}
+
+static void free_rlen_hist(ehist_t *h){
+    free(h->v);
+    free(h->cum);
+    free(h);
+}
+
+//read length (in samples) generator for the selected distribution
+typedef struct{
+    int type;
+    grng_t *g;
+    lrng_t *l;
+    erng_t *e;
+} rlen_t;
+
+static rlen_t *init_rlen(int64_t seed){
+    rlen_t *r = (rlen_t *)calloc(1, sizeof(rlen_t));
+    MALLOC_CHK(r);
+    r->type = opt->rlen_dist;
+    if(r->type == RLEN_GAMMA){
+        double shape = opt->rlen_shape > 0 ? opt->rlen_shape : 2.0;
+        r->g = init_grng(seed, shape, opt->mean_slen/shape);
+    } else if (r->type == RLEN_LOGNORMAL){
+        double sigma = opt->rlen_shape > 0 ? opt->rlen_shape : 1.0;
+        r->l = init_lrng(seed, opt->mean_slen, sigma);
+    } else {
+        assert(rlen_hist != NULL);
+        r->e = init_erng(seed, rlen_hist);
+    }
+    return r;
+}
+
+static inline uint64_t rlen_next(rlen_t *r){
+    double v;
+    if(r->type == RLEN_GAMMA){
+        v = grng(r->g);
+    } else if (r->type == RLEN_LOGNORMAL){
+        v = lrng(r->l);
+    } else {
+        v = erng(r->e);
+    }
+    return v < 1.0 ? 1 : (uint64_t)v; //a zero length read would never be written
+}
+
+static void free_rlen(rlen_t *r){
+    if(r->g) free_grng(r->g);
+    if(r->l) free_lrng(r->l);
+    if(r->e) free_erng(r->e);
+    free(r);
+}
 
 static void set_record_primary_fields(slow5_rec_t *slow5_record, slow5_file_t *sp, uint64_t len_raw_signal, int16_t *raw_signal, int pos, int chan, int32_t read_number){
 
@@ -136,20 +453,234 @@ static void set_record_aux_fields(slow5_rec_t *slow5_record, slow5_file_t *sp, i
     }
 }
 
-prom_t *init_prom(){
+static void set_header_attributes(slow5_file_t *sp);
+static void set_header_aux_fields(slow5_file_t *sp);
 
-    struct stat st = {0};
+//an encoder with the same header and compression as a BLOW5 output, for serialising records to memory
+static slow5_file_t *s5_encoder(){
+    slow5_file_t *sp = slow5_open_with("/dev/null", "w", SLOW5_FORMAT_BINARY);
+    if(sp==NULL){
+        ERROR("%s","Error opening file!");
+        exit(EXIT_FAILURE);
+    }
+    if(slow5_set_press(sp, SLOW5_COMPRESS_ZSTD, SLOW5_COMPRESS_SVB_ZD) < 0){
+        ERROR("%s","Error setting compression method!");
+        exit(EXIT_FAILURE);
+    }
+    set_header_attributes(sp);
+    set_header_aux_fields(sp);
+    return sp;
+}
 
-    if (stat(opt->dir, &st) == -1) {
-        int ret = mkdir(opt->dir, 0755);
-        if (ret == -1) {
-            perror("mkdir");
+//serialised BLOW5 header of an encoder
+static void *s5_hdr_mem(slow5_file_t *sp, size_t *n){
+    slow5_press_method_t method = {SLOW5_COMPRESS_ZSTD, SLOW5_COMPRESS_SVB_ZD};
+    void *hdr = slow5_hdr_to_mem(sp->header, SLOW5_FORMAT_BINARY, method, n);
+    if(hdr == NULL){
+        ERROR("%s","Error serialising header!");
+        exit(EXIT_FAILURE);
+    }
+    return hdr;
+}
+
+//a BLOW5 file written concurrently by several outputs at reserved offsets
+typedef struct{
+    char path[4096];
+    int fd;
+    int dir;
+    int64_t off; //next free byte. Writers reserve ranges with an atomic add
+    int32_t nopen; //outputs still writing. The last one to close finalises the file
+    int32_t nrv;
+    resv_t **rv; //reservations of the outputs writing to this file
+} shared_t;
+
+static shared_t *shared = NULL;
+
+//both streams of a position go to the same file
+static inline int shared_file(int mypos, int type){
+    return mypos % opt->shared;
+}
+
+static void shared_init(prom_t *prom){
+    shared = (shared_t *)calloc(opt->shared, sizeof(shared_t));
+    MALLOC_CHK(shared);
+    slow5_file_t *sp = s5_encoder();
+    size_t n = 0;
+    void *hdr = s5_hdr_mem(sp, &n);
+    slow5_close(sp);
+
+    for(int f=0; f<opt->shared; f++){
+        shared_t *sh = &shared[f];
+        sh->dir = f % opt->nout;
+        sprintf(sh->path, "%s/shared%d.blow5", opt->dirs[sh->dir], f);
+        sh->fd = open(sh->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(sh->fd < 0){
+            ERROR("Error opening %s: %s", sh->path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if(pwrite(sh->fd, hdr, n, 0) != (ssize_t)n){
+            ERROR("Error writing header to %s: %s", sh->path, strerror(errno));
             exit(EXIT_FAILURE);
         }
-    } else{
-        ERROR("Directory %s already exists. Delete that first.", opt->dir);
+        dir_io(sh->dir, n, 0);
+        sh->off = n;
+        sh->rv = (resv_t **)malloc(2 * prom->npos * sizeof(resv_t *));
+        MALLOC_CHK(sh->rv);
+    }
+    free(hdr);
+
+    for(int i=0; i<prom->npos; i++){
+        for(int t=0; t<2; t++){
+            shared_t *sh = &shared[shared_file(i, t)];
+            prom->pos[i]->resv[t].file = shared_file(i, t);
+            sh->rv[sh->nrv++] = &prom->pos[i]->resv[t];
+            sh->nopen++;
+        }
+    }
+}
+
+static void sums_add(sums_t *sums, uint64_t sum){
+    int64_t n = sums->n;
+    if(n % SUMS_BLOCK == 0){ //linked before n is published, so the reader never follows a NULL next
+        sums_blk_t *b = (sums_blk_t *)malloc(sizeof(sums_blk_t));
+        MALLOC_CHK(b);
+        b->next = NULL;
+        if(sums->tail) sums->tail->next = b;
+        else sums->head = b;
+        sums->tail = b;
+    }
+    sums->tail->v[n % SUMS_BLOCK] = sum;
+    __atomic_store_n(&sums->n, n+1, __ATOMIC_RELEASE);
+}
+
+//the checksum of record seq, which must be the next one. It is dropped once taken
+static uint64_t sums_take(sums_t *sums, int64_t seq){
+    assert(seq == sums->taken && seq < __atomic_load_n(&sums->n, __ATOMIC_ACQUIRE));
+    if(seq > 0 && seq % SUMS_BLOCK == 0){ //the writer has moved on from the previous block
+        sums_blk_t *b = sums->head;
+        sums->head = b->next;
+        free(b);
+    }
+    sums->taken++;
+    return sums->head->v[seq % SUMS_BLOCK];
+}
+
+//by the read-back thread once the writers are done
+static void sums_free(sums_t *sums){
+    while(sums->head){
+        sums_blk_t *b = sums->head;
+        sums->head = b->next;
+        free(b);
+    }
+    sums->tail = NULL;
+}
+
+static void resv_add(resv_t *rv, int64_t off, int64_t len, const char *id){
+    pthread_mutex_lock(&rv->lock);
+    if(rv->n == rv->cap){
+        rv->cap = rv->cap ? rv->cap*2 : 256;
+        rv->off = (int64_t *)realloc(rv->off, rv->cap * sizeof(int64_t));
+        MALLOC_CHK(rv->off);
+        rv->len = (int64_t *)realloc(rv->len, rv->cap * sizeof(int64_t));
+        MALLOC_CHK(rv->len);
+        rv->id = (char **)realloc(rv->id, rv->cap * sizeof(char *));
+        MALLOC_CHK(rv->id);
+    }
+    rv->off[rv->n] = off;
+    rv->len[rv->n] = len;
+    rv->id[rv->n] = strdup(id);
+    MALLOC_CHK(rv->id[rv->n]);
+    rv->n++;
+    pthread_mutex_unlock(&rv->lock);
+}
+
+//called by the last output to close: EOF marker and an index from the reservations
+static void shared_close(int f){
+    shared_t *sh = &shared[f];
+    const char eof[] = SLOW5_BINARY_EOF;
+    int64_t end = __atomic_fetch_add(&sh->off, sizeof(eof), __ATOMIC_RELAXED);
+    if(pwrite(sh->fd, eof, sizeof(eof), end) != sizeof(eof)){
+        ERROR("Error writing EOF to %s: %s", sh->path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    dir_io(sh->dir, sizeof(eof), 0);
+    close(sh->fd);
+
+    char path[4200];
+    sprintf(path, "%s.idx.tsv", sh->path);
+    FILE *fp = fopen(path, "w");
+    if(fp == NULL){
+        ERROR("Error opening %s: %s", path, strerror(errno));
         exit(EXIT_FAILURE);
     }
+    fprintf(fp, "#read_id\toffset\tsize\n");
+    int64_t nrec = 0;
+    for(int r=0; r<sh->nrv; r++){
+        resv_t *rv = sh->rv[r];
+        for(int64_t j=0; j<rv->n; j++){
+            fprintf(fp, "%s\t%ld\t%ld\n", rv->id[j], rv->off[j], rv->len[j]);
+        }
+        nrec += rv->n;
+    }
+    dir_io(sh->dir, ftello(fp), 0);
+    fclose(fp);
+
+    fprintf(stderr,"[%s] %s: %ld records from %d outputs, %.2f MB\n", __func__, sh->path, nrec, sh->nrv, (end + sizeof(eof))/(1024.0*1024.0));
+}
+
+static FILE *manifest = NULL; //completed segments, one line each, for downstream consumers
+static pthread_mutex_t manifest_lock = PTHREAD_MUTEX_INITIALIZER;
+
+prom_t *init_prom(){
+
+    split_dirs(opt);
+    for(int d=0; d<opt->ndir; d++){
+        struct stat st = {0};
+        if (stat(opt->dirs[d], &st) == -1) {
+            int ret = mkdir(opt->dirs[d], 0755);
+            if (ret == -1) {
+                perror("mkdir");
+                exit(EXIT_FAILURE);
+            }
+        } else{
+            ERROR("Directory %s already exists. Delete that first.", opt->dirs[d]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if(segmented()){
+        char path[4096];
+        sprintf(path, "%s/manifest.tsv", opt->dirs[0]);
+        manifest = fopen(path, "w");
+        if(manifest == NULL){
+            ERROR("Error opening %s: %s", path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        fprintf(manifest, "#path\tpos\ttype\tseg\treads\tbytes\tclosed\n");
+        fflush(manifest);
+    }
+    dir_wbytes = (int64_t *)ctl_calloc(opt->ndir, sizeof(int64_t));
+    dir_rbytes = (int64_t *)ctl_calloc(opt->ndir, sizeof(int64_t));
+    dir_used = (int64_t *)ctl_calloc(opt->ndir, sizeof(int64_t));
+    dir_peak = (int64_t *)ctl_calloc(opt->ndir, sizeof(int64_t));
+    dev_used = (int64_t *)ctl_calloc(opt->ndir, sizeof(int64_t));
+    dev_peak = (int64_t *)ctl_calloc(opt->ndir, sizeof(int64_t));
+    dir_dev = (int *)malloc(opt->ndir * sizeof(int));
+    MALLOC_CHK(dir_dev);
+    for(int d=0; d<opt->ndir; d++){
+        struct stat st = {0}, st2 = {0};
+        stat(opt->dirs[d], &st);
+        dir_dev[d] = d;
+        for(int e=0; e<d; e++){
+            if(stat(opt->dirs[e], &st2) == 0 && st2.st_dev == st.st_dev){
+                dir_dev[d] = e;
+                break;
+            }
+        }
+    }
+
+    if(opt->rlen_dist == RLEN_EMPIRICAL){
+        rlen_hist = load_rlen_hist(opt->rlen_file);
+    }
 
     prom_t *prom = (prom_t *)malloc(sizeof(prom_t));
     MALLOC_CHK(prom);
@@ -160,14 +691,13 @@ prom_t *init_prom(){
 
     for(int i=0; i < prom->npos; i++){
         LOG_TRACE("Creating pos %d", i);
-        prom->pos[i] = (pos_t *)malloc(sizeof(pos_t));
-        MALLOC_CHK(prom->pos[i]);
+        prom->pos[i] = (pos_t *)ctl_calloc(1, sizeof(pos_t));
         prom->pos[i]->nchan = opt->nchan;
         prom->pos[i]->c = (chan_t **)malloc(prom->pos[i]->nchan * sizeof(chan_t*));
         MALLOC_CHK(prom->pos[i]->c);
 
         char path[4096];
-        sprintf(path, "%s/pos%d", opt->dir, i);
+        sprintf(path, "%s/pos%d", opt->dirs[tmp_dir(i)], i);
         //LOG_TRACE("Creating directory %s", path);
         int ret = mkdir(path, 0755);
         if (ret == -1) {
@@ -186,6 +716,12 @@ prom_t *init_prom(){
             prom->pos[i]->c[j]->raw_signal = (int16_t *)malloc(opt->cz * sizeof(int16_t));
             MALLOC_CHK(prom->pos[i]->c[j]->raw_signal);
             prom->pos[i]->c[j]->chunk_number = 0;
+            prom->pos[i]->c[j]->mux = 0;
+            prom->pos[i]->c[j]->scans = 0;
+            prom->pos[i]->c[j]->idle_until = 0;
+            for(int m=0; m<N_MUX; m++){
+                prom->pos[i]->c[j]->pore_death[m] = INFINITY;
+            }
         }
 
         prom->pos[i]->c_direct = 0;
@@ -195,6 +731,39 @@ prom_t *init_prom(){
         prom->pos[i]->total_samples = 0;
         prom->pos[i]->aq_done = 0;
         prom->pos[i]->s_done = 0;
+        prom->pos[i]->bw.n = (opt->iterations+1)*BW_WINDOWS;
+        prom->pos[i]->bw.bytes = (int64_t *)ctl_calloc(prom->pos[i]->bw.n, sizeof(int64_t));
+        prom->pos[i]->nactive = (int32_t *)ctl_calloc(opt->iterations, sizeof(int32_t));
+        for(int k=0; k<3; k++){
+            prom->pos[i]->max_lag[k] = 0;
+        }
+        for(int t=0; t<2; t++){
+            segs_t *segs = &prom->pos[i]->seg[t];
+            segs->nseg = 0;
+            segs->nclosed = 0;
+            segs->nmigrated = 0;
+            segs->cap = 16;
+            segs->nrec = (int64_t *)malloc(segs->cap * sizeof(int64_t));
+            MALLOC_CHK(segs->nrec);
+            segs->tclose = (double *)malloc(segs->cap * sizeof(double));
+            MALLOC_CHK(segs->tclose);
+            segs->staged = (int8_t *)malloc(segs->cap * sizeof(int8_t));
+            MALLOC_CHK(segs->staged);
+            pthread_mutex_init(&segs->lock, NULL);
+
+            resv_t *rv = &prom->pos[i]->resv[t];
+            memset(rv, 0, sizeof(resv_t));
+            pthread_mutex_init(&rv->lock, NULL);
+
+            memset(&prom->pos[i]->sums[t], 0, sizeof(sums_t));
+
+            int readback = !(opt->sink && opt->sink_dir == NULL);
+            prom->pos[i]->ring[t] = opt->ring_bytes > 0 && readback ? ring_create(opt->ring_bytes) : NULL;
+        }
+    }
+
+    if(opt->shared > 0){
+        shared_init(prom);
     }
 
     return prom;
@@ -209,11 +778,58 @@ void free_prom(prom_t *prom){
             free(prom->pos[i]->c[j]);
         }
         free(prom->pos[i]->c);
-        free(prom->pos[i]);
+        ctl_free(prom->pos[i]->bw.bytes);
+        ctl_free(prom->pos[i]->nactive);
+        for(int t=0; t<2; t++){
+            if(opt->procs == 0){ //a worker process may have grown these on its own heap
+                free(prom->pos[i]->seg[t].nrec);
+                free(prom->pos[i]->seg[t].tclose);
+                free(prom->pos[i]->seg[t].staged);
+            }
+            pthread_mutex_destroy(&prom->pos[i]->seg[t].lock);
+
+            resv_t *rv = &prom->pos[i]->resv[t];
+            for(int64_t j=0; j<rv->n; j++){
+                free(rv->id[j]);
+            }
+            free(rv->off);
+            free(rv->len);
+            free(rv->id);
+            pthread_mutex_destroy(&rv->lock);
+
+            if(prom->pos[i]->ring[t]) ring_destroy(prom->pos[i]->ring[t]);
+        }
+        ctl_free(prom->pos[i]);
     }
 
     free(prom->pos);
     free(prom);
+
+    if(shared){
+        for(int f=0; f<opt->shared; f++){
+            free(shared[f].rv);
+        }
+        free(shared);
+        shared = NULL;
+    }
+    if(manifest){
+        fclose(manifest);
+        manifest = NULL;
+    }
+    ctl_free(dir_wbytes);
+    ctl_free(dir_rbytes);
+    ctl_free(dir_used);
+    ctl_free(dir_peak);
+    ctl_free(dev_used);
+    ctl_free(dev_peak);
+    free(dir_dev);
+    dir_wbytes = dir_rbytes = dir_used = dir_peak = dev_used = dev_peak = NULL;
+    dir_dev = NULL;
+
+    if(rlen_hist){
+        free_rlen_hist(rlen_hist);
+        rlen_hist = NULL;
+    }
 }
 
 static void set_header_attributes(slow5_file_t *sp){
@@ -273,147 +889,2039 @@ static void set_header_aux_fields(slow5_file_t *sp){
     }
 }
 
-static void slow5fy(slow5_file_t *sp, uint64_t len_raw_signal, int16_t *raw_signal, int pos, int chan, int32_t read_number){
-    slow5_rec_t *slow5_record = slow5_rec_init();
-    if(slow5_record == NULL){
-        ERROR("%s","Could not allocate space for a slow5 record.");
-        exit(EXIT_FAILURE);
-    }
+//compression ladder from cheapest to strongest (record, signal)
+static const enum slow5_press_method press_ladder[PRESS_LEVELS][2] = {
+    {SLOW5_COMPRESS_NONE, SLOW5_COMPRESS_NONE},
+    {SLOW5_COMPRESS_NONE, SLOW5_COMPRESS_SVB_ZD},
+    {SLOW5_COMPRESS_ZSTD, SLOW5_COMPRESS_SVB_ZD},
+    {SLOW5_COMPRESS_ZSTD, SLOW5_COMPRESS_EX_ZD},
+};
+static const char *press_name[PRESS_LEVELS] = {"none", "svb-zd", "zstd+svb-zd", "zstd+ex-zd"};
+
+//a BLOW5 output: either local file(s) or a stream to a receiver (opt->sink)
+typedef struct{
+    slow5_file_t *sp; //header and compression state. Writes to /dev/null when streaming
+    stream_t *st;
+    int mypos;
+    int type;
+    int dir; //directory index of the current segment, for I/O accounting
+    int64_t nrec;
+    double encode_time; //serialisation time when streaming or writing to a shared file
+    resv_t *rv; //reservations when writing to a shared file, NULL otherwise
+    int16_t *sig; //read being assembled from chunks
+    int64_t sig_n;
+    int64_t sig_cap;
+
+    //memory-mapped output (opt->mmap_win)
+    int fd;
+    uint8_t *map; //current window, NULL if not mapped
+    int64_t map_off; //file offset of the window
+    int64_t used; //bytes written to the file
+    int64_t alloc; //bytes preallocated, updated by the mapper thread
+    int64_t alloc_req; //bytes asked to be preallocated
+    int32_t pending; //mapper jobs not done yet
+    int32_t windows;
+    int32_t extents;
+    double map_time; //mapping, and waiting for preallocation
+    double bg_time; //preallocating and retiring windows on the mapper thread
+
+    //page-cache hints (opt->fadvise)
+    int64_t dropped; //start of what may still be cached behind the writer
+    int64_t kicked; //end of what was last handed to DONTNEED, possibly still under writeback
+
+    segs_t *segs;
+    int32_t seg; //current segment
+    int64_t seg_nrec; //records in the current segment
+    int64_t seg_samples; //signal samples in the current segment
+    double seg_t0; //when the current segment was started
+
+    //adaptive compression (opt->adapt_press)
+    int press; //ladder level of the current segment
+    double spare; //moving average of the writer's spare fraction of each period
+    int press_changes;
+    int32_t press_segs[PRESS_LEVELS];
+    int64_t press_bytes[PRESS_LEVELS]; //bytes on disk written at each level
+    int64_t press_samples[PRESS_LEVELS]; //samples stored at each level
+} s5out_t;
+
+//the writer reports its spare time after each period: (deadline slack)/ct, negative when lagging
+static void s5out_spare(s5out_t *out, double spare){
+    out->spare = 0.7*out->spare + 0.3*spare;
+}
 
-    set_record_primary_fields(slow5_record, sp, len_raw_signal, raw_signal, pos, chan, read_number);
-    set_record_aux_fields(slow5_record, sp, chan, read_number);
+//bytes and samples of the current segment, counted against its level
+static void s5out_press_account(s5out_t *out){
+    const char eof[] = SLOW5_BINARY_EOF;
+    out->press_bytes[out->press] += ftello(out->sp->fp) + sizeof(eof);
+    out->press_samples[out->press] += out->seg_samples;
+}
 
-    //write to file
-    if(slow5_write(slow5_record, sp) < 0){
-        ERROR("%s","Error writing record!");
-        exit(EXIT_FAILURE);
+static void s5out_press_report(s5out_t *out){
+    double mb = 1024.0*1024.0;
+    int64_t bytes = 0, est = 0;
+    for(int l=0; l<PRESS_LEVELS; l++){
+        if(out->press_segs[l] == 0) continue;
+        fprintf(stderr,"[%s] pos %d stream %d: %-12s %d segments, %.2f MB, %.3f bytes/sample\n", __func__, out->mypos, out->type, press_name[l],
+            out->press_segs[l], out->press_bytes[l]/mb, out->press_samples[l] ? (double)out->press_bytes[l]/out->press_samples[l] : 0);
+        bytes += out->press_bytes[l];
+    }
+    //what the same samples would have taken at the default level, if it was used at all
+    if(out->press_samples[PRESS_DEFAULT] > 0){
+        double ratio = (double)out->press_bytes[PRESS_DEFAULT]/out->press_samples[PRESS_DEFAULT];
+        for(int l=0; l<PRESS_LEVELS; l++){
+            est += l == PRESS_DEFAULT ? out->press_bytes[l] : (int64_t)(out->press_samples[l]*ratio);
+        }
+        fprintf(stderr,"[%s] pos %d stream %d: %d level changes, %.2f MB on disk vs ~%.2f MB at %s (%+.1f%%)\n", __func__, out->mypos, out->type,
+            out->press_changes, bytes/mb, est/mb, press_name[PRESS_DEFAULT], est ? 100.0*(bytes-est)/est : 0);
     }
-    //free the slow5 record
-    slow5_rec_free(slow5_record);
 }
 
-static void islow5_open(chan_t *chan, int mypos, int32_t channel){
-    char path[4096];
-    sprintf(path, "%s/pos%d/chan%d_%d.iblow5", opt->dir, mypos, channel, chan->c_islow5);
-    chan->fp = fopen(path, "w");
-    F_CHK(chan->fp, path);
-    if(fwrite("ISLOW5\1", 1, 7, chan->fp) != 7){
-        ERROR("Error in fwrite. %s",strerror(errno));
-        exit(EXIT_FAILURE);
+//pick the level of the next segment from the spare time
+static void s5out_adapt(s5out_t *out){
+    int press = out->press;
+    if(out->spare > PRESS_UP && press < PRESS_LEVELS-1){
+        press++;
+    } else if (out->spare < PRESS_DOWN && press > 0){
+        press--;
     }
-    if(fwrite(&chan->read_number, sizeof(int32_t), 1, chan->fp) != 1){
-        ERROR("Error in fwrite. %s",strerror(errno));
-        exit(EXIT_FAILURE);
+    if(press != out->press){
+        INFO("pos %d stream %d: segment %d compression %s -> %s (spare %.2f)", out->mypos, out->type, out->seg+1, press_name[out->press], press_name[press], out->spare);
+        out->press = press;
+        out->press_changes++;
     }
 }
 
-static void islow5_chunk_write(chan_t *chan, int64_t j){
-    if(fwrite(&j, sizeof(int64_t), 1, chan->fp) != 1){
-        ERROR("Error in fwrite. %s",strerror(errno));
-        exit(EXIT_FAILURE);
-    }
-    if(fwrite(chan->raw_signal, sizeof(int16_t), j, chan->fp) != (size_t) j){
-        ERROR("Error in fwrite. %s",strerror(errno));
-        exit(EXIT_FAILURE);
+static inline int64_t page_floor(int64_t off){
+    int64_t page = sysconf(_SC_PAGESIZE);
+    return off / page * page;
+}
+
+//keep at most opt->fadvise bytes of the output cached behind its end. DONTNEED starts writeback of dirty pages
+//but only drops clean ones, so every range is given a second time one step later, once it has been written back
+static void s5out_drop_behind(s5out_t *out, int fd, int64_t end){
+    int64_t to = page_floor(end - opt->fadvise);
+    if(to - out->kicked < opt->fadvise/2){
+        return;
     }
+    posix_fadvise(fd, out->dropped, to - out->dropped, POSIX_FADV_DONTNEED);
+    out->dropped = out->kicked;
+    out->kicked = to;
 }
 
-static void islow5_to_slow5(slow5_file_t *sp, int mypos, int32_t channel, int32_t index){
-    char path[4096];
-    sprintf(path, "%s/pos%d/chan%d_%d.iblow5", opt->dir, mypos, channel, index);
-    FILE *fp = fopen(path, "r");
-    F_CHK(fp, path);
-    char magic[7];
-    if(fread(magic, 1, 7, fp) != 7){
-        ERROR("Error reading magic number from %s. %s", path, strerror(errno));
-        exit(EXIT_FAILURE);
+//preallocating the file ahead of the writer and retiring full windows (msync and munmap) is done by a mapper thread of
+//the process, so the writer only maps the next window
+#define MAP_RETIRE 0
+#define MAP_EXTEND 1
+
+typedef struct{
+    s5out_t *out;
+    int kind;
+    uint8_t *map; //window to retire
+    int64_t off; //extent to preallocate
+    int64_t len;
+} map_job_t;
+
+static struct{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_cond_t done_cond; //a job has completed
+    map_job_t *q;
+    int64_t n;
+    int64_t cap;
+    int on;
+    int done;
+    pthread_t thread;
+} mp = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static void map_job_run(map_job_t *j){
+    if(j->kind == MAP_RETIRE){ //writeback is left to the kernel
+        msync(j->map, opt->mmap_win, MS_ASYNC);
+        munmap(j->map, opt->mmap_win);
+        return;
     }
-    if(strncmp(magic, "ISLOW5\1", 7) != 0){
-        ERROR("Error: %s is not an islow5 file", path);
+#ifdef __linux__
+    int ret = posix_fallocate(j->out->fd, j->off, j->len);
+#else
+    int ret = ftruncate(j->out->fd, j->off + j->len) == 0 ? 0 : errno;
+#endif
+    if(ret != 0){
+        ERROR("Error preallocating output: %s", strerror(ret));
         exit(EXIT_FAILURE);
     }
-    int32_t read_number;
-    if(fread(&read_number, sizeof(int32_t), 1, fp) != 1){
-        ERROR("Error read read_number from %s. %s", path, strerror(errno));
-        exit(EXIT_FAILURE);
+}
+
+static void map_job(s5out_t *out, int kind, uint8_t *map, int64_t off, int64_t len){
+    map_job_t j = {out, kind, map, off, len};
+    if(!mp.on){
+        map_job_run(&j);
+        if(kind == MAP_EXTEND){
+            out->alloc = off + len;
+            out->extents++;
+        }
+        return;
+    }
+    pthread_mutex_lock(&mp.lock);
+    if(mp.n == mp.cap){
+        mp.cap = mp.cap ? mp.cap*2 : 64;
+        mp.q = (map_job_t *)realloc(mp.q, mp.cap*sizeof(map_job_t));
+        MALLOC_CHK(mp.q);
     }
+    mp.q[mp.n++] = j;
+    out->pending++;
+    pthread_cond_signal(&mp.cond);
+    pthread_mutex_unlock(&mp.lock);
+}
 
-    int16_t *raw_signal = (int16_t *)malloc(sizeof(int16_t) * opt->cz);
-    MALLOC_CHK(raw_signal);
-    uint64_t len_raw_signal = 0;
-    int64_t j;
-    size_t off = 0;
+static void *mapper(void *arg){
+    trace_thread("mapper");
+    map_job_t *b = NULL; //the jobs being run, swapped with the queue
+    int64_t bcap = 0;
 
+    pthread_mutex_lock(&mp.lock);
     while(1){
-
-        if(fread(&j, sizeof(int64_t), 1, fp) != 1){
-            break; //todo check for EOF
+        while(mp.n == 0 && !mp.done){
+            pthread_cond_wait(&mp.cond, &mp.lock);
         }
-        len_raw_signal += j;
-
-        raw_signal = (int16_t *)realloc(raw_signal,len_raw_signal*sizeof(int16_t));
-        MALLOC_CHK(raw_signal);
-
-        if(fread(raw_signal+off, sizeof(int16_t), j, fp) != (size_t) j){
+        if(mp.n == 0){
             break;
         }
-        off+=j;
-    }
+        map_job_t *q = mp.q;
+        int64_t qcap = mp.cap;
+        int64_t n = mp.n;
+        mp.q = b;
+        mp.cap = bcap;
+        mp.n = 0;
+        b = q;
+        bcap = qcap;
+        pthread_mutex_unlock(&mp.lock);
+
+        for(int64_t i=0; i<n; i++){
+            double t0 = realtime();
+            map_job_run(&b[i]);
+            double t = realtime() - t0;
+            s5out_t *out = b[i].out;
+            pthread_mutex_lock(&mp.lock);
+            if(b[i].kind == MAP_EXTEND){
+                out->alloc = b[i].off + b[i].len;
+                out->extents++;
+            }
+            out->bg_time += t;
+            out->pending--;
+            pthread_cond_broadcast(&mp.done_cond);
+            pthread_mutex_unlock(&mp.lock);
+        }
 
-    slow5_rec_t *slow5_record = slow5_rec_init();
-    if(slow5_record == NULL){
-        ERROR("%s","Could not allocate space for a slow5 record.");
-        exit(EXIT_FAILURE);
+        pthread_mutex_lock(&mp.lock);
     }
+    pthread_mutex_unlock(&mp.lock);
+    free(b);
+    return NULL;
+}
 
-    set_record_primary_fields(slow5_record, sp, len_raw_signal, raw_signal, mypos, channel, read_number);
-    set_record_aux_fields(slow5_record, sp, channel, read_number);
-
-    //write to file
-    if(slow5_write(slow5_record, sp) < 0){
-        ERROR("%s","Error writing record!");
-        exit(EXIT_FAILURE);
+void mapper_start(void){
+    if(opt->mmap_win == 0){
+        return;
     }
-    //free the slow5 record
-    slow5_rec_free(slow5_record);
-
-    free(raw_signal);
+    mp.on = 1;
+    int ret = pthread_create(&mp.thread, NULL, mapper, NULL);
+    NEG_CHK(ret);
+}
 
-    fclose(fp);
+//once every memory-mapped output of this process is closed
+void mapper_stop(void){
+    if(!mp.on){
+        return;
+    }
+    pthread_mutex_lock(&mp.lock);
+    mp.done = 1;
+    pthread_cond_signal(&mp.cond);
+    pthread_mutex_unlock(&mp.lock);
+    int ret = pthread_join(mp.thread, NULL);
+    NEG_CHK(ret);
+    mp.on = 0;
+    free(mp.q);
+    mp.q = NULL;
+    mp.n = mp.cap = 0;
+}
 
-    if(remove(path) != 0){
-        WARNING("Error deleting %s: %s", path, strerror(errno));
+//hand the current window to the mapper and map the next one. The next extent is asked for one window ahead, so the
+//writer only waits for preallocation when the mapper falls behind
+static void s5out_map_next(s5out_t *out){
+    double t0 = realtime();
+    if(out->map){
+        map_job(out, MAP_RETIRE, out->map, 0, 0);
+        out->map = NULL;
+        out->map_off += opt->mmap_win;
+        if(opt->fadvise > 0){
+            s5out_drop_behind(out, out->fd, out->map_off);
+        }
     }
+    while(out->map_off + 2*opt->mmap_win > out->alloc_req){
+        int64_t len = opt->mmap_win*MMAP_EXTENT_WINDOWS;
+        map_job(out, MAP_EXTEND, NULL, out->alloc_req, len);
+        out->alloc_req += len;
+    }
+    if(mp.on){
+        pthread_mutex_lock(&mp.lock);
+        while(out->map_off + opt->mmap_win > out->alloc){ //touching the mapping beyond the end of the file would fault
+            pthread_cond_wait(&mp.done_cond, &mp.lock);
+        }
+        pthread_mutex_unlock(&mp.lock);
+    }
+    out->map = (uint8_t *)mmap(NULL, opt->mmap_win, PROT_READ | PROT_WRITE, MAP_SHARED, out->fd, out->map_off);
+    if(out->map == MAP_FAILED){
+        ERROR("Error mapping output: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    out->windows++;
+    out->map_time += realtime() - t0;
 }
 
-static void islow5_close(chan_t *chan){
-    fclose(chan->fp);
+//copy into the mapping, across windows if needed. Readers see it through the page cache without a flush
+static void s5out_map_write(s5out_t *out, const void *buf, int64_t n){
+    const uint8_t *p = (const uint8_t *)buf;
+    while(n > 0){
+        int64_t room = out->map_off + opt->mmap_win - out->used;
+        if(room == 0){
+            s5out_map_next(out);
+            continue;
+        }
+        int64_t k = n < room ? n : room;
+        memcpy(out->map + (out->used - out->map_off), p, k);
+        out->used += k;
+        p += k;
+        n -= k;
+    }
 }
 
-static slow5_file_t *slow5_initialise(int mypos, int type){
-   //open the SLOW5 file for writing
+static void s5out_map_open(s5out_t *out){
     char path[4096];
-    sprintf(path, "%s/pos%d_%d.blow5", opt->dir, mypos,type);
-    slow5_file_t *sp = slow5_open(path, "w");
-    if(sp==NULL){
-        ERROR("%s","Error opening file!");
+    seg_path(path, out->mypos, out->type, 0, 0);
+    out->dir = out_dir(out->mypos);
+    out->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(out->fd < 0){
+        ERROR("Error opening %s: %s", path, strerror(errno));
         exit(EXIT_FAILURE);
     }
+    s5out_map_next(out);
+    size_t n = 0;
+    void *hdr = s5_hdr_mem(out->sp, &n);
+    s5out_map_write(out, hdr, n);
+    free(hdr);
+    __atomic_store_n(&out->segs->written, out->used, __ATOMIC_RELEASE);
+    dir_io(out->dir, n, 0);
+}
 
-    if(slow5_set_press(sp, SLOW5_COMPRESS_ZSTD, SLOW5_COMPRESS_SVB_ZD) < 0){
-        ERROR("%s","Error setting compression method!");
+//drop the unused part of the last extent and finish the file with the EOF marker
+static void s5out_map_close(s5out_t *out){
+    double t0 = realtime();
+    munmap(out->map, opt->mmap_win);
+    out->map = NULL;
+    pthread_mutex_lock(&mp.lock);
+    while(out->pending > 0){ //an extent landing after the truncation would extend the file again
+        pthread_cond_wait(&mp.done_cond, &mp.lock);
+    }
+    pthread_mutex_unlock(&mp.lock);
+    const char eof[] = SLOW5_BINARY_EOF;
+    if(ftruncate(out->fd, out->used) != 0 || pwrite(out->fd, eof, sizeof(eof), out->used) != (ssize_t)sizeof(eof)){
+        ERROR("Error finishing memory-mapped output: %s", strerror(errno));
         exit(EXIT_FAILURE);
     }
+    close(out->fd);
+    out->map_time += realtime() - t0;
+    dir_io(out->dir, sizeof(eof), 0);
+    fprintf(stderr,"[%s] pos %d stream %d: %ld records, %.2f MB, %d windows, %d extents, encode %.3f us/record, map %.3f s, background %.3f s\n", __func__, out->mypos, out->type,
+        out->nrec, (out->used + sizeof(eof))/(1024.0*1024.0), out->windows, out->extents, out->nrec ? out->encode_time*1e6/out->nrec : 0, out->map_time, out->bg_time);
+}
 
-    set_header_attributes(sp);
-    set_header_aux_fields(sp);
+//write a record, returns the number of bytes written
+static int s5out_write(s5out_t *out, slow5_rec_t *rec){
+    if(out->map){ //encode and copy into the mapped window, no stdio buffer in between
+        double t0 = realtime();
+        void *mem = NULL;
+        size_t bytes = 0;
+        if(slow5_encode(&mem, &bytes, rec, out->sp) < 0){
+            ERROR("%s","Error encoding record!");
+            exit(EXIT_FAILURE);
+        }
+        out->encode_time += realtime() - t0;
+        s5out_map_write(out, mem, bytes);
+        free(mem);
+        __atomic_store_n(&out->segs->written, out->used, __ATOMIC_RELEASE);
+        dir_io(out->dir, bytes, 0);
+        out->nrec++;
+        return (int)bytes;
+    }
+    if(out->rv){ //reserve a range in the shared file and write the encoded record into it
+        double t0 = realtime();
+        void *mem = NULL;
+        size_t bytes = 0;
+        if(slow5_encode(&mem, &bytes, rec, out->sp) < 0){
+            ERROR("%s","Error encoding record!");
+            exit(EXIT_FAILURE);
+        }
+        out->encode_time += realtime() - t0;
+        shared_t *sh = &shared[out->rv->file];
+        int64_t off = __atomic_fetch_add(&sh->off, (int64_t)bytes, __ATOMIC_RELAXED);
+        if(pwrite(sh->fd, mem, bytes, off) != (ssize_t)bytes){
+            ERROR("Error writing to %s: %s", sh->path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        free(mem);
+        resv_add(out->rv, off, bytes, rec->read_id);
+        dir_io(out->dir, bytes, 0);
+        out->nrec++;
+        return (int)bytes;
+    }
+    if(out->st == NULL){
+        int ret = slow5_write(rec, out->sp);
+        if(ret < 0){
+            ERROR("%s","Error writing record!");
+            exit(EXIT_FAILURE);
+        }
+        dir_io(out->dir, ret, 0);
+        out->nrec++;
+        out->seg_nrec++;
+        out->seg_samples += rec->len_raw_signal;
+        return ret;
+    }
 
-    if(slow5_hdr_write(sp) < 0){
-        ERROR("%s","Error writing header!");
+    double t0 = realtime();
+    void *mem = NULL;
+    size_t bytes = 0;
+    if(slow5_encode(&mem, &bytes, rec, out->sp) < 0){
+        ERROR("%s","Error encoding record!");
         exit(EXIT_FAILURE);
     }
+    out->encode_time += realtime() - t0;
+    stream_write(out->st, mem, bytes);
+    free(mem);
+    out->nrec++;
+    return (int)bytes;
+}
 
-    return sp;
+static void s5out_seg_open(s5out_t *out);
+static void s5out_seg_close(s5out_t *out, slow5_file_t *sp, int32_t seg, int64_t nrec, int dir);
+
+//the current segment has reached one of its limits
+static int s5out_seg_full(s5out_t *out){
+    if(opt->seg_time > 0 && realtime() - out->seg_t0 >= opt->seg_time) return 1;
+    if(opt->seg_reads > 0 && out->seg_nrec >= opt->seg_reads) return 1;
+    if(opt->seg_bytes > 0 && ftello(out->sp->fp) >= opt->seg_bytes) return 1;
+    return 0;
+}
+
+static void s5out_flush(s5out_t *out){
+    if(out->rv || out->map){ //pwrite and the mapping are already visible to readers
+        return;
+    }
+    if(out->st == NULL){
+        if(fflush(out->sp->fp) != 0){
+            ERROR("%s","Error flushing slow5 file!\n");
+            exit(EXIT_FAILURE);
+        }
+        if(opt->fadvise > 0){
+            s5out_drop_behind(out, fileno(out->sp->fp), ftello(out->sp->fp));
+        }
+        //segments only rotate on a flush, so that a flushed batch never straddles two segments
+        if(segmented() && s5out_seg_full(out)){
+            //the next segment exists before this one is marked closed, so the reader can always move on
+            slow5_file_t *sp = out->sp;
+            int32_t seg = out->seg;
+            int64_t nrec = out->seg_nrec;
+            int dir = out->dir;
+            if(opt->adapt_press){
+                s5out_press_account(out);
+                s5out_adapt(out);
+            }
+            out->seg++;
+            s5out_seg_open(out);
+            s5out_seg_close(out, sp, seg, nrec, dir);
+        }
+    } else {
+        stream_flush(out->st);
+    }
+}
+
+static void s5out_close(s5out_t *out){
+    if(out->st){
+        const char eof[] = SLOW5_BINARY_EOF;
+        stream_write(out->st, eof, sizeof(eof));
+        stream_t *st = out->st;
+        double mb = 1024.0*1024.0;
+        fprintf(stderr,"[%s] pos %d stream %d: %ld records, %.2f MB, encode %.3f us/record, send %.3f us/record, flush wait %.3f s\n", __func__, out->mypos, out->type,
+            out->nrec, st->bytes/mb, out->nrec ? out->encode_time*1e6/out->nrec : 0, out->nrec ? st->send_time*1e6/out->nrec : 0, st->flush_time);
+        stream_close(out->st);
+        slow5_close(out->sp);
+    } else if(out->map){
+        s5out_map_close(out);
+        slow5_close(out->sp);
+    } else if(out->rv){
+        slow5_close(out->sp);
+        int f = out->rv->file;
+        if(__atomic_sub_fetch(&shared[f].nopen, 1, __ATOMIC_ACQ_REL) == 0){
+            shared_close(f);
+        }
+    } else {
+        if(opt->adapt_press){
+            s5out_press_account(out);
+        }
+        s5out_seg_close(out, out->sp, out->seg, out->seg_nrec, out->dir);
+        if(opt->adapt_press){
+            s5out_press_report(out);
+        }
+    }
+    free(out->sig);
+    free(out);
+}
+
+//returns the number of bytes written
+static int slow5fy(s5out_t *out, uint64_t len_raw_signal, int16_t *raw_signal, int pos, int chan, int32_t read_number){
+    slow5_rec_t *slow5_record = slow5_rec_init();
+    if(slow5_record == NULL){
+        ERROR("%s","Could not allocate space for a slow5 record.");
+        exit(EXIT_FAILURE);
+    }
+
+    set_record_primary_fields(slow5_record, out->sp, len_raw_signal, raw_signal, pos, chan, read_number);
+    set_record_aux_fields(slow5_record, out->sp, chan, read_number);
+
+    //write to file
+    int ret = s5out_write(out, slow5_record);
+    //free the slow5 record
+    slow5_rec_free(slow5_record);
+    return ret;
+}
+
+static void islow5_path(char *path, int mypos, int32_t channel, int32_t index){
+    sprintf(path, "%s/pos%d/chan%d_%d.iblow5", opt->dirs[tmp_dir(mypos)], mypos, channel, index);
+}
+
+//LRU cache of the open intermediate files of a position, so that open descriptors stay under a cap
+//instead of growing with the channels that have a long read in flight. Only the aquisition thread uses it
+typedef struct{
+    int cap; //0 for no limit
+    int nopen;
+    int32_t head; //most recently used channel
+    int32_t tail; //least recently used channel
+    int32_t opened; //channel whose file was just created, its first chunk is neither a hit nor a miss
+    int64_t hits; //chunk writes to a file that was already open
+    int64_t misses; //chunk writes that had to reopen the file
+    int64_t evictions;
+    double reopen_time;
+} fdc_t;
+
+static void fdc_unlink(fdc_t *fdc, pos_t *pos, int32_t i){
+    chan_t *chan = pos->c[i];
+    if(chan->lru_prev >= 0) pos->c[chan->lru_prev]->lru_next = chan->lru_next;
+    else fdc->head = chan->lru_next;
+    if(chan->lru_next >= 0) pos->c[chan->lru_next]->lru_prev = chan->lru_prev;
+    else fdc->tail = chan->lru_prev;
+}
+
+static void fdc_push(fdc_t *fdc, pos_t *pos, int32_t i){
+    chan_t *chan = pos->c[i];
+    chan->lru_prev = -1;
+    chan->lru_next = fdc->head;
+    if(fdc->head >= 0) pos->c[fdc->head]->lru_prev = i;
+    fdc->head = i;
+    if(fdc->tail < 0) fdc->tail = i;
+}
+
+//close least recently used files until under the cap. The file just used is at the head and is never closed
+static void fdc_evict(fdc_t *fdc, pos_t *pos){
+    while(fdc->cap > 0 && fdc->nopen > fdc->cap){
+        int32_t t = fdc->tail;
+        fdc_unlink(fdc, pos, t);
+        fclose(pos->c[t]->fp);
+        pos->c[t]->fp = NULL;
+        fdc->nopen--;
+        fdc->evictions++;
+    }
+}
+
+static void islow5_open(fdc_t *fdc, pos_t *pos, int mypos, int32_t channel){
+    chan_t *chan = pos->c[channel];
+    char path[4096];
+    islow5_path(path, mypos, channel, chan->c_islow5);
+    chan->fp = fopen(path, "w");
+    F_CHK(chan->fp, path);
+    fdc->nopen++;
+    fdc->opened = channel;
+    fdc_push(fdc, pos, channel);
+    fdc_evict(fdc, pos);
+    if(fwrite(ISLOW5_MAGIC, 1, 7, chan->fp) != 7){
+        ERROR("Error in fwrite. %s",strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if(fwrite(&chan->read_number, sizeof(int32_t), 1, chan->fp) != 1){
+        ERROR("Error in fwrite. %s",strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void islow5_chunk_write(fdc_t *fdc, pos_t *pos, int mypos, int32_t channel, int64_t j){
+    int64_t tr = trace_begin();
+    chan_t *chan = pos->c[channel];
+    if(fdc->opened == channel){ //already at the head of the cache
+        fdc->opened = -1;
+    } else if(chan->fp){
+        fdc->hits++;
+        fdc_unlink(fdc, pos, channel);
+        fdc_push(fdc, pos, channel);
+    } else { //closed by the cache, carry on where it left off
+        double ts = realtime();
+        char path[4096];
+        islow5_path(path, mypos, channel, chan->c_islow5);
+        chan->fp = fopen(path, "a");
+        F_CHK(chan->fp, path);
+        fdc->reopen_time += realtime() - ts;
+        fdc->misses++;
+        fdc->nopen++;
+        fdc_push(fdc, pos, channel);
+        fdc_evict(fdc, pos);
+    }
+    if(fwrite(&j, sizeof(int64_t), 1, chan->fp) != 1){
+        ERROR("Error in fwrite. %s",strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if(fwrite(chan->raw_signal, sizeof(int16_t), j, chan->fp) != (size_t) j){
+        ERROR("Error in fwrite. %s",strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    trace_end(TR_ICHUNK, tr);
+}
+
+//after the end of read marker, so that the signal can be checked once it is reassembled
+static void islow5_sum_write(pos_t *pos, int32_t channel, uint64_t sum){
+    chan_t *chan = pos->c[channel];
+    if(fwrite(&sum, sizeof(uint64_t), 1, chan->fp) != 1){
+        ERROR("Error in fwrite. %s",strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void islow5_close(fdc_t *fdc, pos_t *pos, int32_t channel){
+    chan_t *chan = pos->c[channel];
+    if(chan->fp){
+        fdc_unlink(fdc, pos, channel);
+        fclose(chan->fp);
+        chan->fp = NULL;
+        fdc->nopen--;
+    }
+}
+
+//index a segment in its final directory and announce it in the manifest
+static void seg_finalise(int mypos, int type, int32_t seg, int64_t nrec){
+    char path[4096];
+    seg_path(path, mypos, type, seg, 0);
+    slow5_file_t *sp = slow5_open(path, "r");
+    if(sp==NULL){
+        ERROR("Error opening %s for indexing!", path);
+        exit(EXIT_FAILURE);
+    }
+    if(slow5_idx_create(sp) < 0){
+        ERROR("Error creating index for %s!", path);
+        exit(EXIT_FAILURE);
+    }
+    slow5_close(sp);
+
+    struct stat st = {0};
+    char idx[4200];
+    sprintf(idx, "%s.idx", path);
+    if(stat(idx, &st) == 0) dir_io(out_dir(mypos), st.st_size, 0);
+    if(stat(path, &st) != 0){
+        ERROR("Error accessing %s: %s", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_lock(&manifest_lock);
+    fprintf(manifest, "%s\t%d\t%d\t%d\t%ld\t%ld\t%.3f\n", path, mypos, type, seg, nrec, (int64_t)st.st_size, realtime());
+    fflush(manifest);
+    pthread_mutex_unlock(&manifest_lock);
+}
+
+//segments closed in their final directory are indexed and announced by a background thread of the process,
+//so that a rotation does not rescan the segment on the writer's thread
+typedef struct{
+    int mypos;
+    int type;
+    int32_t seg;
+    int64_t nrec;
+    double tq; //when it was queued
+} fin_item_t;
+
+static struct{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    fin_item_t *q;
+    int64_t n;
+    int64_t cap;
+    int on;
+    int done;
+    pthread_t thread;
+    double t0;
+    int64_t nfin;
+    double fin_time;
+    double wait_max; //longest time a closed segment waited to be announced
+} fin = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static void seg_queue(int mypos, int type, int32_t seg, int64_t nrec){
+    if(!fin.on){
+        seg_finalise(mypos, type, seg, nrec);
+        return;
+    }
+    pthread_mutex_lock(&fin.lock);
+    if(fin.n == fin.cap){
+        fin.cap = fin.cap ? fin.cap*2 : 64;
+        fin.q = (fin_item_t *)realloc(fin.q, fin.cap*sizeof(fin_item_t));
+        MALLOC_CHK(fin.q);
+    }
+    fin_item_t it = {mypos, type, seg, nrec, realtime()};
+    fin.q[fin.n++] = it;
+    pthread_cond_signal(&fin.cond);
+    pthread_mutex_unlock(&fin.lock);
+}
+
+static void *seg_finaliser(void *arg){
+    trace_thread("segment finaliser");
+    fin_item_t *b = NULL; //the items being finalised, swapped with the queue
+    int64_t bcap = 0;
+
+    pthread_mutex_lock(&fin.lock);
+    while(1){
+        while(fin.n == 0 && !fin.done){
+            pthread_cond_wait(&fin.cond, &fin.lock);
+        }
+        if(fin.n == 0){
+            break;
+        }
+        fin_item_t *q = fin.q;
+        int64_t qcap = fin.cap;
+        int64_t n = fin.n;
+        fin.q = b;
+        fin.cap = bcap;
+        fin.n = 0;
+        b = q;
+        bcap = qcap;
+        pthread_mutex_unlock(&fin.lock);
+
+        double wait = 0;
+        double t0 = realtime();
+        for(int64_t i=0; i<n; i++){
+            if(t0 - b[i].tq > wait) wait = t0 - b[i].tq;
+            seg_finalise(b[i].mypos, b[i].type, b[i].seg, b[i].nrec);
+        }
+        double t = realtime() - t0;
+
+        pthread_mutex_lock(&fin.lock);
+        fin.nfin += n;
+        fin.fin_time += t;
+        if(wait > fin.wait_max) fin.wait_max = wait;
+    }
+    pthread_mutex_unlock(&fin.lock);
+    free(b);
+    return NULL;
+}
+
+//segments are finalised in the background unless they go through the staging mover
+void seg_finaliser_start(void){
+    if(!segmented() || opt->stage_dir >= 0){
+        return;
+    }
+    fin.t0 = realtime();
+    fin.on = 1;
+    int ret = pthread_create(&fin.thread, NULL, seg_finaliser, NULL);
+    NEG_CHK(ret);
+}
+
+//once every writer of this process has closed its outputs
+void seg_finaliser_stop(void){
+    if(!fin.on){
+        return;
+    }
+    pthread_mutex_lock(&fin.lock);
+    fin.done = 1;
+    pthread_cond_signal(&fin.cond);
+    pthread_mutex_unlock(&fin.lock);
+    int ret = pthread_join(fin.thread, NULL);
+    NEG_CHK(ret);
+    fin.on = 0;
+    free(fin.q);
+    fin.q = NULL;
+    fin.n = fin.cap = 0;
+    fprintf(stderr,"[%.3f] segments: %ld indexed and announced in the background, %.3f ms each, longest wait %.3f s\n", realtime()-fin.t0,
+        fin.nfin, fin.nfin ? fin.fin_time*1e3/fin.nfin : 0, fin.wait_max);
+}
+
+//open the current segment of a local output and write the header
+static void s5out_seg_open(s5out_t *out){
+    int staged = opt->stage_dir >= 0;
+    char path[4096];
+    seg_path(path, out->mypos, out->type, out->seg, staged);
+    out->dir = staged ? opt->stage_dir : out_dir(out->mypos);
+
+    out->sp = slow5_open(path, "w");
+    out->dropped = out->kicked = 0;
+    slow5_file_t *sp = out->sp;
+    if(sp==NULL){
+        ERROR("%s","Error opening file!");
+        exit(EXIT_FAILURE);
+    }
+    if(slow5_set_press(sp, press_ladder[out->press][0], press_ladder[out->press][1]) < 0){
+        ERROR("%s","Error setting compression method!");
+        exit(EXIT_FAILURE);
+    }
+    set_header_attributes(sp);
+    set_header_aux_fields(sp);
+    if(slow5_hdr_write(sp) < 0){
+        ERROR("%s","Error writing header!");
+        exit(EXIT_FAILURE);
+    }
+    dir_io(out->dir, ftello(sp->fp), 0);
+
+    segs_t *segs = out->segs;
+    pthread_mutex_lock(&segs->lock);
+    if(segs->nseg == segs->cap){
+        segs->cap *= 2;
+        segs->nrec = (int64_t *)realloc(segs->nrec, segs->cap * sizeof(int64_t));
+        MALLOC_CHK(segs->nrec);
+        segs->tclose = (double *)realloc(segs->tclose, segs->cap * sizeof(double));
+        MALLOC_CHK(segs->tclose);
+        segs->staged = (int8_t *)realloc(segs->staged, segs->cap * sizeof(int8_t));
+        MALLOC_CHK(segs->staged);
+    }
+    segs->staged[out->seg] = staged;
+    segs->nseg++;
+    pthread_mutex_unlock(&segs->lock);
+
+    out->seg_nrec = 0;
+    out->seg_samples = 0;
+    out->seg_t0 = realtime();
+    out->press_segs[out->press]++;
+}
+
+//finalise the current segment (EOF marker) and make it visible to the reader and the mover
+static void s5out_seg_close(s5out_t *out, slow5_file_t *sp, int32_t seg, int64_t nrec, int dir){
+    if(slow5_close(sp) < 0){
+        ERROR("%s","Error closing slow5 file!");
+        exit(EXIT_FAILURE);
+    }
+    const char eof[] = SLOW5_BINARY_EOF;
+    dir_io(dir, sizeof(eof), 0);
+    if(segmented() && dir != opt->stage_dir){ //staged segments are finalised by the mover
+        seg_queue(out->mypos, out->type, seg, nrec);
+    }
+
+    segs_t *segs = out->segs;
+    pthread_mutex_lock(&segs->lock);
+    segs->nrec[seg] = nrec;
+    segs->tclose[seg] = realtime();
+    segs->nclosed++;
+    pthread_mutex_unlock(&segs->lock);
+}
+
+static s5out_t *slow5_initialise(pos_t *pos, int mypos, int type){
+    s5out_t *out = (s5out_t *)calloc(1, sizeof(s5out_t));
+    MALLOC_CHK(out);
+    out->mypos = mypos;
+    out->type = type;
+    out->segs = &pos->seg[type];
+    out->seg = 0;
+    out->press = PRESS_DEFAULT;
+    out->spare = (PRESS_UP + PRESS_DOWN)/2; //neutral until the writer has reported
+
+    if(!opt->sink && opt->shared == 0 && opt->mmap_win == 0){ //open the SLOW5 file for writing
+        s5out_seg_open(out);
+        return out;
+    }
+
+    out->sp = s5_encoder();
+    if(opt->mmap_win > 0){ //records are serialised here and copied into a mapping of the file
+        s5out_map_open(out);
+        return out;
+    }
+    if(opt->shared > 0){ //records are serialised here and written at reserved offsets in a shared file
+        out->rv = &pos->resv[type];
+        out->dir = shared[out->rv->file].dir;
+        return out;
+    }
+
+    //records are serialised here and the bytes are streamed to the receiver
+    char name[256];
+    sprintf(name, "pos%d_%d.blow5", mypos, type);
+    size_t n = 0;
+    void *hdr = s5_hdr_mem(out->sp, &n);
+    out->st = stream_connect(opt->sink);
+    stream_open(out->st, name);
+    stream_write(out->st, hdr, n);
+    free(hdr);
+
+    return out;
+}
+
+//reader side of an output, following it across segments and tiers
+typedef struct{
+    int mypos;
+    int type;
+    segs_t *segs;
+    int32_t seg; //segment being read
+    int64_t nread; //records read from this segment
+    slow5_file_t *sp;
+    int dir; //directory the segment is being read from
+    resv_t *rv; //record offsets when reading from a shared file, NULL otherwise
+    int64_t bytes; //record bytes consumed so far
+
+    //page-cache hints of the current file (opt->fadvise, opt->cold_read)
+    int64_t ra_end; //end of the range asked for with WILLNEED
+    int64_t dropped; //start of what may still be cached behind the reader
+    int64_t cold; //end of the range evicted before reading
+
+    int stale; //stdio may hold preallocated zeros read ahead of a memory-mapped writer (opt->mmap_win)
+} s5in_t;
+
+static void s5in_open(s5in_t *in){
+    char path[4096];
+    if(opt->sink){ //the receiver writes a single file per output
+        sprintf(path, "%s/pos%d_%d.blow5", opt->sink_dir, in->mypos, in->type);
+        in->sp = slow5_open(path, "r");
+        in->dir = -1;
+    } else if(in->rv){
+        shared_t *sh = &shared[in->rv->file];
+        strcpy(path, sh->path);
+        in->sp = slow5_open(path, "r");
+        in->dir = sh->dir;
+    } else {
+        for(int attempt=0; attempt<2; attempt++){ //the mover may migrate the segment between the check and the open
+            pthread_mutex_lock(&in->segs->lock);
+            int staged = in->segs->staged[in->seg];
+            pthread_mutex_unlock(&in->segs->lock);
+            seg_path(path, in->mypos, in->type, in->seg, staged);
+            in->dir = staged ? opt->stage_dir : out_dir(in->mypos);
+            in->sp = slow5_open(path, "r");
+            if(in->sp) break;
+        }
+    }
+    if(in->sp==NULL){
+        ERROR("Error opening file %s!", path);
+        exit(EXIT_FAILURE);
+    }
+    in->nread = 0;
+    in->ra_end = in->dropped = in->cold = 0;
+    in->stale = opt->mmap_win > 0; //the header was read with whatever followed it
+    if(opt->fadvise > 0){
+        posix_fadvise(fileno(in->sp->fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+}
+
+//page-cache hints before reading the record at the current offset
+static void s5in_hint(s5in_t *in){
+    FILE *fp = in->sp->fp;
+    int fd = fileno(fp);
+    int64_t off = ftello(fp);
+    struct stat st;
+    if(opt->cold_read && off >= in->cold && fstat(fd, &st) == 0){
+        //about to read what the writer added since the last eviction. Dirty pages cannot be dropped, so write them back first
+        if(fdatasync(fd) != 0){
+            WARNING("Error syncing pos %d stream %d before eviction: %s", in->mypos, in->type, strerror(errno));
+        }
+        posix_fadvise(fd, in->cold, 0, POSIX_FADV_DONTNEED);
+        in->cold = st.st_size;
+        fflush(fp); //stdio may hold data read ahead before the eviction
+    }
+    if(opt->fadvise <= 0){
+        return;
+    }
+    if(off + opt->fadvise/2 >= in->ra_end && fstat(fd, &st) == 0 && st.st_size > in->ra_end){
+        int64_t from = off > in->ra_end ? off : in->ra_end;
+        int64_t end = off + opt->fadvise < st.st_size ? off + opt->fadvise : st.st_size; //nothing to ask for past what has been written
+        posix_fadvise(fd, from, end - from, POSIX_FADV_WILLNEED);
+        in->ra_end = end;
+    }
+    int64_t to = page_floor(off);
+    if(!in->rv && to - in->dropped >= opt->fadvise/2){ //in a shared file, what is behind may be records of other outputs not read yet
+        posix_fadvise(fd, in->dropped, to - in->dropped, POSIX_FADV_DONTNEED);
+        in->dropped = to;
+    }
+}
+
+//the current segment is closed and all its records have been read
+static int s5in_seg_done(s5in_t *in){
+    if(opt->sink || in->rv) return 0;
+    pthread_mutex_lock(&in->segs->lock);
+    int done = in->seg < in->segs->nclosed && in->nread == in->segs->nrec[in->seg];
+    pthread_mutex_unlock(&in->segs->lock);
+    return done;
+}
+
+static void s5in_check_eof(s5in_t *in, slow5_rec_t **rec){
+    int ret = slow5_get_next(rec, in->sp);
+    if(ret != SLOW5_ERR_EOF){  //check if proper end of file has been reached
+        ERROR("EOF not properly reached. Return code %d\n",ret);
+        exit(EXIT_FAILURE);
+    }
+    slow5_close(in->sp);
+    in->sp = NULL;
+}
+
+//position the reader at the next record, moving on to the next segment if needed
+static void s5in_advance(s5in_t *in, slow5_rec_t **rec){
+    if(in->sp == NULL){
+        s5in_open(in);
+    }
+    if(s5in_seg_done(in)){ //move on to the next segment
+        s5in_check_eof(in, rec);
+        in->seg++;
+        s5in_open(in);
+    }
+    if(in->stale){ //the file runs on into preallocated zeros, which stdio has read ahead where records may have landed since
+        fflush(in->sp->fp); //drops buffered input of a seekable stream
+        in->stale = 0;
+    }
+    if(in->rv){ //records of other outputs are interleaved in a shared file
+        pthread_mutex_lock(&in->rv->lock);
+        int64_t roff = in->rv->off[in->nread];
+        pthread_mutex_unlock(&in->rv->lock);
+        if(fseeko(in->sp->fp, roff, SEEK_SET) != 0){
+            ERROR("Error seeking in shared file: %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    if(opt->fadvise > 0 || opt->cold_read){
+        s5in_hint(in);
+    }
+}
+
+//whether the read just done filled the stdio buffer beyond what the memory-mapped writer had written before it
+static void s5in_note_ahead(s5in_t *in, int64_t written){
+    in->stale = lseek(fileno(in->sp->fp), 0, SEEK_CUR) > written;
+}
+
+static int s5in_next(s5in_t *in, slow5_rec_t **rec){
+    s5in_advance(in, rec);
+    int64_t written = opt->mmap_win > 0 ? __atomic_load_n(&in->segs->written, __ATOMIC_ACQUIRE) : 0;
+    off_t off = ftello(in->sp->fp);
+    int ret = slow5_get_next(rec, in->sp);
+    if(opt->mmap_win > 0){
+        s5in_note_ahead(in, written);
+    }
+    in->bytes += ftello(in->sp->fp) - off;
+    if(in->dir >= 0){
+        dir_io(in->dir, 0, ftello(in->sp->fp) - off);
+    }
+    in->nread++;
+    return ret;
+}
+
+//the next record was taken from the ring, step over it in the file without reading it
+static void s5in_skip(s5in_t *in, slow5_rec_t **rec, int64_t file_bytes){
+    s5in_advance(in, rec);
+    in->bytes += file_bytes;
+    int64_t written = opt->mmap_win > 0 ? __atomic_load_n(&in->segs->written, __ATOMIC_ACQUIRE) : 0;
+    if(!in->rv && fseeko(in->sp->fp, file_bytes, SEEK_CUR) != 0){
+        ERROR("Error seeking in slow5 file: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if(opt->mmap_win > 0){
+        s5in_note_ahead(in, written);
+    }
+    in->nread++;
+}
+
+//after everything has been read, every remaining segment must be at a proper EOF
+static void s5in_close(s5in_t *in, slow5_rec_t **rec){
+    if(in->rv){ //the EOF marker of a shared file comes after every output, checked by nobody in particular
+        if(in->sp) slow5_close(in->sp);
+        in->sp = NULL;
+        return;
+    }
+    if(in->sp == NULL){
+        s5in_open(in);
+    }
+    s5in_check_eof(in, rec);
+    if(opt->sink) return;
+    while(in->seg+1 < in->segs->nclosed){ //trailing segments without records
+        in->seg++;
+        s5in_open(in);
+        s5in_check_eof(in, rec);
+    }
+}
+
+//BLOW5 as an output backend, on top of s5out and s5in
+static void *blow5_open(const wloc_t *loc){
+    return slow5_initialise(loc->pos, loc->mypos, loc->type);
+}
+
+static void blow5_append_chunk(void *p, const int16_t *samples, int64_t n){
+    s5out_t *out = (s5out_t *)p;
+    if(out->sig_n + n > out->sig_cap){
+        out->sig_cap = (out->sig_n + n)*2;
+        out->sig = (int16_t *)realloc(out->sig, out->sig_cap*sizeof(int16_t));
+        MALLOC_CHK(out->sig);
+    }
+    memcpy(out->sig + out->sig_n, samples, n*sizeof(int16_t));
+    out->sig_n += n;
+}
+
+//a record holds the whole signal, so a read that comes in chunks is assembled first
+static int64_t blow5_append_read(void *p, const wmeta_t *m, const int16_t *samples, int64_t n){
+    s5out_t *out = (s5out_t *)p;
+    if(out->sig_n == 0){
+        return slow5fy(out, n, (int16_t *)samples, out->mypos, m->chan, m->read_number);
+    }
+    blow5_append_chunk(out, samples, n);
+    int ret = slow5fy(out, out->sig_n, out->sig, out->mypos, m->chan, m->read_number);
+    out->sig_n = 0;
+    return ret;
+}
+
+static void blow5_flush(void *p){
+    s5out_flush((s5out_t *)p);
+}
+
+static void blow5_close(void *p){
+    s5out_close((s5out_t *)p);
+}
+
+static void blow5_spare(void *p, double spare){
+    s5out_spare((s5out_t *)p, spare);
+}
+
+typedef struct{
+    s5in_t in;
+    slow5_rec_t *rec;
+} blow5_in_t;
+
+static void *blow5_ropen(const wloc_t *loc){
+    blow5_in_t *r = (blow5_in_t *)calloc(1, sizeof(blow5_in_t));
+    MALLOC_CHK(r);
+    //when streaming, read back from where the receiver writes
+    s5in_t in = {loc->mypos, loc->type, &loc->pos->seg[loc->type], 0, 0, NULL, -1, opt->shared ? &loc->pos->resv[loc->type] : NULL, 0, 0, 0, 0};
+    r->in = in;
+    return r;
+}
+
+static int64_t blow5_rnext(void *p, const int16_t **samples, int64_t *n){
+    blow5_in_t *r = (blow5_in_t *)p;
+    int64_t bytes = r->in.bytes;
+    if(s5in_next(&r->in, &r->rec) < 0){
+        return -1;
+    }
+    *samples = r->rec->raw_signal;
+    *n = r->rec->len_raw_signal;
+    return r->in.bytes - bytes;
+}
+
+static void blow5_rskip(void *p, int64_t file_bytes){
+    blow5_in_t *r = (blow5_in_t *)p;
+    s5in_skip(&r->in, &r->rec, file_bytes);
+}
+
+static void blow5_rclose(void *p){
+    blow5_in_t *r = (blow5_in_t *)p;
+    s5in_close(&r->in, &r->rec);
+    slow5_rec_free(r->rec);
+    free(r);
+}
+
+static const writer_ops_t blow5_writer = {
+    "blow5", 1,
+    blow5_open, blow5_append_chunk, blow5_append_read, blow5_flush, blow5_close, blow5_spare,
+    blow5_ropen, blow5_rnext, blow5_rskip, blow5_rclose,
+};
+
+//indexed by opt->format
+static const writer_ops_t *formats[] = {&blow5_writer, &raw_writer, &col_writer};
+
+static void out_loc(wloc_t *loc, pos_t *pos, int mypos, int type){
+    loc->pos = pos;
+    loc->mypos = mypos;
+    loc->type = type;
+    loc->dir = out_dir(mypos);
+    sprintf(loc->path, "%s/pos%d_%d", opt->dirs[loc->dir], mypos, type);
+}
+
+//an output stream of a position, written through the backend chosen with --format
+typedef struct{
+    const writer_ops_t *ops;
+    void *w; //backend state
+    pos_t *pos;
+    int mypos;
+    int type;
+    ring_t *ring; //completed reads for the read-back consumer, NULL if not enabled
+    int64_t nrec;
+    int64_t bytes; //record bytes written so far
+    int64_t samples; //signal samples written so far
+    int16_t *sig; //chunks of the read being appended, kept only for the ring
+    int64_t sig_n;
+    int64_t sig_cap;
+} out_t;
+
+static out_t *out_open(pos_t *pos, int mypos, int type){
+    out_t *out = (out_t *)calloc(1, sizeof(out_t));
+    MALLOC_CHK(out);
+    out->ops = formats[opt->format];
+    out->pos = pos;
+    out->mypos = mypos;
+    out->type = type;
+    out->ring = pos->ring[type];
+    wloc_t loc;
+    out_loc(&loc, pos, mypos, type);
+    out->w = out->ops->open(&loc);
+    return out;
+}
+
+static void out_keep(out_t *out, const int16_t *samples, int64_t n){
+    if(out->ring){
+        if(out->sig_n + n > out->sig_cap){
+            out->sig_cap = (out->sig_n + n)*2;
+            out->sig = (int16_t *)realloc(out->sig, out->sig_cap*sizeof(int16_t));
+            MALLOC_CHK(out->sig);
+        }
+        memcpy(out->sig + out->sig_n, samples, n*sizeof(int16_t));
+    }
+    out->sig_n += n;
+}
+
+static void out_append_chunk(out_t *out, const int16_t *samples, int64_t n){
+    out_keep(out, samples, n);
+    if(out->ring && out->ops->assembles){ //kept for the ring, the backend gets the read whole
+        return;
+    }
+    out->ops->append_chunk(out->w, samples, n);
+}
+
+//complete a read (any chunks appended so far followed by samples), note its checksum and hand it to the
+//read-back consumer through the shared-memory ring. sum is the checksum taken at aquisition. Returns the bytes written
+static int64_t out_append_read(out_t *out, const wmeta_t *m, const int16_t *samples, int64_t n, uint64_t sum){
+    int whole = out->ring && out->ops->assembles && out->sig_n > 0; //the chunks are only in out->sig
+    int64_t bytes = whole ? 0 : out->ops->append_read(out->w, m, samples, n);
+    const int16_t *sig = samples;
+    if(out->sig_n > 0){
+        out_keep(out, samples, n);
+        sig = out->sig;
+        n = out->sig_n;
+        out->sig_n = 0;
+    }
+    if(whole){
+        bytes = out->ops->append_read(out->w, m, sig, n);
+    }
+    out->bytes += bytes;
+    out->samples += n;
+    if(opt->checksum && !(opt->sink && opt->sink_dir == NULL)){ //taken by the read-back, if there is one
+        sums_add(&out->pos->sums[out->type], sum);
+    }
+    if(out->ring){
+        ring_put(out->ring, out->nrec, sig, n, bytes);
+    }
+    out->nrec++;
+    return bytes;
+}
+
+static void out_flush(out_t *out){
+    double t0 = realtime();
+    int64_t tr = trace_begin();
+    out->ops->flush(out->w);
+    trace_end(TR_FLUSH, tr);
+    out->pos->flush_time[out->type] += realtime() - t0;
+    out->pos->flushes[out->type]++;
+}
+
+//passed on to backends that adapt to it
+static void out_spare(out_t *out, double spare){
+    if(out->ops->spare){
+        out->ops->spare(out->w, spare);
+    }
+}
+
+static void out_close(out_t *out){
+    out->ops->close(out->w);
+    fprintf(stderr,"[%s] pos %d stream %d: %s %ld records, %.2f MB, %.3f bytes/sample\n", __func__, out->mypos, out->type, out->ops->name,
+        out->nrec, out->bytes/(1024.0*1024.0), out->samples ? (double)out->bytes/out->samples : 0);
+    free(out->sig);
+    free(out);
+}
+
+//reader side of an output, for the read-back
+typedef struct{
+    const writer_ops_t *ops;
+    void *r; //backend state
+    int64_t ntotal; //records consumed so far, from the file or the ring
+    int64_t bytes; //record bytes consumed so far
+} in_t;
+
+static void in_open(in_t *in, pos_t *pos, int mypos, int type){
+    wloc_t loc;
+    out_loc(&loc, pos, mypos, type);
+    in->ops = formats[opt->format];
+    in->r = in->ops->ropen(&loc);
+    in->ntotal = 0;
+    in->bytes = 0;
+}
+
+static int in_next(in_t *in, const int16_t **samples, int64_t *n){
+    int64_t tr = trace_begin();
+    int64_t bytes = in->ops->rnext(in->r, samples, n);
+    trace_end(TR_GETNEXT, tr);
+    if(bytes < 0){
+        return -1;
+    }
+    in->bytes += bytes;
+    in->ntotal++;
+    return 0;
+}
+
+//the next record was taken from the ring, step over it in the output without reading it
+static void in_skip(in_t *in, int64_t file_bytes){
+    in->ops->rskip(in->r, file_bytes);
+    in->bytes += file_bytes;
+    in->ntotal++;
+}
+
+static void in_close(in_t *in){
+    in->ops->rclose(in->r);
+}
+
+//intermediate files that have been converted are deleted here. With opt->reclaim_batch, the conversion threads
+//of this process only queue them and a single thread unlinks them in batches, so that conversion does not wait
+//on directory updates. Either way the latency of every unlink is recorded
+typedef struct{
+    char *path;
+    int dir; //directory to credit the freed bytes to (-1 for none)
+    int64_t size;
+    double tq; //when it was queued
+} rc_item_t;
+
+static struct{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    rc_item_t *q;
+    int64_t n;
+    int64_t cap;
+    int done;
+    pthread_t thread;
+    double t0;
+
+    int64_t nunlink;
+    double unlink_time;
+    double unlink_max;
+    int64_t batches;
+    int64_t peak; //most files queued at once
+    double wait_max; //longest time a file waited in the queue
+} rc = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static void rc_unlink(const char *path, int dir, int64_t size){
+    int64_t tr = trace_begin();
+    double ts = realtime();
+    int ret = remove(path);
+    double t = realtime() - ts;
+    trace_end(TR_UNLINK, tr);
+    if(ret != 0){
+        WARNING("Error deleting %s: %s", path, strerror(errno));
+    } else if(dir >= 0){
+        dir_release(dir, size);
+    }
+    pthread_mutex_lock(&rc.lock);
+    rc.nunlink++;
+    rc.unlink_time += t;
+    if(t > rc.unlink_max) rc.unlink_max = t;
+    pthread_mutex_unlock(&rc.lock);
+}
+
+//delete path (a file, or a directory once the files queued before it are gone)
+static void reclaim(const char *path, int dir, int64_t size){
+    if(opt->reclaim_batch <= 0){
+        rc_unlink(path, dir, size);
+        return;
+    }
+    char *p = strdup(path);
+    MALLOC_CHK(p);
+    pthread_mutex_lock(&rc.lock);
+    if(rc.n == rc.cap){
+        rc.cap = rc.cap ? rc.cap*2 : 1024;
+        rc.q = (rc_item_t *)realloc(rc.q, rc.cap*sizeof(rc_item_t));
+        MALLOC_CHK(rc.q);
+    }
+    rc_item_t it = {p, dir, size, realtime()};
+    rc.q[rc.n++] = it;
+    if(rc.n > rc.peak) rc.peak = rc.n;
+    if(rc.n >= opt->reclaim_batch) pthread_cond_signal(&rc.cond);
+    pthread_mutex_unlock(&rc.lock);
+}
+
+//unlinks a batch once opt->reclaim_batch files are queued, or whatever is queued every chunk period
+static void *reclaimer(void *arg){
+    trace_thread("reclaimer");
+    rc_item_t *b = NULL; //the batch being unlinked, swapped with the queue
+    int64_t bcap = 0;
+
+    pthread_mutex_lock(&rc.lock);
+    while(1){
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        int64_t ns = ts.tv_nsec + (int64_t)(opt->ct*1e9);
+        ts.tv_sec += ns / 1000000000;
+        ts.tv_nsec = ns % 1000000000;
+        while(rc.n < opt->reclaim_batch && !rc.done){
+            if(pthread_cond_timedwait(&rc.cond, &rc.lock, &ts) == ETIMEDOUT) break;
+        }
+        if(rc.n == 0){
+            if(rc.done) break;
+            continue;
+        }
+
+        rc_item_t *q = rc.q;
+        int64_t qcap = rc.cap;
+        int64_t n = rc.n;
+        rc.q = b;
+        rc.cap = bcap;
+        rc.n = 0;
+        b = q;
+        bcap = qcap;
+        rc.batches++;
+        pthread_mutex_unlock(&rc.lock);
+
+        double now = realtime();
+        double wait = 0;
+        for(int64_t i=0; i<n; i++){ //in order, a directory is queued after its files
+            if(now - b[i].tq > wait) wait = now - b[i].tq;
+            rc_unlink(b[i].path, b[i].dir, b[i].size);
+            free(b[i].path);
+        }
+
+        pthread_mutex_lock(&rc.lock);
+        if(wait > rc.wait_max) rc.wait_max = wait;
+    }
+    pthread_mutex_unlock(&rc.lock);
+    free(b);
+    return NULL;
+}
+
+void reclaim_start(void){
+    rc.t0 = realtime();
+    if(opt->reclaim_batch > 0){
+        int ret = pthread_create(&rc.thread, NULL, reclaimer, NULL);
+        NEG_CHK(ret);
+    }
+}
+
+//once every conversion thread of this process is done
+void reclaim_stop(void){
+    if(opt->reclaim_batch > 0){
+        pthread_mutex_lock(&rc.lock);
+        rc.done = 1;
+        pthread_cond_signal(&rc.cond);
+        pthread_mutex_unlock(&rc.lock);
+        int ret = pthread_join(rc.thread, NULL);
+        NEG_CHK(ret);
+        free(rc.q);
+        rc.q = NULL;
+        rc.n = rc.cap = 0;
+    }
+    if(rc.nunlink == 0){
+        return;
+    }
+    fprintf(stderr,"[%.3f] reclaim: %ld unlinks, latency mean %.3f us, max %.3f us", realtime()-rc.t0,
+        rc.nunlink, rc.unlink_time*1e6/rc.nunlink, rc.unlink_max*1e6);
+    if(opt->reclaim_batch > 0){
+        fprintf(stderr,", %ld batches, peak queue %ld, longest wait %.3f s", rc.batches, rc.peak, rc.wait_max);
+    }
+    fprintf(stderr,"\n");
+}
+
+//convert an intermediate file into a record of the output, handing it over a chunk at a time
+static void islow5_to_slow5(out_t *out, int mypos, int32_t channel, int32_t index){
+    int64_t tr = trace_begin();
+    char path[4096];
+    islow5_path(path, mypos, channel, index);
+    FILE *fp = fopen(path, "r");
+    F_CHK(fp, path);
+    char magic[7];
+    if(fread(magic, 1, 7, fp) != 7){
+        ERROR("Error reading magic number from %s. %s", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if(strncmp(magic, ISLOW5_MAGIC, 7) != 0){
+        ERROR("Error: %s is not an islow5 file", path);
+        exit(EXIT_FAILURE);
+    }
+    int32_t read_number;
+    if(fread(&read_number, sizeof(int32_t), 1, fp) != 1){
+        ERROR("Error read read_number from %s. %s", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    int64_t cap = opt->cz;
+    int16_t *chunk = (int16_t *)malloc(sizeof(int16_t) * cap);
+    MALLOC_CHK(chunk);
+    uint64_t len_raw_signal = 0;
+    int64_t j;
+    uint64_t sum = 0;
+    xxh64_t h;
+    xxh64_reset(&h, 0);
+
+    while(1){
+
+        if(fread(&j, sizeof(int64_t), 1, fp) != 1){ //only complete reads are converted, so the marker must be there
+            ERROR("Truncated intermediate file %s (read %d): %s after %ld samples, no end of read marker", path, read_number,
+                ferror(fp) ? strerror(errno) : "end of file", len_raw_signal);
+            exit(EXIT_FAILURE);
+        }
+        if(j == ISLOW5_END){ //end of read, followed by the checksum
+            if(fread(&sum, sizeof(uint64_t), 1, fp) != 1){
+                ERROR("Error reading the checksum from %s. %s", path, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            break;
+        }
+        if(j > cap){
+            cap = j;
+            chunk = (int16_t *)realloc(chunk, cap*sizeof(int16_t));
+            MALLOC_CHK(chunk);
+        }
+        if(fread(chunk, sizeof(int16_t), j, fp) != (size_t) j){
+            ERROR("Truncated intermediate file %s (read %d): %s in a chunk of %ld samples after %ld samples", path, read_number,
+                ferror(fp) ? strerror(errno) : "end of file", j, len_raw_signal);
+            exit(EXIT_FAILURE);
+        }
+        if(opt->checksum){
+            xxh64_update(&h, chunk, j*sizeof(int16_t));
+        }
+        out_append_chunk(out, chunk, j);
+        len_raw_signal += j;
+    }
+
+    if(opt->checksum && xxh64_digest(&h) != sum){ //the intermediate file did not hold what was written
+        ERROR("pos %d: checksum mismatch in %s (read %d, %ld samples)", mypos, path, read_number, len_raw_signal);
+        __atomic_fetch_add(&out->pos->sum_bad, 1, __ATOMIC_RELAXED);
+    }
+
+    wmeta_t m = {channel, read_number};
+    out_append_read(out, &m, NULL, 0, sum);
+    free(chunk);
+
+    off_t size = ftello(fp);
+    dir_io(tmp_dir(mypos), 0, size);
+    fclose(fp);
+
+    reclaim(path, tmp_dir(mypos), size);
+    trace_end(TR_CONV, tr);
+}
+
+//copies closed segments from the staging tier to their final directory and frees the staging space
+void *stage_mover(void *ptarg){
+    prom_t *prom = (prom_t *)ptarg;
+    double realtime0 = realtime();
+    VERBOSE("%s","Hi from the staging mover");
+
+    int32_t nmoved = 0;
+    int64_t moved_bytes = 0;
+    double copy_time = 0;
+    double max_wait = 0; //longest time a closed segment waited on the staging tier
+    int64_t peak_backlog = 0; //most bytes waiting to be migrated at once
+
+    struct timespec dl;
+    deadline_init(&dl);
+
+    while(1){
+        deadline_add(&dl, opt->ct);
+        int all_done = 1;
+        int64_t backlog = 0;
+
+        for(int i=0; i<prom->npos; i++){
+            pos_t *pos = prom->pos[i];
+            if(!(pos->aq_done && pos->s_done)) all_done = 0;
+            for(int t=0; t<2; t++){
+                segs_t *segs = &pos->seg[t];
+                pthread_mutex_lock(&segs->lock);
+                int32_t nclosed = segs->nclosed;
+                pthread_mutex_unlock(&segs->lock);
+                for(int32_t k=segs->nmigrated; k<nclosed; k++){
+                    char src[4096], dst[4096], tmp[4200];
+                    seg_path(src, i, t, k, 1);
+                    seg_path(dst, i, t, k, 0);
+                    sprintf(tmp, "%s.tmp", dst); //readers never see a partial copy
+                    struct stat st = {0};
+                    if(stat(src, &st) == 0) backlog += st.st_size;
+
+                    double ts = realtime();
+                    int64_t n = copy_file(src, tmp);
+                    if(n < 0 || rename(tmp, dst) != 0){
+                        ERROR("Error migrating %s to %s: %s", src, dst, strerror(errno));
+                        exit(EXIT_FAILURE);
+                    }
+                    copy_time += realtime() - ts;
+
+                    pthread_mutex_lock(&segs->lock);
+                    segs->staged[k] = 0;
+                    double wait = realtime() - segs->tclose[k];
+                    int64_t nrec = segs->nrec[k];
+                    pthread_mutex_unlock(&segs->lock);
+                    seg_finalise(i, t, k, nrec);
+                    if(remove(src) != 0){ //a reader that still has it open keeps reading from the unlinked file
+                        WARNING("Error deleting %s: %s", src, strerror(errno));
+                    }
+                    dir_io(opt->stage_dir, 0, n);
+                    dir_io(out_dir(i), n, 0);
+                    dir_release(opt->stage_dir, n);
+                    segs->nmigrated = k+1;
+
+                    nmoved++;
+                    moved_bytes += n;
+                    if(wait > max_wait) max_wait = wait;
+                    LOG_DEBUG("migrated %s (%ld bytes) after %.3f s", src, n, wait);
+                }
+            }
+        }
+        if(backlog > peak_backlog) peak_backlog = backlog;
+
+        if(all_done){ //every output is closed and has been migrated in this pass
+            break;
+        }
+        if(deadline_slack(&dl) < 0){
+            WARNING("[%.3f] staging mover is lagging", realtime()-realtime0);
+        } else {
+            sleep_until(&dl);
+        }
+    }
+
+    double mb = 1024.0*1024.0;
+    fprintf(stderr,"[%.3f] staging: migrated %d segments (%.2f MB) at %.2f MB/s, peak backlog %.2f MB, longest wait %.3f s, peak staging usage %.2f MB\n",
+        realtime()-realtime0, nmoved, moved_bytes/mb, copy_time > 0 ? moved_bytes/mb/copy_time : 0, peak_backlog/mb, max_wait, dir_peak[opt->stage_dir]/mb);
+
+    pthread_exit(0);
+}
+
+static volatile int exporter_done = 0;
+
+//counters of every position and directory in the Prometheus text format. Only reads counters that
+//their owning threads update anyway, so the exporter never makes a writer wait
+static void exporter_write(prom_t *prom, const char *path, double uptime){
+    char tmp[4200];
+    sprintf(tmp, "%s.tmp", path); //scrapers never see a partial file
+    FILE *fp = fopen(tmp, "w");
+    if(fp == NULL){
+        WARNING("Could not open %s: %s", tmp, strerror(errno));
+        return;
+    }
+    static const char *thread_name[] = {"aq", "conv", "readback"};
+    static const char *out_name[] = {"direct", "converted"};
+
+    fprintf(fp, "# HELP slowion_uptime_seconds Time since the run started.\n# TYPE slowion_uptime_seconds gauge\n");
+    fprintf(fp, "slowion_uptime_seconds %.3f\n", uptime);
+    fprintf(fp, "# HELP slowion_reads_written_total Reads written to BLOW5.\n# TYPE slowion_reads_written_total counter\n");
+    for(int i=0; i<prom->npos; i++){
+        fprintf(fp, "slowion_reads_written_total{pos=\"%d\",output=\"direct\"} %ld\n", i, prom->pos[i]->c_direct);
+        fprintf(fp, "slowion_reads_written_total{pos=\"%d\",output=\"converted\"} %ld\n", i, prom->pos[i]->c_s);
+    }
+    fprintf(fp, "# HELP slowion_intermediate_reads_total Reads completed in intermediate files.\n# TYPE slowion_intermediate_reads_total counter\n");
+    for(int i=0; i<prom->npos; i++){
+        fprintf(fp, "slowion_intermediate_reads_total{pos=\"%d\"} %ld\n", i, prom->pos[i]->c_islow5);
+    }
+    fprintf(fp, "# HELP slowion_reads_read_back_total Reads read back by the pseudobasecaller.\n# TYPE slowion_reads_read_back_total counter\n");
+    for(int i=0; i<prom->npos; i++){
+        fprintf(fp, "slowion_reads_read_back_total{pos=\"%d\",output=\"direct\"} %ld\n", i, prom->pos[i]->c_bd);
+        fprintf(fp, "slowion_reads_read_back_total{pos=\"%d\",output=\"converted\"} %ld\n", i, prom->pos[i]->c_bs);
+    }
+    fprintf(fp, "# HELP slowion_samples_total Signal samples sequenced.\n# TYPE slowion_samples_total counter\n");
+    for(int i=0; i<prom->npos; i++){
+        fprintf(fp, "slowion_samples_total{pos=\"%d\"} %ld\n", i, prom->pos[i]->total_samples);
+    }
+    fprintf(fp, "# HELP slowion_aquisition_written_bytes_total Bytes written by the aquisition thread.\n# TYPE slowion_aquisition_written_bytes_total counter\n");
+    for(int i=0; i<prom->npos; i++){
+        fprintf(fp, "slowion_aquisition_written_bytes_total{pos=\"%d\"} %ld\n", i, prom->pos[i]->bw.total);
+    }
+    fprintf(fp, "# HELP slowion_flush_seconds_total Time spent flushing BLOW5 output.\n# TYPE slowion_flush_seconds_total counter\n");
+    for(int i=0; i<prom->npos; i++){
+        for(int t=0; t<2; t++){
+            fprintf(fp, "slowion_flush_seconds_total{pos=\"%d\",output=\"%s\"} %.6f\n", i, out_name[t], prom->pos[i]->flush_time[t]);
+        }
+    }
+    fprintf(fp, "# HELP slowion_flushes_total BLOW5 output flushes.\n# TYPE slowion_flushes_total counter\n");
+    for(int i=0; i<prom->npos; i++){
+        for(int t=0; t<2; t++){
+            fprintf(fp, "slowion_flushes_total{pos=\"%d\",output=\"%s\"} %ld\n", i, out_name[t], prom->pos[i]->flushes[t]);
+        }
+    }
+    fprintf(fp, "# HELP slowion_lagging_iterations_total Iterations that missed their deadline.\n# TYPE slowion_lagging_iterations_total counter\n");
+    for(int i=0; i<prom->npos; i++){
+        for(int t=0; t<3; t++){
+            fprintf(fp, "slowion_lagging_iterations_total{pos=\"%d\",thread=\"%s\"} %ld\n", i, thread_name[t], prom->pos[i]->lags[t]);
+        }
+    }
+    fprintf(fp, "# HELP slowion_max_lag_seconds Worst deadline overrun so far.\n# TYPE slowion_max_lag_seconds gauge\n");
+    for(int i=0; i<prom->npos; i++){
+        for(int t=0; t<3; t++){
+            fprintf(fp, "slowion_max_lag_seconds{pos=\"%d\",thread=\"%s\"} %.6f\n", i, thread_name[t], prom->pos[i]->max_lag[t]);
+        }
+    }
+    fprintf(fp, "# HELP slowion_backpressure_level Backpressure level (0 normal, 1 batch, 2 defer).\n# TYPE slowion_backpressure_level gauge\n");
+    for(int i=0; i<prom->npos; i++){
+        fprintf(fp, "slowion_backpressure_level{pos=\"%d\"} %d\n", i, prom->pos[i]->bp_level);
+    }
+    fprintf(fp, "# HELP slowion_dir_written_bytes_total Bytes written to an output directory.\n# TYPE slowion_dir_written_bytes_total counter\n");
+    for(int d=0; d<opt->ndir; d++){
+        fprintf(fp, "slowion_dir_written_bytes_total{dir=\"%s\"} %ld\n", opt->dirs[d], __atomic_load_n(&dir_wbytes[d], __ATOMIC_RELAXED));
+    }
+    fprintf(fp, "# HELP slowion_dir_read_bytes_total Bytes read from an output directory.\n# TYPE slowion_dir_read_bytes_total counter\n");
+    for(int d=0; d<opt->ndir; d++){
+        fprintf(fp, "slowion_dir_read_bytes_total{dir=\"%s\"} %ld\n", opt->dirs[d], __atomic_load_n(&dir_rbytes[d], __ATOMIC_RELAXED));
+    }
+    fprintf(fp, "# HELP slowion_dir_used_bytes Bytes currently held in an output directory.\n# TYPE slowion_dir_used_bytes gauge\n");
+    for(int d=0; d<opt->ndir; d++){
+        fprintf(fp, "slowion_dir_used_bytes{dir=\"%s\"} %ld\n", opt->dirs[d], __atomic_load_n(&dir_used[d], __ATOMIC_RELAXED));
+    }
+
+    if(fclose(fp) != 0 || rename(tmp, path) != 0){
+        WARNING("Could not write %s: %s", path, strerror(errno));
+    }
+}
+
+//rewrites opt->prometheus every opt->prometheus_interval seconds until exporter_stop
+void *exporter(void *ptarg){
+    prom_t *prom = (prom_t *)ptarg;
+    double realtime0 = realtime();
+    VERBOSE("Hi from the metrics exporter, writing %s", opt->prometheus);
+
+    int64_t nwrite = 0;
+    struct timespec dl;
+    deadline_init(&dl);
+    while(!exporter_done){
+        exporter_write(prom, opt->prometheus, realtime()-realtime0);
+        nwrite++;
+        deadline_add(&dl, opt->prometheus_interval);
+        while(!exporter_done && deadline_slack(&dl) > 0){ //wake up regularly so that stopping is quick
+            struct timespec ts = {0, 100*1000*1000};
+            nanosleep(&ts, NULL);
+        }
+    }
+    exporter_write(prom, opt->prometheus, realtime()-realtime0); //final values
+    nwrite++;
+    LOG_DEBUG("metrics exporter wrote %s %ld times", opt->prometheus, nwrite);
+
+    pthread_exit(0);
+}
+
+void exporter_stop(void){
+    exporter_done = 1;
+}
+
+//bw->bytes and bw->n are set up in init_prom, before any worker process is forked
+static void bw_init(bw_t *bw, double t0, double w){
+    bw->t0 = t0;
+    bw->w = w;
+}
+
+static inline void bw_add(bw_t *bw, int64_t bytes){
+    int k = (int)((realtime() - bw->t0)/bw->w);
+    if(k >= bw->n) k = bw->n-1;
+    bw->bytes[k] += bytes;
+    bw->total += bytes;
+}
+
+static void bw_report(bw_t *bw, int mypos, double elapsed){
+    int64_t total = 0;
+    int64_t peak = 0;
+    for(int k=0; k<bw->n; k++){
+        total += bw->bytes[k];
+        if(bw->bytes[k] > peak) peak = bw->bytes[k];
+    }
+    double mb = 1024.0*1024.0;
+    fprintf(stderr,"[%.3f] pos %d: aquisition write bandwidth peak %.2f MB/s (%.0f ms windows), average %.2f MB/s\n", elapsed, mypos,
+        peak/bw->w/mb, bw->w*1000, elapsed>0 ? total/elapsed/mb : 0);
+}
+
+//totals across positions, gathered from the (possibly shared) position state after the run
+void print_run_stats(prom_t *prom){
+    int64_t written = 0, read_back = 0, samples = 0;
+    double lag[3] = {0, 0, 0};
+    int worst[3] = {0, 0, 0};
+    for(int i=0; i<prom->npos; i++){
+        pos_t *pos = prom->pos[i];
+        written += pos->c_direct + pos->c_s;
+        read_back += pos->c_bd + pos->c_bs;
+        samples += pos->total_samples;
+        for(int k=0; k<3; k++){
+            if(pos->max_lag[k] > lag[k]){
+                lag[k] = pos->max_lag[k];
+                worst[k] = i;
+            }
+        }
+    }
+    fprintf(stderr, "[%s] %d positions%s: %ld reads written, %ld read back, %ld samples\n", __func__, prom->npos,
+        opt->procs > 0 ? " in worker processes" : "", written, read_back, samples);
+    fprintf(stderr, "[%s] worst deadline overrun: aquisition %.3f s (pos %d), iwrite->dwrite %.3f s (pos %d), pseudobasecalling %.3f s (pos %d)\n", __func__,
+        lag[0], worst[0], lag[1], worst[1], lag[2], worst[2]);
+}
+
+//aggregate the aquisition bandwidth of all positions into bins of opt->bw_timeline seconds
+void print_bw_timeline(prom_t *prom){
+    if(opt->bw_timeline <= 0 || prom->npos == 0) return;
+
+    bw_t *bw0 = &prom->pos[0]->bw;
+    int per_bin = (int)(opt->bw_timeline/bw0->w + 0.5);
+    if(per_bin < 1) per_bin = 1;
+    int it_per_bin = (int)(opt->bw_timeline/opt->ct + 0.5);
+    if(it_per_bin < 1) it_per_bin = 1;
+    int nbin = (bw0->n + per_bin - 1)/per_bin;
+
+    double mb = 1024.0*1024.0;
+    double peak = 0;
+    fprintf(stderr, "[%s] %10s %12s %16s\n", __func__, "time(s)", "MB/s", "active_channels");
+    for(int b=0; b<nbin; b++){
+        int64_t bytes = 0;
+        for(int i=0; i<prom->npos; i++){
+            bw_t *bw = &prom->pos[i]->bw;
+            for(int k=b*per_bin; k<(b+1)*per_bin && k<bw->n; k++){
+                bytes += bw->bytes[k];
+            }
+        }
+        double active = 0;
+        int nit = 0;
+        for(int it=b*it_per_bin; it<(b+1)*it_per_bin && it<opt->iterations; it++){
+            for(int i=0; i<prom->npos; i++){
+                active += prom->pos[i]->nactive[it];
+            }
+            nit++;
+        }
+        if(bytes == 0 && nit == 0) continue; //tail after the aquisition ended
+        double rate = bytes/(per_bin*bw0->w)/mb;
+        if(rate > peak) peak = rate;
+        fprintf(stderr, "[%s] %10.1f %12.2f %16.0f\n", __func__, b*per_bin*bw0->w, rate, nit ? active/nit : 0);
+    }
+    fprintf(stderr, "[%s] peak %.2f MB/s over %d s bins\n", __func__, peak, opt->bw_timeline);
+}
+
+//is the channel ready to start a new read at simulation time now (in seconds)
+static int chan_ready(chan_t *chan, double now){
+    if(opt->mux_scan > 0){
+        int scans = (int)(now/opt->mux_scan);
+        if(scans > 0 && now - (double)scans*opt->mux_scan < opt->mux_scan/MUX_SCAN_FRAC){
+            return 0; //mux scan in progress
+        }
+        if(scans > chan->scans){ //after a scan, switch to the first living pore
+            chan->scans = scans;
+            for(int m=0; m<N_MUX; m++){
+                if(chan->pore_death[m] > now){
+                    chan->mux = m;
+                    break;
+                }
+            }
+        }
+    }
+    if(chan->pore_death[chan->mux] <= now){
+        return 0; //pore is dead, wait for the next mux scan (if any)
+    }
+    return now >= chan->idle_until;
+}
+
+//per-thread state of the aquisition loop
+typedef struct{
+    int mypos;
+    pos_t *pos;
+    out_t *out;
+    rlen_t *generator;
+    int64_t ran;
+
+    int aq_done;
+    int slow5_done;
+    int islow5_done;
+
+    //time spent in per-record work, to see how the overhead grows as chunks shrink
+    double slow5fy_time;
+    double iwrite_time;
+    int64_t iwrite_chunks;
+
+    int64_t state_ran; //for the pore state model, kept apart so that the signal stream is unchanged
+
+    fdc_t fdc; //open intermediate files
+} aq_t;
+
+//aquire the next chunk of channel i at simulation time now and write it out. Returns 1 if a chunk was produced
+static int aq_chan(aq_t *aq, int i, double now){
+    int mypos = aq->mypos;
+    pos_t *pos = aq->pos;
+    chan_t *chan = pos->c[i];
+
+    if(chan->len_raw_signal == 0){
+        if(!chan_ready(chan, now)){
+            return 0;
+        }
+        chan->len_raw_signal = rlen_next(aq->generator);
+        chan->aq = 0;
+        chan->chunk_number=0;
+        xxh64_reset(&chan->sum, 0);
+        LOG_TRACE("channel %d pos %d: read %d (%ld samples) started", i, mypos, chan->read_number, chan->len_raw_signal);
+    }
+
+    if(chan->aq < chan->len_raw_signal){
+        int16_t st = 500;
+        int j = 0;
+        int64_t tr = trace_begin();
+        for(j=0;j<opt->cz && chan->aq+j<chan->len_raw_signal ;j++){
+            chan->raw_signal[j] = st+round(rng(&aq->ran)*1000-500);
+        }
+        trace_end(TR_GEN, tr);
+        //a chunk at a time, the read is never in memory as a whole. Reads that go to an intermediate file are always
+        //hashed, recovery relies on the checksum after their end of read marker
+        if(opt->checksum || chan->len_raw_signal > opt->cz){
+            xxh64_update(&chan->sum, chan->raw_signal, j*sizeof(int16_t));
+        }
+        chan->chunk_number++;
+        if(chan->chunk_number==1){
+            if(chan->aq+j == chan->len_raw_signal){ //directly write to bLOW5 if the read is short and thus fits in one chunk
+
+                LOG_TRACE("channel %d pos %d: read %d (chunk %d, samples %ld/%ld) written to SLOW5", i, mypos, chan->read_number, chan->chunk_number-1, chan->aq+j, chan->len_raw_signal);
+                double ts = realtime();
+                int64_t tr = trace_begin();
+                wmeta_t m = {i, chan->read_number};
+                int64_t bytes = out_append_read(aq->out, &m, chan->raw_signal, chan->len_raw_signal, xxh64_digest(&chan->sum));
+                trace_end(TR_SLOW5FY, tr);
+                aq->slow5fy_time += realtime() - ts;
+                bw_add(&aq->pos->bw, bytes);
+                aq->slow5_done++;
+
+            } else { //if the read is long, write to an intermediate file (for now in a very inefficient - without even compressing the chunk)
+                LOG_TRACE("channel %d pos %d: read %d (chunk %d, samples %ld/%ld) written to ISLOW5", i, mypos, chan->read_number, chan->chunk_number, chan->aq+j, chan->len_raw_signal);
+                double ts = realtime();
+                islow5_open(&aq->fdc, pos, mypos, i);
+                islow5_chunk_write(&aq->fdc, pos, mypos, i, j);
+                aq->iwrite_time += realtime() - ts;
+                bw_add(&aq->pos->bw, ISLOW5_HDR_SIZE + sizeof(int64_t) + j*sizeof(int16_t));
+                dir_io(tmp_dir(mypos), ISLOW5_HDR_SIZE + sizeof(int64_t) + j*sizeof(int16_t), 0);
+                aq->iwrite_chunks++;
+            }
+
+        } else {
+            LOG_TRACE("channel %d pos %d: read %d (chunk %d, samples %ld/%ld) written to ISLOW5", i, mypos, chan->read_number, chan->chunk_number, chan->aq+j, chan->len_raw_signal);
+            double ts = realtime();
+            islow5_chunk_write(&aq->fdc, pos, mypos, i, j);
+            aq->iwrite_time += realtime() - ts;
+            bw_add(&aq->pos->bw, sizeof(int64_t) + j*sizeof(int16_t));
+            dir_io(tmp_dir(mypos), sizeof(int64_t) + j*sizeof(int16_t), 0);
+            aq->iwrite_chunks++;
+        }
+        chan->aq += j;
+
+    }
+    if(chan->aq == chan->len_raw_signal){
+        if(chan->chunk_number>1){
+            islow5_chunk_write(&aq->fdc, pos, mypos, i, ISLOW5_END);
+            islow5_sum_write(pos, i, xxh64_digest(&chan->sum));
+            bw_add(&aq->pos->bw, sizeof(int64_t) + sizeof(uint64_t));
+            dir_io(tmp_dir(mypos), sizeof(int64_t) + sizeof(uint64_t), 0);
+            islow5_close(&aq->fdc, pos, i);
+            chan->c_islow5++;
+            aq->islow5_done++;
+        }
+        LOG_TRACE("channel %d pos %d: read %d (samples %ld) done", i, mypos, chan->read_number, chan->len_raw_signal);
+        pos->total_samples += chan->len_raw_signal;
+        if(opt->occupancy < 1.0){ //inter-read gap so that the pore is sequencing opt->occupancy of the time
+            double mean_gap = (double)chan->len_raw_signal/opt->freq*(1.0-opt->occupancy)/opt->occupancy;
+            chan->idle_until = now - log(rng(&aq->state_ran))*mean_gap;
+        }
+        chan->len_raw_signal = 0;
+        chan->read_number++;
+        aq->aq_done++;
+
+    }
+    return 1;
+}
+
+static void trace_sleep(struct timespec *dl){
+    int64_t tr = trace_begin();
+    sleep_until(dl);
+    trace_end(TR_SLEEP, tr);
+}
+
+//record an iteration of a stage, together with the backlogs between the stages of the position
+static void metrics_record(metrics_t *mt, pos_t *pos, int it, double elapsed, double slack, int64_t reads, int64_t samples, int64_t bytes){
+    if(!metrics_enabled()){
+        return;
+    }
+    metric_t *m = metrics_next(mt);
+    m->t = metrics_time();
+    m->it = it;
+    m->elapsed = elapsed;
+    m->slack = slack;
+    m->reads = reads;
+    m->samples = samples;
+    m->bytes = bytes;
+    m->conv_backlog = pos->c_islow5 - pos->c_s;
+    m->rb_backlog_direct = pos->c_direct - pos->c_bd;
+    m->rb_backlog_conv = pos->c_s - pos->c_bs;
+}
+
+//backpressure controller of a position, run by the aquisition thread once per iteration
+typedef struct{
+    int level;
+    int calm; //consecutive healthy iterations
+    int since; //iterations since the last level change
+    int32_t *done_hist; //intermediate reads completed by the end of each iteration
+    int32_t *conv_hist; //intermediate reads converted by the end of each iteration
+    double latency; //steady-state conversion latency in iterations, learned while storage keeps up
+    double slack; //of the previous iteration
+    int late; //consecutive iterations with negative and still falling slack
+    int changes;
+    int64_t iters[BP_DEFER+1]; //iterations spent at each level
+} bp_t;
+
+static const char *bp_name[] = {"normal", "batch", "defer"};
+
+static void bp_update(bp_t *bp, aq_t *aq, int it, double slack, double t){
+    pos_t *pos = aq->pos;
+    int32_t converted = pos->c_s;
+    int32_t backlog = aq->islow5_done - converted;
+    bp->done_hist[it] = aq->islow5_done;
+    bp->conv_hist[it] = converted;
+    bp->iters[bp->level]++;
+
+    //iterations since the reads conversion has reached were complete. Conversion always trails aquisition by a
+    //few iterations, so only a latency well above the usual one, with a backlog growing by more than an
+    //iteration's worth of reads, means storage is falling behind
+    int lag = 0;
+    while(lag < it && converted < bp->done_hist[it-lag]){
+        lag++;
+    }
+    if(converted == 0){ //conversion has not started, nothing to learn from yet
+        bp->latency = lag;
+    }
+    int behind = 0;
+    if(it >= BP_WINDOW && converted > 0){
+        int32_t grown = backlog - (bp->done_hist[it-BP_WINDOW] - bp->conv_hist[it-BP_WINDOW]);
+        int32_t per_it = (aq->islow5_done - bp->done_hist[it-BP_WINDOW]) / BP_WINDOW;
+        behind = lag > bp->latency + BP_WINDOW && grown > per_it;
+    }
+    if(!behind){
+        bp->latency += (lag - bp->latency) / 8;
+    }
+    int healthy = slack >= 0 && lag <= bp->latency + 1;
+
+    //neither is a single late iteration (e.g., opening the outputs), nor catching up after one
+    bp->late = slack < 0 && slack <= bp->slack ? bp->late + 1 : 0;
+    bp->slack = slack;
+
+    int level = bp->level;
+    bp->since++;
+    if(bp->late > 1 || behind){
+        bp->calm = 0;
+        if(level < BP_DEFER && bp->since > 1) level++; //give the last step an iteration to take effect
+    } else if (healthy){
+        if(++bp->calm >= BP_CALM && level > BP_NORMAL){
+            level--;
+            bp->calm = 0;
+        }
+    } else {
+        bp->calm = 0;
+    }
+
+    if(level != bp->level){
+        INFO("[%.3f] pos %d: backpressure %s -> %s (slack %.3f s, conversion backlog %d reads)", t, aq->mypos, bp_name[bp->level], bp_name[level], slack, backlog);
+        bp->level = level;
+        bp->since = 0;
+        bp->changes++;
+        pos->bp_level = level;
+    }
 }
 
 void *seq_aq_w(void *ptarg){
@@ -424,98 +2932,133 @@ void *seq_aq_w(void *ptarg){
 
     double realtime0 = realtime();
     fprintf(stderr,"[%.3f] starting aquisition on pos %d\n", realtime()-realtime0, mypos);
+    char name[64];
+    sprintf(name, "pos %d aquisition", mypos);
+    trace_thread(name);
+
+    aq_t aq = {0};
+    aq.mypos = mypos;
+    aq.pos = pos;
+    aq.ran = opt->seed;
+    aq.generator = init_rlen(opt->seed+1);
+    aq.out = out_open(pos, mypos, 0);
+    aq.state_ran = opt->seed+3+mypos;
+    aq.fdc.cap = opt->fd_cap;
+    aq.fdc.head = aq.fdc.tail = aq.fdc.opened = -1;
+    bw_init(&pos->bw, realtime0, opt->ct/BW_WINDOWS);
+
+    if(opt->pore_halflife > 0){ //exponential pore lifetimes
+        double lambda = log(2.0)/(opt->pore_halflife*3600.0);
+        for(int i=0; i < pos->nchan; i++){
+            for(int m=0; m<N_MUX; m++){
+                pos->c[i]->pore_death[m] = -log(rng(&aq.state_ran))/lambda;
+            }
+        }
+    }
+
+    //timer wheel: each channel gets a phase offset (slot) within the chunk period and is
+    //serviced when its slot comes around. A single slot is the original lockstep behaviour.
+    int nslot = opt->stagger > 0 ? opt->stagger : 1;
+    int *slot_start = (int *)calloc(nslot+1, sizeof(int));
+    MALLOC_CHK(slot_start);
+    int *order = (int *)malloc(pos->nchan * sizeof(int));
+    MALLOC_CHK(order);
+    int *chan_slot = (int *)malloc(pos->nchan * sizeof(int));
+    MALLOC_CHK(chan_slot);
+    int64_t phase_seed = opt->seed+2+mypos;
+    for(int i=0; i < pos->nchan; i++){
+        chan_slot[i] = nslot > 1 ? (int)(rng(&phase_seed)*nslot) % nslot : 0;
+        slot_start[chan_slot[i]+1]++;
+    }
+    for(int b=0; b < nslot; b++){
+        slot_start[b+1] += slot_start[b];
+    }
+    int *fill = (int *)calloc(nslot, sizeof(int));
+    MALLOC_CHK(fill);
+    for(int i=0; i < pos->nchan; i++){
+        order[slot_start[chan_slot[i]] + fill[chan_slot[i]]++] = i;
+    }
+    free(fill);
+    free(chan_slot);
+
+    bp_t bp = {0};
+    bp.since = BP_CALM;
+    bp.done_hist = (int32_t *)calloc(opt->iterations, sizeof(int32_t));
+    MALLOC_CHK(bp.done_hist);
+    bp.conv_hist = (int32_t *)calloc(opt->iterations, sizeof(int32_t));
+    MALLOC_CHK(bp.conv_hist);
+    pos->bp_level = BP_NORMAL;
 
-    int64_t ran = opt->seed;
-    grng_t* generator=init_grng(opt->seed+1, 2.0, opt->mean_slen/2);
+    metrics_t mt;
+    metrics_init(&mt, mypos, METRICS_AQ);
 
-    slow5_file_t *sp = slow5_initialise(mypos, 0);
-    int aq_done = 0;
-    int slow5_done = 0;
-    int islow5_done = 0;
+    struct timespec dl;
+    deadline_init(&dl);
 
     for(int it=0; it < opt->iterations; it++){
 
         double t0 = realtime();
 
-        for(int i=0; i < pos->nchan; i++){
-            chan_t *chan = pos->c[i];
+        for(int b=0; b < nslot; b++){
+            deadline_add(&dl, opt->ct/nslot);
 
-            if(chan->len_raw_signal == 0){
-                chan->len_raw_signal = (uint64_t)grng(generator);
-                chan->aq = 0;
-                chan->chunk_number=0;
-                LOG_TRACE("channel %d pos %d: read %d (%ld samples) started", i, mypos, chan->read_number, chan->len_raw_signal);
+            double now = it*opt->ct + b*opt->ct/nslot;
+            for(int k=slot_start[b]; k < slot_start[b+1]; k++){
+                pos->nactive[it] += aq_chan(&aq, order[k], now);
             }
-
-            if(chan->aq < chan->len_raw_signal){
-                int16_t st = 500;
-                int j = 0;
-                for(j=0;j<opt->cz && chan->aq+j<chan->len_raw_signal ;j++){
-                    chan->raw_signal[j] = st+round(rng(&ran)*1000-500);
-                }
-                chan->chunk_number++;
-                if(chan->chunk_number==1){
-                    if(chan->aq+j == chan->len_raw_signal){ //directly write to bLOW5 if the read is short and thus fits in one chunk
-
-                        LOG_TRACE("channel %d pos %d: read %d (chunk %d, samples %ld/%ld) written to SLOW5", i, mypos, chan->read_number, chan->chunk_number-1, chan->aq+j, chan->len_raw_signal);
-                        slow5fy(sp, chan->len_raw_signal, chan->raw_signal, mypos, i, chan->read_number);
-                        slow5_done++;
-
-                    } else { //if the read is long, write to an intermediate file (for now in a very inefficient - without even compressing the chunk)
-                        LOG_TRACE("channel %d pos %d: read %d (chunk %d, samples %ld/%ld) written to ISLOW5", i, mypos, chan->read_number, chan->chunk_number, chan->aq+j, chan->len_raw_signal);
-                        islow5_open(chan, mypos, i);
-                        islow5_chunk_write(chan, j);
-                    }
-
-                } else {
-                    LOG_TRACE("channel %d pos %d: read %d (chunk %d, samples %ld/%ld) written to ISLOW5", i, mypos, chan->read_number, chan->chunk_number, chan->aq+j, chan->len_raw_signal);
-                    islow5_chunk_write(chan, j);
-                }
-                chan->aq += j;
-
+            if(bp.level < BP_BATCH || (b == nslot-1 && it % BP_BATCH_ITERS == BP_BATCH_ITERS-1)){
+                out_flush(aq.out);
+                pos->c_direct=aq.slow5_done;
             }
-            if(chan->aq == chan->len_raw_signal){
-                if(chan->chunk_number>1){
-                    islow5_close(chan);
-                    chan->c_islow5++;
-                    islow5_done++;
-                }
-                LOG_TRACE("channel %d pos %d: read %d (samples %ld) done", i, mypos, chan->read_number, chan->len_raw_signal);
-                pos->total_samples += chan->len_raw_signal;
-                chan->len_raw_signal = 0;
-                chan->read_number++;
-                aq_done++;
 
+            if (b < nslot-1){ //a late slot eats into the slack of the following ones
+                trace_sleep(&dl);
             }
-
-        }
-        if(fflush(sp->fp) != 0){
-            ERROR("%s","Error flushing slow5 file!\n");
-            exit(EXIT_FAILURE);
         }
 
         double t1 = realtime();
         double elapsed = t1 - t0;
-        double s = opt->ct-elapsed;
+        double s = deadline_slack(&dl);
+        pos->c_islow5 = aq.islow5_done;
+        metrics_record(&mt, pos, it, elapsed, s, aq.aq_done, pos->total_samples, pos->bw.total);
         if(s<0){
-            WARNING("[%.3f] pos %d: aquisition+write is lagging: %f need to be %d", realtime()-realtime0, mypos, elapsed, opt->ct);
+            if(-s > pos->max_lag[0]) pos->max_lag[0] = -s;
+            pos->lags[0]++;
+            WARNING("[%.3f] pos %d: aquisition+write is lagging: %f need to be %.3f", realtime()-realtime0, mypos, elapsed, opt->ct);
         }
         else{
-            fprintf(stderr,"[%.3f] pos %d: reads done aquisition %d, dwrite %d, iwrite %d \n", realtime()-realtime0, mypos, aq_done, slow5_done, islow5_done);
-            sleep(s);
+            fprintf(stderr,"[%.3f] pos %d: reads done aquisition %d, dwrite %d, iwrite %d \n", realtime()-realtime0, mypos, aq.aq_done, aq.slow5_done, aq.islow5_done);
+        }
+        if(opt->backpressure){
+            bp_update(&bp, &aq, it, s, realtime()-realtime0);
         }
-        pos->c_direct=slow5_done;
+        out_spare(aq.out, s/opt->ct);
+        if(s >= 0){
+            trace_sleep(&dl);
+        }
+    }
+    out_flush(aq.out); //anything held back by batching
+    pos->c_direct=aq.slow5_done;
+    metrics_flush(&mt);
+    pos->bp_level = BP_NORMAL; //the conversion thread catches up once aquisition is over
+    if(opt->backpressure){
+        fprintf(stderr,"[%.3f] pos %d: backpressure %d level changes, iterations normal %ld, batch %ld, defer %ld\n", realtime()-realtime0, mypos,
+            bp.changes, bp.iters[BP_NORMAL], bp.iters[BP_BATCH], bp.iters[BP_DEFER]);
     }
+    free(bp.done_hist);
+    free(bp.conv_hist);
 
     int half_done = 0;
     int sum_read_number = 0;
     for(int i=0; i < pos->nchan; i++){
         chan_t *chan = pos->c[i];
         if(chan->aq>0 && chan->aq < chan->len_raw_signal){
-            islow5_close(chan);
+            islow5_close(&aq.fdc, pos, i);
             char path[4096];
-            sprintf(path, "%s/pos%d/chan%d_%d.iblow5", opt->dir, mypos, i, chan->c_islow5);
+            islow5_path(path, mypos, i, chan->c_islow5);
             LOG_TRACE("Deleting half done temp file %s", path);
+            struct stat st = {0};
+            if(stat(path, &st) == 0) dir_release(tmp_dir(mypos), st.st_size);
             if(remove(path) != 0){
                 ERROR("Error deleting temp file %s", path);
                 exit(EXIT_FAILURE);
@@ -525,11 +3068,20 @@ void *seq_aq_w(void *ptarg){
         sum_read_number += chan->read_number;
     }
     LOG_TRACE("Half done temp files deleted %d", half_done);
-    assert(aq_done == slow5_done + islow5_done);
-    assert(aq_done == sum_read_number);
-
-    slow5_close(sp);
-    free_grng(generator);
+    fprintf(stderr,"[%.3f] pos %d: slow5fy %d records (%.3f us/record), islow5_chunk_write %ld chunks (%.3f us/chunk)\n", realtime()-realtime0, mypos,
+        aq.slow5_done, aq.slow5_done ? aq.slow5fy_time*1e6/aq.slow5_done : 0, aq.iwrite_chunks, aq.iwrite_chunks ? aq.iwrite_time*1e6/aq.iwrite_chunks : 0);
+    if(aq.fdc.cap > 0){
+        fprintf(stderr,"[%.3f] pos %d: fd cache cap %d, hits %ld, misses %ld (reopen %.3f us each), evictions %ld\n", realtime()-realtime0, mypos,
+            aq.fdc.cap, aq.fdc.hits, aq.fdc.misses, aq.fdc.misses ? aq.fdc.reopen_time*1e6/aq.fdc.misses : 0, aq.fdc.evictions);
+    }
+    bw_report(&pos->bw, mypos, realtime()-realtime0);
+    assert(aq.aq_done == aq.slow5_done + aq.islow5_done);
+    assert(aq.aq_done == sum_read_number);
+
+    out_close(aq.out);
+    free_rlen(aq.generator);
+    free(slot_start);
+    free(order);
     pos->aq_done = 1;
 
     pthread_exit(0);
@@ -544,75 +3096,112 @@ void *iwrite2dwrite(void *ptarg){
     double realtime0 = realtime();
 
     VERBOSE("Hi from slow5fier for pos %d", mypos);
-    slow5_file_t *sp = slow5_initialise(mypos, 1);
+    char name[64];
+    sprintf(name, "pos %d iwrite->dwrite", mypos);
+    trace_thread(name);
+    out_t *out = out_open(pos, mypos, 1);
 
     int done_s = 0;
+    double conv_time = 0;
 
-    sleep(opt->ct+1);
+    struct timespec dl;
+    deadline_init(&dl);
+    deadline_add(&dl, opt->ct+1);
+    trace_sleep(&dl);
 
     int cont = 2;
+    int first = 0; //channel to start converting from
+    int it = 0;
+    metrics_t mt;
+    metrics_init(&mt, mypos, METRICS_CONV);
 
     while(cont>0){
 
         double t0 = realtime();
+        deadline_add(&dl, opt->ct);
 
-        for(int i=0; i < pos->nchan; i++){
+        //when deferring, conversion stops after its time budget and the next iteration starts where this one stopped
+        int defer = pos->bp_level >= BP_DEFER;
+        int deferred = 0;
+        for(int k=0; k < pos->nchan && !deferred; k++){
+            int i = (first + k) % pos->nchan;
             chan_t *chan = pos->c[i];
 
             int32_t aq_n = chan->c_islow5;
             int32_t s_n = chan->c_s;
 
-            if (s_n < aq_n){
-                for(int32_t j=s_n; j < aq_n; j++){
-                    //serialise the intermediate binary file into BLOW5
-                    //for now doing in an inefficient way (if the chunks in the intermediate format were already compressed,
-                    //those chunks can be directly copied over without decompressing - yes, SLOW5 spec supports per-chunk compression)
-                    islow5_to_slow5(sp, mypos, i, j);
-                    done_s++;
+            for(int32_t j=s_n; j < aq_n; j++){
+                if(defer && realtime() - t0 > opt->ct*BP_DEFER_BUDGET){
+                    deferred = 1;
+                    first = i;
+                    break;
                 }
-                chan->c_s = aq_n;
+                //serialise the intermediate binary file into the output
+                //for now doing in an inefficient way (if the chunks in the intermediate format were already compressed,
+                //those chunks can be directly copied over without decompressing - yes, SLOW5 spec supports per-chunk compression)
+                double ts = realtime();
+                islow5_to_slow5(out, mypos, i, j);
+                conv_time += realtime() - ts;
+                done_s++;
+                chan->c_s = j+1;
             }
 
         }
 
-        if(fflush(sp->fp) != 0){
-            ERROR("%s","Error flushing slow5 file!\n");
-            exit(EXIT_FAILURE);
-        }
+        out_flush(out);
         double t1 = realtime();
         double elapsed = t1 - t0;
-        double s = opt->ct-elapsed;
+        double s = deadline_slack(&dl);
+        out_spare(out, s/opt->ct);
         if(s<0){
-            WARNING("[%.3f] pos %d: iwrite->dwrite is lagging: %f need to be %d", realtime() - realtime0, mypos, elapsed, opt->ct);
+            if(-s > pos->max_lag[1]) pos->max_lag[1] = -s;
+            pos->lags[1]++;
+            WARNING("[%.3f] pos %d: iwrite->dwrite is lagging: %f need to be %.3f", realtime() - realtime0, mypos, elapsed, opt->ct);
         }
         else{
             fprintf(stderr,"[%.3f] pos %d: iwrite->dwrite %d reads done\n", realtime() - realtime0, mypos, done_s);
-            sleep(s);
+            trace_sleep(&dl);
         }
 
         if(pos->aq_done){
             cont--;
         }
         pos->c_s = done_s;
+        metrics_record(&mt, pos, it++, elapsed, s, done_s, out->samples, out->bytes);
 
     }
 
 
-    slow5_close(sp);
+    metrics_flush(&mt);
+    out_close(out);
+    fprintf(stderr,"[%.3f] pos %d: islow5_to_slow5 %d records (%.3f us/record)\n", realtime() - realtime0, mypos, done_s, done_s ? conv_time*1e6/done_s : 0);
 
     pos->s_done = 1;
 
     char path[4096];
-    sprintf(path, "%s/pos%d", opt->dir, mypos);
-    int ret = remove(path);
-    if (ret != 0) {
-        WARNING("Error deleting temp dir %s. %s", path, strerror(errno));
-    }
+    sprintf(path, "%s/pos%d", opt->dirs[tmp_dir(mypos)], mypos);
+    reclaim(path, -1, 0); //after the files of the position, which may still be queued
 
     pthread_exit(0);
 }
 
 
+//compare the signal of record seq of an output, as read back, with its checksum from aquisition
+static void verify_read(pos_t *pos, int mypos, int type, int64_t seq, const int16_t *signal, int64_t n){
+    if(!opt->checksum){
+        return;
+    }
+    uint64_t want = sums_take(&pos->sums[type], seq);
+    if(xxh64_signal(signal, n) == want){
+        pos->sum_ok++;
+        return;
+    }
+    int64_t bad = __atomic_add_fetch(&pos->sum_bad, 1, __ATOMIC_RELAXED);
+    if(bad <= 10){
+        ERROR("pos %d: checksum mismatch on read-back of record %ld of output %d (%ld samples)", mypos, seq, type, n);
+    }
+}
+
 void *pseudobasecaller(void *ptarg){
     ptarg_t *arg = (ptarg_t*)ptarg;
     int mypos = arg->mypos;
@@ -621,48 +3210,59 @@ void *pseudobasecaller(void *ptarg){
 
     double realtime0 = realtime();
     VERBOSE("Hi from pseudobasecaller for pos %d", mypos);
+    char name[64];
+    sprintf(name, "pos %d pseudobasecaller", mypos);
+    trace_thread(name);
 
     int done_bd = 0;
     int done_bs = 0;
 
-    sleep(opt->ct*2+1);
+    struct timespec dl;
+    deadline_init(&dl);
+    deadline_add(&dl, opt->ct*2+1);
+    trace_sleep(&dl);
     int cont = 2;
 
-    char path[4096];
-    sprintf(path, "%s/pos%d_0.blow5", opt->dir, mypos);
-    slow5_file_t *sp0 = slow5_open(path, "r");
-    if(sp0==NULL){
-        ERROR("%s","Error opening file!\n");
-        exit(EXIT_FAILURE);
-    }
-    sprintf(path, "%s/pos%d_1.blow5", opt->dir, mypos);
-    slow5_file_t *sp1 = slow5_open(path, "r");
-    if(sp1==NULL){
-        ERROR("%s","Error opening file!\n");
-        exit(EXIT_FAILURE);
-    }
-
-    slow5_rec_t *rec0 = NULL;
-    slow5_rec_t *rec1 = NULL;
-    int ret=0;
+    //the writers have created their outputs by now
+    in_t in0, in1;
+    in_open(&in0, pos, mypos, 0);
+    in_open(&in1, pos, mypos, 1);
+    int16_t *sig = NULL; //reads taken from the ring
+    int64_t sig_cap = 0;
+    const int16_t *rsig; //reads taken from the output
+    int64_t rn;
 
     int64_t samples = 0;
+    int it = 0;
+    metrics_t mt;
+    metrics_init(&mt, mypos, METRICS_READBACK);
+    int64_t rchar0 = 0, disk0 = 0; //this thread only reads the outputs, so its I/O counters tell cache hits from disk reads
+    int io = thread_io(&rchar0, &disk0) == 0;
 
     while(cont>0){
 
         double t0 = realtime();
+        deadline_add(&dl, opt->ct);
 
         int64_t s_n = pos->c_direct;
         int64_t b_n = pos->c_bd;
 
         if (b_n < s_n){
             for(int32_t j=b_n; j < s_n; j++){
-                ret = slow5_get_next(&rec0,sp0);
-                if(ret<0){
+                int64_t n, file_bytes;
+                if(pos->ring[0] && ring_get(pos->ring[0], in0.ntotal, &sig, &sig_cap, &n, &file_bytes) == 0){
+                    verify_read(pos, mypos, 0, in0.ntotal, sig, n);
+                    in_skip(&in0, file_bytes);
+                    samples += n;
+                    done_bd++;
+                    continue;
+                }
+                if(in_next(&in0, &rsig, &rn) < 0){
                     ERROR("%s","Error reading slow5 file!\n");
                     exit(EXIT_FAILURE);
                 }
-                samples += rec0->len_raw_signal;
+                verify_read(pos, mypos, 0, in0.ntotal-1, rsig, rn);
+                samples += rn;
                 done_bd++;
             }
             pos->c_bd = s_n;
@@ -673,12 +3273,21 @@ void *pseudobasecaller(void *ptarg){
 
         if (b_n < s_n){
             for(int32_t j=b_n; j < s_n; j++){
-                ret = slow5_get_next(&rec1,sp1); //this is just to simulate the reading workload of basecalling. We read the whole record from disk, but do not actually do actual basecalling
-                if(ret<0){
+                int64_t n, file_bytes;
+                if(pos->ring[1] && ring_get(pos->ring[1], in1.ntotal, &sig, &sig_cap, &n, &file_bytes) == 0){ //in memory, no need to touch the file
+                    verify_read(pos, mypos, 1, in1.ntotal, sig, n);
+                    in_skip(&in1, file_bytes);
+                    samples += n;
+                    done_bs++;
+                    continue;
+                }
+                //this is just to simulate the reading workload of basecalling. We read the whole record from disk, but do not actually do actual basecalling
+                if(in_next(&in1, &rsig, &rn) < 0){
                     ERROR("%s","Error reading slow5 file!\n");
                     exit(EXIT_FAILURE);
                 }
-                samples += rec1->len_raw_signal;
+                verify_read(pos, mypos, 1, in1.ntotal-1, rsig, rn);
+                samples += rn;
                 done_bs++;
             }
             pos->c_bs = s_n;
@@ -686,13 +3295,16 @@ void *pseudobasecaller(void *ptarg){
 
         double t1 = realtime();
         double elapsed = t1 - t0;
-        double s = opt->ct-elapsed;
+        double s = deadline_slack(&dl);
+        metrics_record(&mt, pos, it++, elapsed, s, done_bd+done_bs, samples, in0.bytes+in1.bytes);
         if(s<0){
-            WARNING("[%.3f] pos %d: pseudobasecalling is lagging: %f need to be %d", realtime()-realtime0, mypos, elapsed, opt->ct);
+            if(-s > pos->max_lag[2]) pos->max_lag[2] = -s;
+            pos->lags[2]++;
+            WARNING("[%.3f] pos %d: pseudobasecalling is lagging: %f need to be %.3f", realtime()-realtime0, mypos, elapsed, opt->ct);
         }
         else{
             fprintf(stderr,"[%.3f] pos %d: pseudobasecalled %d reads (%d+%d), %ld samples\n", realtime()-realtime0, mypos, done_bd+done_bs, done_bd, done_bs, samples);
-            sleep(s);
+            trace_sleep(&dl);
         }
 
         if(pos->aq_done && pos->s_done){
@@ -701,24 +3313,365 @@ void *pseudobasecaller(void *ptarg){
 
     }
 
-    ret = slow5_get_next(&rec0,sp0);
-    if(ret != SLOW5_ERR_EOF){  //check if proper end of file has been reached
-        ERROR("EOF not properly reached. Return code %d\n",ret);
-        exit(EXIT_FAILURE);
-    }
-    ret = slow5_get_next(&rec1,sp1);
-    if(ret != SLOW5_ERR_EOF){  //check if proper end of file has been reached
-        ERROR("EOF not properly reached. Return code %d\n",ret);
-        exit(EXIT_FAILURE);
+    metrics_flush(&mt);
+    in_close(&in0);
+    in_close(&in1);
+    free(sig);
+    sums_free(&pos->sums[0]);
+    sums_free(&pos->sums[1]);
+
+    if(pos->ring[0]){
+        int64_t hits[2], misses[2], bytes[2];
+        ring_stats(pos->ring[0], &hits[0], &misses[0], &bytes[0]);
+        ring_stats(pos->ring[1], &hits[1], &misses[1], &bytes[1]);
+        fprintf(stderr,"[%.3f] pos %d: read-back from ring %ld reads (%.2f MB of samples), from file %ld reads\n", realtime()-realtime0, mypos,
+            hits[0]+hits[1], (bytes[0]+bytes[1])/(1024.0*1024.0), misses[0]+misses[1]);
     }
 
-    slow5_rec_free(rec0);
-    slow5_rec_free(rec1);
-    slow5_close(sp0);
-    slow5_close(sp1);
+    int64_t rchar, disk;
+    if(io && thread_io(&rchar, &disk) == 0){
+        rchar -= rchar0;
+        disk -= disk0;
+        double mb = 1024.0*1024.0;
+        double hit = rchar > 0 ? 100.0*(rchar - disk)/rchar : 0;
+        fprintf(stderr,"[%.3f] pos %d: read-back read %.2f MB, %.2f MB of it fetched from storage (%.1f%% page cache hits)\n", realtime()-realtime0, mypos,
+            rchar/mb, disk/mb, hit > 0 ? hit : 0);
+    }
 
+    if(opt->checksum){
+        fprintf(stderr,"[%.3f] pos %d: checksums verified %ld reads, %ld mismatches\n", realtime()-realtime0, mypos, pos->sum_ok, pos->sum_bad);
+    }
     fprintf(stderr,"[%.3f] pos %d: total samples %ld, pseudobasecalled samples %ld\n",realtime()-realtime0, mypos, pos->total_samples, samples);
     assert(pos->total_samples == samples);
 
     pthread_exit(0);
 }
+
+//an intermediate file found by recover
+typedef struct{
+    char path[4096];
+    int pos;
+    int32_t chan;
+    int32_t index;
+    int out; //output (position) index in the recover job
+    int8_t done; //converted, deleted once the output is on disk
+} rec_file_t;
+
+//recovered BLOW5 output of one position, shared by the recover threads
+typedef struct{
+    int pos;
+    char path[4096];
+    slow5_file_t *sp;
+    pthread_mutex_t lock;
+    int64_t nrec;
+} rec_out_t;
+
+typedef struct{
+    rec_file_t *files;
+    int64_t nfiles;
+    int64_t next; //next file to take, atomic
+    rec_out_t *outs;
+    int nout;
+    int64_t done, truncated, invalid, samples, bytes; //atomic
+} rec_job_t;
+
+//validate an intermediate file and read the signal of a complete read.
+//Returns the number of samples, or -1 with the reason in msg
+static int64_t recover_read(FILE *fp, int16_t **raw, int32_t *read_number, char *msg){
+    char magic[7];
+    if(fread(magic, 1, 7, fp) != 7 || strncmp(magic, ISLOW5_MAGIC, 7) != 0){
+        sprintf(msg, "not an ISLOW5 file");
+        return -1;
+    }
+    if(fread(read_number, sizeof(int32_t), 1, fp) != 1){
+        sprintf(msg, "truncated header");
+        return -1;
+    }
+    int64_t len = 0, cap = 0, j;
+    while(1){
+        off_t off = ftello(fp);
+        if(fread(&j, sizeof(int64_t), 1, fp) != 1){
+            sprintf(msg, "no end of read marker after %ld samples (read was in progress)", len);
+            return -1;
+        }
+        if(j == ISLOW5_END){
+            uint64_t sum;
+            if(fread(&sum, sizeof(uint64_t), 1, fp) != 1){
+                sprintf(msg, "no checksum after the end of read marker");
+                return -1;
+            }
+            if(xxh64_signal(*raw, len) != sum){
+                sprintf(msg, "checksum mismatch over %ld samples", len);
+                return -1;
+            }
+            break;
+        }
+        if(j < 0 || j > INT32_MAX){
+            sprintf(msg, "bad chunk length %ld at byte %ld", j, (long)off);
+            return -1;
+        }
+        if(len + j > cap){
+            cap = (len + j)*2;
+            *raw = (int16_t *)realloc(*raw, cap * sizeof(int16_t));
+            MALLOC_CHK(*raw);
+        }
+        if(fread(*raw + len, sizeof(int16_t), j, fp) != (size_t)j){
+            sprintf(msg, "truncated chunk of %ld samples at byte %ld", j, (long)off);
+            return -1;
+        }
+        len += j;
+    }
+    return len;
+}
+
+static void *recover_worker(void *ptarg){
+    rec_job_t *job = (rec_job_t *)ptarg;
+    int16_t *raw = NULL;
+    char msg[256];
+    slow5_file_t *enc = s5_encoder(); //same header and compression as the outputs, so that records are compressed in parallel
+
+    int64_t k;
+    while((k = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->nfiles){
+        rec_file_t *f = &job->files[k];
+        FILE *fp = fopen(f->path, "r");
+        if(fp == NULL){
+            WARNING("Could not open %s: %s", f->path, strerror(errno));
+            __atomic_fetch_add(&job->invalid, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        int32_t read_number = -1;
+        int64_t len = recover_read(fp, &raw, &read_number, msg);
+        off_t size = ftello(fp);
+        fclose(fp);
+        if(len < 0){
+            fprintf(stderr, "[%s] %s: %s\n", __func__, f->path, msg);
+            __atomic_fetch_add(&job->truncated, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        rec_out_t *out = &job->outs[f->out];
+        slow5_rec_t *rec = slow5_rec_init();
+        if(rec == NULL){
+            ERROR("%s","Could not allocate space for a slow5 record.");
+            exit(EXIT_FAILURE);
+        }
+        set_record_primary_fields(rec, enc, len, raw, f->pos, f->chan, read_number);
+        set_record_aux_fields(rec, enc, f->chan, read_number);
+        void *mem = NULL;
+        size_t bytes = 0;
+        if(slow5_encode(&mem, &bytes, rec, enc) < 0){
+            ERROR("Error encoding record from %s", f->path);
+            exit(EXIT_FAILURE);
+        }
+        slow5_rec_free(rec);
+
+        pthread_mutex_lock(&out->lock); //only to append the encoded record
+        if(fwrite(mem, 1, bytes, out->sp->fp) != bytes){
+            ERROR("Error writing record from %s: %s", f->path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        out->nrec++;
+        pthread_mutex_unlock(&out->lock);
+        free(mem);
+
+        f->done = 1;
+        __atomic_fetch_add(&job->done, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&job->samples, len, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&job->bytes, size, __ATOMIC_RELAXED);
+    }
+
+    slow5_close(enc);
+    free(raw);
+    pthread_exit(0);
+}
+
+//find posN/chanX_Y.iblow5 under dir
+static void recover_scan(const char *dir, rec_job_t *job, int64_t *cap){
+    DIR *d = opendir(dir);
+    if(d == NULL){
+        ERROR("Could not open directory %s: %s", dir, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    struct dirent *e;
+    while((e = readdir(d)) != NULL){
+        int pos;
+        char tail;
+        if(sscanf(e->d_name, "pos%d%c", &pos, &tail) != 1){
+            continue;
+        }
+        char pdir[4096];
+        snprintf(pdir, sizeof(pdir), "%s/%s", dir, e->d_name);
+        DIR *pd = opendir(pdir);
+        if(pd == NULL){
+            continue;
+        }
+        struct dirent *fe;
+        while((fe = readdir(pd)) != NULL){
+            int32_t chan, index;
+            int n = 0;
+            if(sscanf(fe->d_name, "chan%d_%d.iblow5%n", &chan, &index, &n) != 2 || fe->d_name[n] != '\0'){
+                continue;
+            }
+            if(job->nfiles == *cap){
+                *cap = *cap ? *cap*2 : 1024;
+                job->files = (rec_file_t *)realloc(job->files, *cap * sizeof(rec_file_t));
+                MALLOC_CHK(job->files);
+            }
+            rec_file_t *f = &job->files[job->nfiles];
+            if(snprintf(f->path, sizeof(f->path), "%s/%s", pdir, fe->d_name) >= (int)sizeof(f->path)){
+                WARNING("Path too long, skipping %s/%s", pdir, fe->d_name);
+                continue;
+            }
+            job->nfiles++;
+            f->pos = pos;
+            f->chan = chan;
+            f->index = index;
+            f->out = -1;
+            f->done = 0;
+        }
+        closedir(pd);
+    }
+    closedir(d);
+}
+
+static void print_recover_help(FILE *fp_help){
+    fprintf(fp_help,"Usage: slowion recover [OPTIONS] -d DIR[,DIR...]\n");
+    fprintf(fp_help,"\nconverts complete reads in intermediate files left behind by an interrupted run into BLOW5\n");
+    fprintf(fp_help,"\noptions:\n");
+    fprintf(fp_help,"   -d DIR[,DIR...]            output directories of the interrupted run\n");
+    fprintf(fp_help,"   -o DIR                     where to write recovered_posN[_K].blow5 [first -d directory]\n");
+    fprintf(fp_help,"   -t INT                     threads [%d]\n", 8);
+    fprintf(fp_help,"   -f INT                     sample rate of the run [%d]\n", opt->freq);
+    fprintf(fp_help,"   -h                         help\n");
+}
+
+int recover_main(int argc, char *argv[]){
+    double realtime0 = realtime();
+    const char *outdir = NULL;
+    int nthreads = 8;
+
+    int c;
+    optind = 1;
+    while ((c = getopt(argc, argv, "d:o:t:f:h")) >= 0) {
+        if (c == 'd') {
+            opt->dir = optarg;
+        } else if (c == 'o') {
+            outdir = optarg;
+        } else if (c == 't') {
+            nthreads = atoi(optarg);
+            if(nthreads < 1){
+                ERROR("%s","Number of threads must be >= 1.");
+                exit(EXIT_FAILURE);
+            }
+        } else if (c == 'f') {
+            opt->freq = atoi(optarg);
+        } else if (c == 'h') {
+            print_recover_help(stdout);
+            exit(EXIT_SUCCESS);
+        } else {
+            print_recover_help(stderr);
+            exit(EXIT_FAILURE);
+        }
+    }
+    split_dirs(opt);
+    if(outdir == NULL){
+        outdir = opt->dirs[0];
+    }
+
+    rec_job_t job = {0};
+    int64_t cap = 0;
+    for(int d=0; d<opt->ndir; d++){
+        recover_scan(opt->dirs[d], &job, &cap);
+    }
+    fprintf(stderr,"[%.3f] found %ld intermediate files\n", realtime()-realtime0, job.nfiles);
+
+    //one output per position that has files
+    for(int64_t k=0; k<job.nfiles; k++){
+        rec_file_t *f = &job.files[k];
+        int o = 0;
+        while(o < job.nout && job.outs[o].pos != f->pos) o++;
+        if(o == job.nout){
+            job.outs = (rec_out_t *)realloc(job.outs, (job.nout+1) * sizeof(rec_out_t));
+            MALLOC_CHK(job.outs);
+            rec_out_t *out = &job.outs[job.nout++];
+            out->pos = f->pos;
+            out->nrec = 0;
+            pthread_mutex_init(&out->lock, NULL);
+
+            //truncated files are left in place, so recover may run again on the same directory. Never overwrite an earlier output
+            for(int k=1; ; k++){
+                if(k == 1) snprintf(out->path, sizeof(out->path), "%s/recovered_pos%d.blow5", outdir, f->pos);
+                else snprintf(out->path, sizeof(out->path), "%s/recovered_pos%d_%d.blow5", outdir, f->pos, k);
+                int fd = open(out->path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+                if(fd >= 0){
+                    close(fd);
+                    break;
+                }
+                if(errno != EEXIST){
+                    ERROR("Error creating %s: %s", out->path, strerror(errno));
+                    exit(EXIT_FAILURE);
+                }
+            }
+            out->sp = slow5_open(out->path, "w");
+            if(out->sp == NULL){
+                ERROR("Error opening %s", out->path);
+                exit(EXIT_FAILURE);
+            }
+            if(slow5_set_press(out->sp, SLOW5_COMPRESS_ZSTD, SLOW5_COMPRESS_SVB_ZD) < 0){
+                ERROR("%s","Error setting compression method!");
+                exit(EXIT_FAILURE);
+            }
+            set_header_attributes(out->sp);
+            set_header_aux_fields(out->sp);
+            if(slow5_hdr_write(out->sp) < 0){
+                ERROR("%s","Error writing header!");
+                exit(EXIT_FAILURE);
+            }
+        }
+        f->out = o;
+    }
+
+    pthread_t *th = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+    MALLOC_CHK(th);
+    for(int t=0; t<nthreads; t++){
+        int ret = pthread_create(&th[t], NULL, recover_worker, (void *)&job);
+        NEG_CHK(ret);
+    }
+    for(int t=0; t<nthreads; t++){
+        int ret = pthread_join(th[t], NULL);
+        NEG_CHK(ret);
+    }
+    free(th);
+
+    //an intermediate file is the only copy of its read until the output is on disk
+    for(int o=0; o<job.nout; o++){
+        fprintf(stderr,"[%s] %s: %ld reads\n", __func__, job.outs[o].path, job.outs[o].nrec);
+        slow5_close(job.outs[o].sp);
+        pthread_mutex_destroy(&job.outs[o].lock);
+        int fd = open(job.outs[o].path, O_RDONLY);
+        if(fd < 0 || fsync(fd) != 0){
+            ERROR("Error syncing %s, intermediate files are kept: %s", job.outs[o].path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+    }
+    for(int64_t k=0; k<job.nfiles; k++){
+        if(job.files[k].done && remove(job.files[k].path) != 0){
+            WARNING("Error deleting %s: %s", job.files[k].path, strerror(errno));
+        }
+    }
+    //position directories that are now empty
+    for(int64_t k=0; k<job.nfiles; k++){
+        char *slash = strrchr(job.files[k].path, '/');
+        *slash = '\0';
+        rmdir(job.files[k].path); //fails harmlessly while truncated files remain
+    }
+
+    double elapsed = realtime()-realtime0;
+    fprintf(stderr,"[%.3f] recovered %ld reads (%ld samples, %.2f MB read, %.2f MB/s) with %d threads, %ld truncated, incomplete or corrupt left in place, %ld unreadable\n",
+        elapsed, job.done, job.samples, job.bytes/(1024.0*1024.0), elapsed > 0 ? job.bytes/(1024.0*1024.0)/elapsed : 0, nthreads, job.truncated, job.invalid);
+
+    free(job.files);
+    free(job.outs);
+    return job.invalid > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
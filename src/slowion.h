@@ -25,15 +25,40 @@ SOFTWARE.
 ******************************************************************************/
 
 #ifndef SLOWION_H
+#define SLOWION_H
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <pthread.h>
+#include "ring.h"
+#include "checksum.h"
 
 
 #define SLOWION_VERSION "0.1.0"
 
+//read length distributions
+#define RLEN_GAMMA 0
+#define RLEN_LOGNORMAL 1
+#define RLEN_EMPIRICAL 2
+
+#define N_MUX 4 //pores (muxes) per channel
+
+//placement of files across output directories
+#define PLACE_RR 0 //positions round-robin across directories
+#define PLACE_TIERED 1 //intermediate files on the first directory, final BLOW5 round-robin on the rest
+
+//backpressure levels, each one includes the ones below
+#define BP_NORMAL 0
+#define BP_BATCH 1 //flush the direct output every few iterations instead of every slot
+#define BP_DEFER 2 //conversion of intermediate reads gets a time budget per iteration, the rest waits
+
+//output formats (backends in writer.h)
+#define FMT_BLOW5 0
+#define FMT_RAW 1 //samples back to back with a fixed-size index entry per read
+#define FMT_COLUMNAR 2 //signal blocks of a batch of reads, metadata in a separate table
+
 typedef struct{
     int bps;
     int mean_rlen;
@@ -44,11 +69,54 @@ typedef struct{
     int nchan;
 
     int freq;
-    int ct;
+    double ct; //chunk period in seconds
+    int chunk_ms; //user requested chunk period in ms (0 to derive from the read length)
     int cz;
     int iterations;
+    int stagger; //timer-wheel slots per chunk period for staggered channels (0 for lockstep)
+
+    int rlen_dist; //read length distribution
+    double rlen_shape; //gamma shape or lognormal sigma (0 for the distribution's default)
+    const char *rlen_file; //read lengths for the empirical distribution
 
-    const char *dir;
+    //pore state model
+    double occupancy; //fraction of time a live pore spends sequencing
+    double pore_halflife; //pore half-life in hours (0 for immortal pores)
+    int mux_scan; //seconds between mux scans (0 for no mux scans)
+    int bw_timeline; //bin width in seconds for the bandwidth timeline (0 to disable)
+
+    const char *sink; //stream BLOW5 output to a receiver at this address instead of local files
+    const char *sink_dir; //where the receiver writes, for reading back (NULL to skip reading back)
+
+    const char *dir; //comma separated output directories as given
+    char **dirs; //output directories followed by the staging directory (if any)
+    int ndir;
+    int nout; //number of output directories (excluding the staging directory)
+    int placement;
+    const char *stage; //fast staging tier for intermediate files and live BLOW5 segments (NULL for none)
+    int stage_dir; //index of the staging directory in dirs (-1 for none)
+    double seg_time; //start a new BLOW5 segment every seg_time seconds (0 for a single file)
+    int64_t seg_reads; //start a new BLOW5 segment every seg_reads records (0 for no limit)
+    int64_t seg_bytes; //start a new BLOW5 segment when the current one reaches seg_bytes (0 for no limit)
+    int shared; //write all outputs into this many shared BLOW5 files (0 for a file per output)
+    int64_t ring_bytes; //shared-memory ring per output for the read-back consumer (0 for none)
+    int procs; //worker processes, each running a group of positions (0 for threads in this process)
+    int fd_cap; //max intermediate files kept open per position (0 for no limit)
+    int backpressure; //adapt batching and conversion when storage falls behind
+    int adapt_press; //choose the compression of each new segment from the spare time of the writer
+    const char *metrics; //per-iteration metrics file, CSV if it ends in .csv else JSON lines (NULL for none)
+    const char *prometheus; //Prometheus text-format file rewritten during the run (NULL for none)
+    double prometheus_interval; //seconds between rewrites of opt->prometheus
+    double sysmon; //seconds between samples of kernel I/O, CPU and pressure counters (0 for none)
+    const char *sysmon_file; //CSV of the kernel counter samples (NULL for none)
+    const char *trace; //Chrome trace of the hot-path stages (NULL for none)
+    int64_t trace_spans; //spans kept per thread for the trace
+    int checksum; //checksum each read at aquisition and verify it after conversion and on read-back
+    int format; //output format
+    int64_t mmap_win; //write BLOW5 outputs through a memory-mapped window of this many bytes (0 for stdio)
+    int reclaim_batch; //unlink converted intermediate files from a background thread in batches of this many (0 for synchronously)
+    int64_t fadvise; //page-cache window of each BLOW5 output in bytes: read ahead by the reader, dropped behind the writer and reader (0 for no hints)
+    int cold_read; //evict written data from the page cache before reading it back
 
     int64_t seed;
 
@@ -66,14 +134,73 @@ typedef struct{
     int32_t c_islow5; //written to disk
     int32_t c_s; // iwrite2dwrited
 
+    int32_t lru_prev, lru_next; //neighbours in the open file list of the position (channel indices, -1 at the ends)
+    xxh64_t sum; //checksum of the read so far
+
+    //pore state model
+    int8_t mux; //current mux
+    int32_t scans; //mux scans seen so far
+    double idle_until; //simulation time (s) until which the channel is between reads
+    double pore_death[N_MUX]; //simulation time (s) at which each pore dies
+
 } chan_t;
 
+//BLOW5 segments of one output stream, shared between the writer, the reader and the mover
+typedef struct{
+    int32_t nseg; //segments opened so far
+    int32_t nclosed; //segments closed so far
+    int32_t nmigrated; //segments moved off the staging tier so far
+    int32_t cap;
+    int64_t *nrec; //records in each closed segment
+    double *tclose; //when each segment was closed
+    int8_t *staged; //1 while the segment is on the staging tier
+    int64_t written; //bytes of a memory-mapped output written so far, published to its reader
+    pthread_mutex_t lock;
+} segs_t;
+
+//byte ranges reserved in a shared BLOW5 file by one output stream, in write order
+typedef struct{
+    int32_t file; //shared file index
+    int64_t n; //records written
+    int64_t cap;
+    int64_t *off; //offset of each record in the shared file
+    int64_t *len; //size of each record
+    char **id; //read_id of each record, for the index
+    pthread_mutex_t lock;
+} resv_t;
+
+#define SUMS_BLOCK 4096 //checksums per block of sums_t
+
+typedef struct sums_blk_s{
+    uint64_t v[SUMS_BLOCK];
+    struct sums_blk_s *next;
+} sums_blk_t;
+
+//checksums of the records of an output stream not yet verified by the read-back, in write order. Single writer and
+//single reader, both threads of the process running the position, so the blocks live on that process's heap
+typedef struct{
+    int64_t n; //checksums added, published by the writer
+    int64_t taken; //checksums taken by the read-back
+    sums_blk_t *head; //block of the next checksum to take, the reader frees blocks it is done with
+    sums_blk_t *tail; //block being filled by the writer
+} sums_t;
+
+//bytes written per fixed wall-clock window, to compare peak against average bandwidth
+typedef struct{
+    double t0;
+    double w; //window width in seconds
+    int n;
+    int64_t *bytes;
+    int64_t total; //bytes so far
+} bw_t;
+
 
 typedef struct{
     int nchan;
     chan_t **c;
 
     int64_t c_direct;  //written to disk
+    int64_t c_islow5; //intermediate reads complete
     int64_t c_s; // iwrite2dwrited
 
     int64_t c_bd; //direct ones current being basecalled
@@ -83,6 +210,20 @@ typedef struct{
     int8_t aq_done;
     int8_t s_done;
 
+    bw_t bw; //aquisition write bandwidth over time
+    segs_t seg[2]; //segments of the direct (0) and converted (1) outputs
+    resv_t resv[2]; //records of the direct (0) and converted (1) outputs in the shared files
+    ring_t *ring[2]; //completed reads of the direct (0) and converted (1) outputs for the read-back
+    double max_lag[3]; //worst deadline overrun (s) of the aquisition, iwrite->dwrite and read-back threads
+    int64_t lags[3]; //iterations that missed their deadline, same order as max_lag
+    double flush_time[2]; //time spent flushing the direct (0) and converted (1) outputs
+    int64_t flushes[2];
+    sums_t sums[2]; //checksums of the direct (0) and converted (1) outputs
+    int64_t sum_ok; //reads whose checksum matched on read-back
+    int64_t sum_bad; //checksum mismatches, after conversion or on read-back
+    int8_t bp_level; //set by the aquisition thread, read by iwrite->dwrite
+    int32_t *nactive; //channels that produced a chunk, per iteration
+
 } pos_t;
 
 typedef struct{
@@ -103,5 +244,20 @@ void free_prom(prom_t *prom);
 void *seq_aq_w(void *ptarg);
 void *iwrite2dwrite(void *ptarg);
 void *pseudobasecaller(void *ptarg);
+void print_run_stats(prom_t *prom);
+void print_bw_timeline(prom_t *prom);
+void print_dir_stats(double elapsed);
+int64_t dir_written_total(void);
+void dir_account(int d, int64_t written, int64_t read);
+void *stage_mover(void *ptarg);
+void reclaim_start(void);
+void seg_finaliser_start(void);
+void seg_finaliser_stop(void);
+void mapper_start(void);
+void mapper_stop(void);
+void reclaim_stop(void);
+int recover_main(int argc, char *argv[]);
+void *exporter(void *ptarg);
+void exporter_stop(void);
 
 #endif
\ No newline at end of file
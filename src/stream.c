@@ -0,0 +1,390 @@
+/* @file stream.c
+**
+** streaming BLOW5 output to a receiver over a Unix domain socket or TCP
+** and the bundled receiver (slowION recv) that writes the streams to files
+** @@
+******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "stream.h"
+#include "error.h"
+#include "misc.h"
+
+#define RECV_BUF_SIZE (1024*1024)
+
+//addresses are unix:PATH or tcp:HOST:PORT
+static int stream_socket(const char *addr, int listening){
+    int fd = -1;
+    if(strncmp(addr, "unix:", 5) == 0){
+        struct sockaddr_un sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        if(strlen(addr+5) >= sizeof(sa.sun_path)){
+            ERROR("Socket path %s is too long", addr+5);
+            exit(EXIT_FAILURE);
+        }
+        strcpy(sa.sun_path, addr+5);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        NEG_CHK(fd);
+        if(listening){
+            unlink(sa.sun_path);
+            if(bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(fd, 1024) < 0){
+                ERROR("Could not listen on %s: %s", addr, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+        } else if(connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0){
+            ERROR("Could not connect to %s: %s", addr, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    } else if (strncmp(addr, "tcp:", 4) == 0){
+        char host[1024];
+        const char *port = strrchr(addr+4, ':');
+        if(port == NULL || (size_t)(port - (addr+4)) >= sizeof(host)){
+            ERROR("Malformed address %s. Expected tcp:HOST:PORT", addr);
+            exit(EXIT_FAILURE);
+        }
+        memcpy(host, addr+4, port - (addr+4));
+        host[port - (addr+4)] = '\0';
+        port++;
+
+        struct addrinfo hints, *res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = listening ? AI_PASSIVE : 0;
+        int ret = getaddrinfo(host[0] ? host : NULL, port, &hints, &res);
+        if(ret != 0){
+            ERROR("Could not resolve %s: %s", addr, gai_strerror(ret));
+            exit(EXIT_FAILURE);
+        }
+        fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        NEG_CHK(fd);
+        int one = 1;
+        if(listening){
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if(bind(fd, res->ai_addr, res->ai_addrlen) < 0 || listen(fd, 1024) < 0){
+                ERROR("Could not listen on %s: %s", addr, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            if(connect(fd, res->ai_addr, res->ai_addrlen) < 0){
+                ERROR("Could not connect to %s: %s", addr, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); //flushes are latency sensitive
+        }
+        freeaddrinfo(res);
+    } else {
+        ERROR("Unknown address %s. Expected unix:PATH or tcp:HOST:PORT", addr);
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+/*********************************** sender ***********************************/
+
+stream_t *stream_connect(const char *addr){
+    stream_t *st = (stream_t *)calloc(1, sizeof(stream_t));
+    MALLOC_CHK(st);
+    st->fd = stream_socket(addr, 0);
+    return st;
+}
+
+//send the header and the payload with a single sendmsg, without copying the payload into a frame
+static void stream_send(stream_t *st, uint32_t type, const void *buf, size_t n){
+    stream_hdr_t h = {type, 0, n};
+    struct iovec iov[2];
+    iov[0].iov_base = &h;
+    iov[0].iov_len = sizeof(h);
+    iov[1].iov_base = (void *)buf;
+    iov[1].iov_len = n;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n ? 2 : 1;
+
+    double t0 = realtime();
+    while(msg.msg_iovlen > 0){
+        ssize_t ret = sendmsg(st->fd, &msg, MSG_NOSIGNAL);
+        if(ret < 0){
+            if(errno == EINTR) continue;
+            ERROR("Error sending to the receiver: %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        while(msg.msg_iovlen > 0 && (size_t)ret >= msg.msg_iov[0].iov_len){ //partial send: skip what went out
+            ret -= msg.msg_iov[0].iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if(msg.msg_iovlen > 0){
+            msg.msg_iov[0].iov_base = (char *)msg.msg_iov[0].iov_base + ret;
+            msg.msg_iov[0].iov_len -= ret;
+        }
+    }
+    st->send_time += realtime() - t0;
+    st->bytes += n;
+    st->msgs++;
+}
+
+void stream_open(stream_t *st, const char *name){
+    stream_send(st, STREAM_OPEN, name, strlen(name));
+}
+
+void stream_write(stream_t *st, const void *buf, size_t n){
+    stream_send(st, STREAM_DATA, buf, n);
+}
+
+//returns once the receiver has written everything sent so far
+void stream_flush(stream_t *st){
+    stream_send(st, STREAM_FLUSH, NULL, 0);
+    double t0 = realtime();
+    char ack;
+    ssize_t ret;
+    while((ret = read(st->fd, &ack, 1)) < 0 && errno == EINTR);
+    if(ret != 1){
+        ERROR("%s","Receiver did not acknowledge the flush.");
+        exit(EXIT_FAILURE);
+    }
+    st->flush_time += realtime() - t0;
+}
+
+void stream_close(stream_t *st){
+    stream_flush(st);
+    stream_send(st, STREAM_CLOSE, NULL, 0);
+    close(st->fd);
+    free(st);
+}
+
+/********************************** receiver **********************************/
+
+typedef struct{
+    int sock;
+    const char *dir;
+} conn_t;
+
+static int recv_full(int fd, void *buf, size_t n){
+    size_t got = 0;
+    while(got < n){
+        ssize_t ret = read(fd, (char *)buf + got, n - got);
+        if(ret < 0 && errno == EINTR) continue;
+        if(ret <= 0) return -1;
+        got += ret;
+    }
+    return 0;
+}
+
+static void write_full(int fd, const char *buf, size_t n){
+    while(n > 0){
+        ssize_t ret = write(fd, buf, n);
+        if(ret < 0 && errno == EINTR) continue;
+        if(ret < 0){
+            ERROR("Error writing: %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        buf += ret;
+        n -= ret;
+    }
+}
+
+//move n bytes from the socket to the file. splice() keeps the payload in the kernel where supported
+static void recv_data(int sock, int fd, size_t n, int *pipefd, char *buf){
+#ifdef __linux__
+    if(pipefd[0] >= 0){
+        while(n > 0){
+            ssize_t in = splice(sock, NULL, pipefd[1], NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if(in < 0 && errno == EINTR) continue;
+            if(in < 0 && (errno == EINVAL || errno == ENOSYS)){ //not supported for this socket/file, fall back
+                close(pipefd[0]);
+                close(pipefd[1]);
+                pipefd[0] = pipefd[1] = -1;
+                break;
+            }
+            if(in <= 0){
+                ERROR("Error receiving data: %s", in < 0 ? strerror(errno) : "connection closed");
+                exit(EXIT_FAILURE);
+            }
+            n -= in;
+            while(in > 0){
+                ssize_t out = splice(pipefd[0], NULL, fd, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+                if(out < 0 && errno == EINTR) continue;
+                if(out <= 0){
+                    ERROR("Error writing data: %s", strerror(errno));
+                    exit(EXIT_FAILURE);
+                }
+                in -= out;
+            }
+        }
+    }
+#endif
+    while(n > 0){
+        size_t m = n < RECV_BUF_SIZE ? n : RECV_BUF_SIZE;
+        if(recv_full(sock, buf, m) < 0){
+            ERROR("%s","Connection closed while receiving data.");
+            exit(EXIT_FAILURE);
+        }
+        write_full(fd, buf, m);
+        n -= m;
+    }
+}
+
+static void *recv_conn(void *arg){
+    conn_t *conn = (conn_t *)arg;
+    int sock = conn->sock;
+    int fd = -1;
+    char name[4096] = "";
+    int64_t bytes = 0;
+    double realtime0 = realtime();
+
+    char *buf = (char *)malloc(RECV_BUF_SIZE);
+    MALLOC_CHK(buf);
+    int pipefd[2] = {-1, -1};
+#ifdef __linux__
+    if(pipe(pipefd) < 0){
+        pipefd[0] = pipefd[1] = -1;
+    }
+#endif
+
+    stream_hdr_t h;
+    while(recv_full(sock, &h, sizeof(h)) == 0){
+        if(h.type == STREAM_OPEN){
+            if(h.len >= sizeof(name)){
+                ERROR("File name too long (%ld)", (long)h.len);
+                exit(EXIT_FAILURE);
+            }
+            if(recv_full(sock, name, h.len) < 0) break;
+            name[h.len] = '\0';
+            if(strchr(name, '/') != NULL || strcmp(name, "..") == 0){
+                ERROR("Refusing file name %s", name);
+                exit(EXIT_FAILURE);
+            }
+            char path[8192];
+            sprintf(path, "%s/%s", conn->dir, name);
+            fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if(fd < 0){
+                ERROR("Could not to open file %s: %s", path, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            VERBOSE("receiving %s", path);
+        } else if (h.type == STREAM_DATA){
+            if(fd < 0){
+                ERROR("%s","Data received before a file was opened.");
+                exit(EXIT_FAILURE);
+            }
+            recv_data(sock, fd, h.len, pipefd, buf);
+            bytes += h.len;
+        } else if (h.type == STREAM_FLUSH){ //writes went straight to the fd, so there is nothing buffered here
+            char ack = 1;
+            write_full(sock, &ack, 1);
+        } else if (h.type == STREAM_CLOSE){
+            break;
+        } else {
+            ERROR("Unknown message type %d", h.type);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if(fd >= 0){
+        close(fd);
+    }
+    close(sock);
+    if(pipefd[0] >= 0){
+        close(pipefd[0]);
+        close(pipefd[1]);
+    }
+    free(buf);
+    double t = realtime() - realtime0;
+    fprintf(stderr, "[%s] %s: %.2f MB in %.3f s (%.2f MB/s)\n", __func__, name, bytes/(1024.0*1024.0), t, t > 0 ? bytes/(1024.0*1024.0)/t : 0);
+    free(conn);
+    pthread_exit(0);
+}
+
+static void print_recv_help(FILE *fp_help){
+    fprintf(fp_help,"Usage: slowION recv [OPTIONS]\n");
+    fprintf(fp_help,"\nreceives streamed BLOW5 output (slowION --sink) and writes it to files\n");
+    fprintf(fp_help,"\noptions:\n");
+    fprintf(fp_help,"   -s ADDR                    address to listen on (unix:PATH or tcp:HOST:PORT) [unix:./slowion.sock]\n");
+    fprintf(fp_help,"   -d DIR                     output directory [./output_recv]\n");
+    fprintf(fp_help,"   -n INT                     exit after INT streams have closed (0: run until killed) [0]\n");
+    fprintf(fp_help,"   -h                         help\n");
+}
+
+int recv_main(int argc, char *argv[]){
+    const char *addr = "unix:./slowion.sock";
+    const char *dir = "./output_recv";
+    int nexpect = 0;
+
+    int c;
+    optind = 1;
+    while ((c = getopt(argc, argv, "s:d:n:h")) >= 0) {
+        if (c == 's') {
+            addr = optarg;
+        } else if (c == 'd') {
+            dir = optarg;
+        } else if (c == 'n') {
+            nexpect = atoi(optarg);
+        } else if (c == 'h') {
+            print_recv_help(stdout);
+            exit(EXIT_SUCCESS);
+        } else {
+            print_recv_help(stderr);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct stat st = {0};
+    if (stat(dir, &st) == -1 && mkdir(dir, 0755) == -1) {
+        ERROR("Could not create directory %s. %s", dir, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    int lfd = stream_socket(addr, 1);
+    INFO("listening on %s, writing to %s", addr, dir);
+
+    pthread_t *th = NULL;
+    int nth = 0;
+    while(nexpect == 0 || nth < nexpect){
+        int sock = accept(lfd, NULL, NULL);
+        if(sock < 0){
+            if(errno == EINTR) continue;
+            ERROR("accept failed: %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        conn_t *conn = (conn_t *)malloc(sizeof(conn_t));
+        MALLOC_CHK(conn);
+        conn->sock = sock;
+        conn->dir = dir;
+        th = (pthread_t *)realloc(th, (nth+1) * sizeof(pthread_t));
+        MALLOC_CHK(th);
+        int ret = pthread_create(&th[nth], NULL, recv_conn, (void *)conn);
+        NEG_CHK(ret);
+        nth++;
+    }
+
+    for(int i=0; i<nth; i++){
+        int ret = pthread_join(th[i], NULL);
+        NEG_CHK(ret);
+    }
+    free(th);
+    close(lfd);
+    if(strncmp(addr, "unix:", 5) == 0){
+        unlink(addr+5);
+    }
+    return 0;
+}
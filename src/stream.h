@@ -0,0 +1,43 @@
+/* @file stream.h
+**
+** streaming BLOW5 output to a receiver over a Unix domain socket or TCP
+** @@
+******************************************************************************/
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//message types
+#define STREAM_OPEN 1  //payload is the file name
+#define STREAM_DATA 2  //payload is appended to the file
+#define STREAM_FLUSH 3 //receiver acknowledges once all previous data is written
+#define STREAM_CLOSE 4
+
+//fixed size message header, sent in host byte order (sender and receiver are expected to be the same architecture)
+typedef struct{
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t len;
+} stream_hdr_t;
+
+//sender side of one output file
+typedef struct{
+    int fd;
+    int64_t bytes; //payload bytes sent
+    int64_t msgs;
+    double send_time; //time spent in sendmsg
+    double flush_time; //time spent waiting for flush acknowledgements
+} stream_t;
+
+stream_t *stream_connect(const char *addr);
+void stream_open(stream_t *st, const char *name);
+void stream_write(stream_t *st, const void *buf, size_t n);
+void stream_flush(stream_t *st);
+void stream_close(stream_t *st);
+
+int recv_main(int argc, char *argv[]);
+
+#endif
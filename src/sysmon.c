@@ -0,0 +1,332 @@
+/* @file sysmon.c
+**
+** sampling of kernel I/O, CPU and pressure counters during a run
+** @@
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "sysmon.h"
+#include "metrics.h"
+#include "error.h"
+#include "misc.h"
+
+#define SYSMON_MAX_DEV 16
+#define SECTOR_SIZE 512 //unit of /proc/diskstats, whatever the device's own sector size
+
+//cumulative counters at one point in time
+typedef struct{
+    int64_t rchar, wchar; //bytes passed to read/write calls
+    int64_t read_bytes, write_bytes; //bytes the processes caused to be fetched from or sent to storage
+    double cpu_user, cpu_sys; //seconds, summed over threads
+    double cpu_max_thread; //seconds of the busiest thread
+    int64_t dev_rsect, dev_wsect; //sectors, summed over the devices of the output directories
+    int64_t dev_io_ms; //time the devices had I/O in flight
+    int64_t psi_some, psi_full; //us of I/O stall (some/all non-idle tasks)
+} sys_snap_t;
+
+struct sysmon_s{
+    FILE *fp;
+    double interval;
+    pid_t *pids;
+    int npid;
+    sys_snap_t *last_pid; //last good reading of each pid, kept after it exits
+    double *last_task; //per-thread CPU seconds in the previous sample, indexed by slot
+    pid_t *task_id;
+    int ntask, task_cap;
+    dev_t dev[SYSMON_MAX_DEV];
+    char dev_name[SYSMON_MAX_DEV][64];
+    int ndev;
+    int has_io, has_psi, has_dev;
+    sys_snap_t first, prev;
+    double t0;
+    double max_thread_busy; //highest share of one interval used by a single thread
+    double peak_psi_some; //highest share of one interval with some tasks stalled on I/O
+    int64_t nsample;
+    volatile int done;
+    pthread_t th;
+};
+
+static int read_pid_io(pid_t pid, sys_snap_t *s){
+    char path[64];
+    sprintf(path, "/proc/%d/io", (int)pid);
+    FILE *fp = fopen(path, "r");
+    if(fp == NULL){
+        return -1;
+    }
+    char key[64];
+    long long v;
+    while(fscanf(fp, "%63[^:]: %lld\n", key, &v) == 2){
+        if(strcmp(key, "rchar") == 0) s->rchar = v;
+        else if(strcmp(key, "wchar") == 0) s->wchar = v;
+        else if(strcmp(key, "read_bytes") == 0) s->read_bytes = v;
+        else if(strcmp(key, "write_bytes") == 0) s->write_bytes = v;
+    }
+    fclose(fp);
+    return 0;
+}
+
+//utime and stime in seconds from a /proc stat file, of a process (including its exited threads) or of one thread
+static int read_stat_cpu(const char *path, double *user, double *sys){
+    FILE *fp = fopen(path, "r");
+    if(fp == NULL){
+        return -1;
+    }
+    char buf[1024];
+    size_t n = fread(buf, 1, sizeof(buf)-1, fp);
+    fclose(fp);
+    buf[n] = '\0';
+    char *p = strrchr(buf, ')'); //the thread name may contain anything
+    unsigned long long ut, st;
+    if(p == NULL || sscanf(p+2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &ut, &st) != 2){
+        return -1;
+    }
+    double hz = sysconf(_SC_CLK_TCK);
+    *user = ut/hz;
+    *sys = st/hz;
+    return 0;
+}
+
+//CPU of every pid, and of the busiest of their threads over the last interval
+static void read_cpu(sysmon_t *sm, sys_snap_t *s, double dt){
+    for(int k=0; k<sm->npid; k++){
+        char path[320];
+        double pu, ps;
+        sprintf(path, "/proc/%d/stat", (int)sm->pids[k]);
+        if(read_stat_cpu(path, &pu, &ps) == 0){ //else exited, keep what it had
+            sm->last_pid[k].cpu_user = pu;
+            sm->last_pid[k].cpu_sys = ps;
+        }
+        s->cpu_user += sm->last_pid[k].cpu_user;
+        s->cpu_sys += sm->last_pid[k].cpu_sys;
+
+        sprintf(path, "/proc/%d/task", (int)sm->pids[k]);
+        DIR *d = opendir(path);
+        if(d == NULL){
+            continue;
+        }
+        struct dirent *e;
+        while((e = readdir(d)) != NULL){
+            if(e->d_name[0] == '.') continue;
+            double u, st;
+            snprintf(path, sizeof(path), "/proc/%d/task/%s/stat", (int)sm->pids[k], e->d_name);
+            if(read_stat_cpu(path, &u, &st) != 0) continue;
+
+            pid_t tid = atoi(e->d_name);
+            int j = 0;
+            while(j < sm->ntask && sm->task_id[j] != tid) j++;
+            if(j == sm->ntask){
+                if(sm->ntask == sm->task_cap){
+                    sm->task_cap = sm->task_cap ? sm->task_cap*2 : 64;
+                    sm->task_id = (pid_t *)realloc(sm->task_id, sm->task_cap*sizeof(pid_t));
+                    sm->last_task = (double *)realloc(sm->last_task, sm->task_cap*sizeof(double));
+                    MALLOC_CHK(sm->task_id);
+                    MALLOC_CHK(sm->last_task);
+                }
+                sm->task_id[j] = tid;
+                sm->last_task[j] = 0;
+                sm->ntask++;
+            }
+            double busy = u + st - sm->last_task[j];
+            sm->last_task[j] = u + st;
+            if(busy > s->cpu_max_thread) s->cpu_max_thread = busy;
+            if(dt > 0 && busy/dt > sm->max_thread_busy) sm->max_thread_busy = busy/dt;
+        }
+        closedir(d);
+    }
+}
+
+static int read_psi(sys_snap_t *s){
+    FILE *fp = fopen("/proc/pressure/io", "r");
+    if(fp == NULL){
+        return -1;
+    }
+    char kind[8];
+    long long total;
+    int n = 0;
+    while(fscanf(fp, "%7s avg10=%*f avg60=%*f avg300=%*f total=%lld\n", kind, &total) == 2){
+        if(strcmp(kind, "some") == 0) s->psi_some = total;
+        else if(strcmp(kind, "full") == 0) s->psi_full = total;
+        n++;
+    }
+    fclose(fp);
+    return n > 0 ? 0 : -1;
+}
+
+static int read_diskstats(sysmon_t *sm, sys_snap_t *s){
+    FILE *fp = fopen("/proc/diskstats", "r");
+    if(fp == NULL){
+        return -1;
+    }
+    char line[512];
+    int found = 0;
+    while(fgets(line, sizeof(line), fp)){
+        unsigned int ma, mi;
+        char name[64];
+        unsigned long long rd, rd_merged, rsect, rd_ms, wr, wr_merged, wsect, wr_ms, inflight, io_ms;
+        if(sscanf(line, "%u %u %63s %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu", &ma, &mi, name,
+                &rd, &rd_merged, &rsect, &rd_ms, &wr, &wr_merged, &wsect, &wr_ms, &inflight, &io_ms) != 13){
+            continue;
+        }
+        for(int k=0; k<sm->ndev; k++){
+            if(major(sm->dev[k]) == ma && minor(sm->dev[k]) == mi){
+                s->dev_rsect += rsect;
+                s->dev_wsect += wsect;
+                s->dev_io_ms += io_ms;
+                snprintf(sm->dev_name[k], sizeof(sm->dev_name[k]), "%s", name);
+                found++;
+            }
+        }
+    }
+    fclose(fp);
+    return found > 0 ? 0 : -1;
+}
+
+static void sysmon_sample(sysmon_t *sm, sys_snap_t *s, double dt){
+    memset(s, 0, sizeof(sys_snap_t));
+    for(int k=0; k<sm->npid; k++){
+        sys_snap_t p = {0};
+        if(read_pid_io(sm->pids[k], &p) == 0){
+            sm->last_pid[k].rchar = p.rchar;
+            sm->last_pid[k].wchar = p.wchar;
+            sm->last_pid[k].read_bytes = p.read_bytes;
+            sm->last_pid[k].write_bytes = p.write_bytes;
+            sm->has_io = 1;
+        }
+        s->rchar += sm->last_pid[k].rchar;
+        s->wchar += sm->last_pid[k].wchar;
+        s->read_bytes += sm->last_pid[k].read_bytes;
+        s->write_bytes += sm->last_pid[k].write_bytes;
+    }
+    read_cpu(sm, s, dt);
+    if(read_psi(s) == 0) sm->has_psi = 1;
+    if(read_diskstats(sm, s) == 0) sm->has_dev = 1;
+}
+
+static void sysmon_row(sysmon_t *sm, sys_snap_t *s, double dt){
+    sys_snap_t *p = &sm->prev;
+    double psi_some = (s->psi_some - p->psi_some)/1e6;
+    if(dt > 0 && psi_some/dt > sm->peak_psi_some) sm->peak_psi_some = psi_some/dt;
+    if(sm->fp){
+        fprintf(sm->fp, "%.3f,%.3f,%.3f,%.3f,%.3f,%ld,%ld,%ld,%ld,%ld,%ld,%ld,%.6f,%.6f\n", metrics_time(), dt,
+            s->cpu_user - p->cpu_user, s->cpu_sys - p->cpu_sys, s->cpu_max_thread,
+            s->rchar - p->rchar, s->wchar - p->wchar, s->read_bytes - p->read_bytes, s->write_bytes - p->write_bytes,
+            (s->dev_rsect - p->dev_rsect)*SECTOR_SIZE, (s->dev_wsect - p->dev_wsect)*SECTOR_SIZE, s->dev_io_ms - p->dev_io_ms,
+            psi_some, (s->psi_full - p->psi_full)/1e6);
+    }
+    sm->prev = *s;
+    sm->nsample++;
+}
+
+static void *sysmon_thread(void *arg){
+    sysmon_t *sm = (sysmon_t *)arg;
+    struct timespec dl;
+    deadline_init(&dl);
+    double last = realtime();
+    while(!sm->done){
+        deadline_add(&dl, sm->interval);
+        while(!sm->done && deadline_slack(&dl) > 0){ //wake up regularly so that stopping is quick
+            struct timespec ts = {0, 100*1000*1000};
+            nanosleep(&ts, NULL);
+        }
+        double now = realtime();
+        sys_snap_t s;
+        sysmon_sample(sm, &s, now - last);
+        sysmon_row(sm, &s, now - last);
+        last = now;
+    }
+    pthread_exit(0);
+}
+
+sysmon_t *sysmon_start(const char *path, double interval, char **dirs, int ndir, const pid_t *pids, int npid){
+    sysmon_t *sm = (sysmon_t *)calloc(1, sizeof(sysmon_t));
+    MALLOC_CHK(sm);
+    sm->interval = interval;
+    sm->npid = npid;
+    sm->pids = (pid_t *)malloc(npid * sizeof(pid_t));
+    MALLOC_CHK(sm->pids);
+    memcpy(sm->pids, pids, npid * sizeof(pid_t));
+    sm->last_pid = (sys_snap_t *)calloc(npid, sizeof(sys_snap_t));
+    MALLOC_CHK(sm->last_pid);
+
+    for(int d=0; d<ndir; d++){
+        struct stat st = {0};
+        if(stat(dirs[d], &st) != 0){
+            continue;
+        }
+        int k = 0;
+        while(k < sm->ndev && sm->dev[k] != st.st_dev) k++;
+        if(k == sm->ndev && sm->ndev < SYSMON_MAX_DEV){
+            sm->dev[sm->ndev] = st.st_dev;
+            sprintf(sm->dev_name[sm->ndev], "%u:%u", major(st.st_dev), minor(st.st_dev));
+            sm->ndev++;
+        }
+    }
+
+    if(path){
+        sm->fp = fopen(path, "w");
+        F_CHK(sm->fp, path);
+        fprintf(sm->fp, "t,dt,cpu_user,cpu_sys,cpu_max_thread,rchar,wchar,read_bytes,write_bytes,dev_read_bytes,dev_write_bytes,dev_io_ms,psi_some,psi_full\n");
+    }
+
+    sm->t0 = realtime();
+    sysmon_sample(sm, &sm->first, 0);
+    sm->prev = sm->first;
+
+    int ret = pthread_create(&sm->th, NULL, sysmon_thread, (void *)sm);
+    NEG_CHK(ret);
+    return sm;
+}
+
+void sysmon_stop(sysmon_t *sm, int64_t logical_bytes){
+    sm->done = 1;
+    int ret = pthread_join(sm->th, NULL);
+    NEG_CHK(ret);
+    if(sm->fp){
+        fclose(sm->fp);
+    }
+
+    double elapsed = realtime() - sm->t0;
+    sys_snap_t *a = &sm->first;
+    sys_snap_t *b = &sm->prev;
+    double mb = 1024.0*1024.0;
+    fprintf(stderr, "[%s] %ld samples over %.3f s\n", __func__, sm->nsample, elapsed);
+    fprintf(stderr, "[%s] cpu: user %.2f s, sys %.2f s (%.2f cores on average), busiest thread %.0f%% of an interval at peak\n", __func__,
+        b->cpu_user - a->cpu_user, b->cpu_sys - a->cpu_sys, elapsed > 0 ? (b->cpu_user - a->cpu_user + b->cpu_sys - a->cpu_sys)/elapsed : 0, sm->max_thread_busy*100);
+    if(sm->has_io){
+        fprintf(stderr, "[%s] process io: written %.2f MB by the application, %.2f MB in write calls, %.2f MB sent to storage, %.2f MB read from storage\n", __func__,
+            logical_bytes/mb, (b->wchar - a->wchar)/mb, (b->write_bytes - a->write_bytes)/mb, (b->read_bytes - a->read_bytes)/mb);
+    } else {
+        fprintf(stderr, "[%s] process io: /proc/PID/io unavailable\n", __func__);
+    }
+    if(sm->has_dev){
+        int64_t dev_w = (b->dev_wsect - a->dev_wsect)*SECTOR_SIZE;
+        fprintf(stderr, "[%s] devices", __func__);
+        for(int k=0; k<sm->ndev; k++) fprintf(stderr, " %s", sm->dev_name[k]);
+        fprintf(stderr, ": written %.2f MB, read %.2f MB, busy %.1f%% of the time, write amplification %.2f (device bytes per application byte; includes other processes on the devices, excludes data still in the page cache)\n",
+            dev_w/mb, (b->dev_rsect - a->dev_rsect)*SECTOR_SIZE/mb, elapsed > 0 ? (b->dev_io_ms - a->dev_io_ms)/10.0/elapsed : 0,
+            logical_bytes > 0 ? (double)dev_w/logical_bytes : 0);
+    } else {
+        fprintf(stderr, "[%s] devices: output directories not found in /proc/diskstats (e.g. tmpfs or overlay)\n", __func__);
+    }
+    if(sm->has_psi){
+        fprintf(stderr, "[%s] io pressure: some tasks stalled %.3f s (%.1f%%, peak %.1f%% of an interval), all tasks stalled %.3f s\n", __func__,
+            (b->psi_some - a->psi_some)/1e6, elapsed > 0 ? (b->psi_some - a->psi_some)/1e4/elapsed : 0, sm->peak_psi_some*100, (b->psi_full - a->psi_full)/1e6);
+    } else {
+        fprintf(stderr, "[%s] io pressure: /proc/pressure/io unavailable\n", __func__);
+    }
+
+    free(sm->pids);
+    free(sm->last_pid);
+    free(sm->task_id);
+    free(sm->last_task);
+    free(sm);
+}
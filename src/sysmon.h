@@ -0,0 +1,24 @@
+/* @file sysmon.h
+**
+** sampling of kernel I/O, CPU and pressure counters during a run
+** @@
+******************************************************************************/
+
+#ifndef SYSMON_H
+#define SYSMON_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef struct sysmon_s sysmon_t;
+
+//sample every interval seconds the processes in pids (their /proc/PID/io and per-thread CPU time), I/O pressure,
+//and the block devices under dirs. Each sample is a CSV row in path (NULL for none), timed like the metrics
+//so that the two can be joined. Linux only; counters that cannot be read are reported as unavailable
+sysmon_t *sysmon_start(const char *path, double interval, char **dirs, int ndir, const pid_t *pids, int npid);
+
+//stop sampling and report write amplification (device bytes against logical_bytes written by the application),
+//I/O pressure stall time and CPU use over the run
+void sysmon_stop(sysmon_t *sm, int64_t logical_bytes);
+
+#endif
@@ -0,0 +1,139 @@
+/* @file trace.c
+**
+** per-thread spans of the hot-path stages, dumped as a Chrome trace (chrome://tracing, Perfetto)
+** @@
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "trace.h"
+#include "error.h"
+
+int trace_on = 0;
+int64_t trace_cap = 0;
+__thread trace_buf_t *trace_tls = NULL;
+
+static int trace_fd = -1;
+static int64_t trace_t0 = 0;
+static int trace_pid = 0; //process that opened the trace
+static trace_buf_t **trace_bufs = NULL; //every registered thread of this process
+static int trace_nbuf = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *ev_name[TR_NEV] = {"gen", "slow5fy", "islow5_chunk_write", "fflush", "islow5_to_slow5", "slow5_get_next", "sleep", "unlink"};
+
+static int64_t mono_us(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+int64_t trace_now(void){
+    return mono_us() - trace_t0;
+}
+
+static void trace_write(const char *buf, size_t len){
+    if(write(trace_fd, buf, len) != (ssize_t)len){
+        WARNING("Error writing trace: %s", strerror(errno));
+    }
+}
+
+void trace_open(const char *path, int64_t cap){
+    if(path == NULL){
+        return;
+    }
+    //JSON array format, where the closing bracket is optional. O_APPEND keeps the writes of worker processes whole
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if(trace_fd < 0){
+        ERROR("Could not open trace file %s: %s", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    trace_write("[\n", 2);
+    trace_cap = cap;
+    trace_t0 = mono_us();
+    trace_pid = (int)getpid();
+    trace_on = 1;
+}
+
+void trace_thread(const char *name){
+    if(!trace_on){
+        return;
+    }
+    trace_buf_t *b = (trace_buf_t *)calloc(1, sizeof(trace_buf_t));
+    MALLOC_CHK(b);
+    b->span = (trace_span_t *)malloc(trace_cap * sizeof(trace_span_t));
+    MALLOC_CHK(b->span);
+    snprintf(b->name, sizeof(b->name), "%s", name);
+
+    pthread_mutex_lock(&trace_lock);
+    trace_bufs = (trace_buf_t **)realloc(trace_bufs, (trace_nbuf+1) * sizeof(trace_buf_t *));
+    MALLOC_CHK(trace_bufs);
+    b->tid = trace_nbuf;
+    trace_bufs[trace_nbuf++] = b;
+    pthread_mutex_unlock(&trace_lock);
+
+    trace_tls = b;
+}
+
+void trace_dump(void){
+    if(!trace_on || trace_nbuf == 0){
+        return;
+    }
+    int pid = (int)getpid();
+    size_t cap = 1 << 20;
+    char *buf = (char *)malloc(cap);
+    MALLOC_CHK(buf);
+    size_t len = 0;
+    int64_t kept = 0, dropped = 0;
+
+    if(pid != trace_pid){ //a worker process
+        len += sprintf(buf + len, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"slowION worker\"}},\n", pid);
+    }
+    pthread_mutex_lock(&trace_lock);
+    for(int k=0; k<trace_nbuf; k++){
+        trace_buf_t *b = trace_bufs[k];
+        len += sprintf(buf + len, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n", pid, b->tid, b->name);
+        int64_t first = b->n > trace_cap ? b->n - trace_cap : 0;
+        for(int64_t i=first; i<b->n; i++){
+            if(len + 256 > cap){ //each write ends on a whole event
+                trace_write(buf, len);
+                len = 0;
+            }
+            trace_span_t *s = &b->span[i % trace_cap];
+            len += sprintf(buf + len, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%ld,\"dur\":%d},\n",
+                ev_name[s->ev], pid, b->tid, s->t0, s->dur);
+        }
+        kept += b->n - first;
+        dropped += first;
+        free(b->span);
+        free(b);
+    }
+    free(trace_bufs);
+    trace_bufs = NULL;
+    trace_nbuf = 0;
+    pthread_mutex_unlock(&trace_lock);
+
+    trace_write(buf, len);
+    free(buf);
+    fprintf(stderr, "[%s] pid %d: %ld spans written, %ld oldest overwritten\n", __func__, pid, kept, dropped);
+}
+
+void trace_close(void){
+    if(trace_fd < 0){
+        return;
+    }
+    char buf[128];
+    int len = sprintf(buf, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"slowION\"}}\n]\n", (int)getpid());
+    trace_write(buf, len);
+    close(trace_fd);
+    trace_fd = -1;
+    trace_on = 0;
+}
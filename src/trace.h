@@ -0,0 +1,70 @@
+/* @file trace.h
+**
+** per-thread spans of the hot-path stages, dumped as a Chrome trace (chrome://tracing, Perfetto)
+** @@
+******************************************************************************/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+//span types
+enum trace_ev{
+    TR_GEN, //signal generation of a chunk
+    TR_SLOW5FY, //a single-chunk read written to the output
+    TR_ICHUNK, //islow5_chunk_write
+    TR_FLUSH, //flush of an output
+    TR_CONV, //islow5_to_slow5
+    TR_GETNEXT, //a record read back
+    TR_SLEEP, //waiting for the next deadline
+    TR_UNLINK, //an intermediate file deleted
+    TR_NEV
+};
+
+typedef struct{
+    int64_t t0; //us since trace_open
+    int32_t dur; //us
+    int32_t ev;
+} trace_span_t;
+
+//spans of one thread. Once full, the oldest are overwritten
+typedef struct{
+    char name[64];
+    int32_t tid;
+    int64_t n; //spans recorded, including overwritten ones
+    trace_span_t *span;
+} trace_buf_t;
+
+extern int trace_on;
+extern int64_t trace_cap;
+extern __thread trace_buf_t *trace_tls;
+
+//path NULL disables tracing. cap is the number of spans kept per thread.
+//Must be called before worker processes are forked, they append to the same file
+void trace_open(const char *path, int64_t cap);
+//register the calling thread
+void trace_thread(const char *name);
+//append the spans of every thread of this process to the trace file
+void trace_dump(void);
+void trace_close(void);
+
+int64_t trace_now(void);
+
+static inline int64_t trace_begin(void){
+    return trace_on ? trace_now() : 0;
+}
+
+static inline void trace_end(int ev, int64_t t0){
+    trace_buf_t *b = trace_tls;
+    if(b == NULL){
+        return;
+    }
+    trace_span_t *s = &b->span[b->n % trace_cap];
+    s->t0 = t0;
+    s->dur = (int32_t)(trace_now() - t0);
+    s->ev = ev;
+    b->n++;
+}
+
+#endif
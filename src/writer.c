@@ -0,0 +1,415 @@
+/* @file writer.c
+**
+** output backends other than BLOW5 (which lives in slowion.c): a raw sample file with an index,
+** and a columnar layout with the signals of a batch in one block and the metadata in a separate table
+** @@
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "writer.h"
+#include "error.h"
+
+#define COL_BATCH_BYTES (64*1024*1024) //a batch is written out before the next flush once its signal block reaches this
+
+static int open_file(const char *path, const char *ext, int flags){
+    char name[4200];
+    sprintf(name, "%s%s", path, ext);
+    int fd = open(name, flags, 0644);
+    if(fd < 0){
+        ERROR("Could not to open file %s: %s", name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+static void pwrite_all(int fd, const void *buf, size_t n, int64_t off){
+    while(n > 0){
+        ssize_t ret = pwrite(fd, buf, n, off);
+        if(ret < 0){
+            if(errno == EINTR) continue;
+            ERROR("Error writing output: %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        buf = (const char *)buf + ret;
+        n -= ret;
+        off += ret;
+    }
+}
+
+//returns 0 if all n bytes were read, -1 on an error or a short file
+static int pread_all(int fd, void *buf, size_t n, int64_t off){
+    while(n > 0){
+        ssize_t ret = pread(fd, buf, n, off);
+        if(ret < 0 && errno == EINTR) continue;
+        if(ret <= 0) return -1;
+        buf = (char *)buf + ret;
+        n -= ret;
+        off += ret;
+    }
+    return 0;
+}
+
+static void grow(void **p, int64_t *cap, int64_t need, size_t size){
+    if(need <= *cap) return;
+    int64_t c = *cap ? *cap : 1024;
+    while(c < need) c *= 2;
+    *p = realloc(*p, c * size);
+    MALLOC_CHK(*p);
+    *cap = c;
+}
+
+
+/******************************** raw ********************************/
+
+//samples of every read back to back in posN_T.raw, and a fixed-size entry per read in posN_T.ridx
+typedef struct{
+    int64_t off; //first sample of the read, counted in samples from the start of the data file
+    int64_t n;
+    int32_t chan;
+    int32_t read_number;
+} raw_idx_t;
+
+typedef struct{
+    FILE *data;
+    FILE *idx;
+    int dir;
+    int64_t off; //samples written
+    int64_t start; //first sample of the read being appended
+} raw_w_t;
+
+static void *raw_open(const wloc_t *loc){
+    raw_w_t *w = (raw_w_t *)calloc(1, sizeof(raw_w_t));
+    MALLOC_CHK(w);
+    w->data = fdopen(open_file(loc->path, ".raw", O_WRONLY | O_CREAT | O_TRUNC), "w");
+    w->idx = fdopen(open_file(loc->path, ".ridx", O_WRONLY | O_CREAT | O_TRUNC), "w");
+    if(w->data == NULL || w->idx == NULL){
+        ERROR("Error opening raw output %s: %s", loc->path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    w->dir = loc->dir;
+    return w;
+}
+
+static void raw_append_chunk(void *p, const int16_t *samples, int64_t n){
+    raw_w_t *w = (raw_w_t *)p;
+    if(fwrite(samples, sizeof(int16_t), n, w->data) != (size_t)n){
+        ERROR("Error writing raw output: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    w->off += n;
+    dir_account(w->dir, n*sizeof(int16_t), 0);
+}
+
+static int64_t raw_append_read(void *p, const wmeta_t *m, const int16_t *samples, int64_t n){
+    raw_w_t *w = (raw_w_t *)p;
+    raw_append_chunk(w, samples, n);
+    raw_idx_t e = {w->start, w->off - w->start, m->chan, m->read_number};
+    if(fwrite(&e, sizeof(e), 1, w->idx) != 1){
+        ERROR("Error writing raw index: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    dir_account(w->dir, sizeof(e), 0);
+    w->start = w->off;
+    return e.n*sizeof(int16_t) + sizeof(e);
+}
+
+//samples before the index, so that an entry the reader can see never points past the data
+static void raw_flush(void *p){
+    raw_w_t *w = (raw_w_t *)p;
+    if(fflush(w->data) != 0 || fflush(w->idx) != 0){
+        ERROR("Error flushing raw output: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void raw_close(void *p){
+    raw_w_t *w = (raw_w_t *)p;
+    raw_flush(w);
+    fclose(w->data);
+    fclose(w->idx);
+    free(w);
+}
+
+typedef struct{
+    int data;
+    int idx;
+    int dir;
+    int64_t nread;
+    int16_t *buf;
+    int64_t cap;
+} raw_r_t;
+
+static void *raw_ropen(const wloc_t *loc){
+    raw_r_t *r = (raw_r_t *)calloc(1, sizeof(raw_r_t));
+    MALLOC_CHK(r);
+    r->data = open_file(loc->path, ".raw", O_RDONLY);
+    r->idx = open_file(loc->path, ".ridx", O_RDONLY);
+    r->dir = loc->dir;
+    return r;
+}
+
+static int64_t raw_rnext(void *p, const int16_t **samples, int64_t *n){
+    raw_r_t *r = (raw_r_t *)p;
+    raw_idx_t e;
+    if(pread_all(r->idx, &e, sizeof(e), r->nread*sizeof(e)) < 0 || e.n < 0){
+        return -1;
+    }
+    grow((void **)&r->buf, &r->cap, e.n, sizeof(int16_t));
+    if(pread_all(r->data, r->buf, e.n*sizeof(int16_t), e.off*sizeof(int16_t)) < 0){
+        return -1;
+    }
+    int64_t bytes = e.n*sizeof(int16_t) + sizeof(e);
+    dir_account(r->dir, 0, bytes);
+    r->nread++;
+    *samples = r->buf;
+    *n = e.n;
+    return bytes;
+}
+
+//entries are fixed size, so nothing needs to be read to step over one
+static void raw_rskip(void *p, int64_t file_bytes){
+    raw_r_t *r = (raw_r_t *)p;
+    r->nread++;
+}
+
+static void raw_rclose(void *p){
+    raw_r_t *r = (raw_r_t *)p;
+    close(r->data);
+    close(r->idx);
+    free(r->buf);
+    free(r);
+}
+
+const writer_ops_t raw_writer = {
+    "raw", 0,
+    raw_open, raw_append_chunk, raw_append_read, raw_flush, raw_close, NULL,
+    raw_ropen, raw_rnext, raw_rskip, raw_rclose,
+};
+
+
+/******************************** columnar ********************************/
+
+//reads are buffered and written out a batch at a time, normally once per flush. The signals of a batch go to
+//posN_T.col as a single block, and the metadata to posN_T.meta as a header followed by one column per field:
+//int32 chan[nrec], int32 read_number[nrec], int64 len[nrec]
+typedef struct{
+    int64_t nrec;
+    int64_t block; //offset of the signal block in the data file
+} col_hdr_t;
+
+#define COL_ROW_BYTES (2*sizeof(int32_t) + sizeof(int64_t))
+
+typedef struct{
+    int data;
+    int meta;
+    int dir;
+    int64_t data_off;
+    int64_t meta_off;
+
+    //batch being built
+    int64_t nrec;
+    int64_t cap;
+    int32_t *chan;
+    int32_t *read_number;
+    int64_t *len;
+    int16_t *sig;
+    int64_t sig_n;
+    int64_t sig_cap;
+    int64_t start; //first sample of the read being appended
+    void *mbuf; //serialised metadata of a batch
+    int64_t mbuf_cap;
+} col_w_t;
+
+static void *col_open(const wloc_t *loc){
+    col_w_t *w = (col_w_t *)calloc(1, sizeof(col_w_t));
+    MALLOC_CHK(w);
+    w->data = open_file(loc->path, ".col", O_WRONLY | O_CREAT | O_TRUNC);
+    w->meta = open_file(loc->path, ".meta", O_WRONLY | O_CREAT | O_TRUNC);
+    w->dir = loc->dir;
+    return w;
+}
+
+static void col_write_batch(col_w_t *w){
+    if(w->nrec == 0){
+        return;
+    }
+    size_t sbytes = w->sig_n*sizeof(int16_t);
+    pwrite_all(w->data, w->sig, sbytes, w->data_off);
+
+    col_hdr_t h = {w->nrec, w->data_off};
+    int64_t mbytes = sizeof(h) + w->nrec*COL_ROW_BYTES;
+    grow(&w->mbuf, &w->mbuf_cap, mbytes, 1);
+    char *m = (char *)w->mbuf;
+    memcpy(m, &h, sizeof(h));
+    m += sizeof(h);
+    memcpy(m, w->chan, w->nrec*sizeof(int32_t));
+    m += w->nrec*sizeof(int32_t);
+    memcpy(m, w->read_number, w->nrec*sizeof(int32_t));
+    m += w->nrec*sizeof(int32_t);
+    memcpy(m, w->len, w->nrec*sizeof(int64_t));
+    pwrite_all(w->meta, w->mbuf, mbytes, w->meta_off);
+
+    dir_account(w->dir, sbytes + mbytes, 0);
+    w->data_off += sbytes;
+    w->meta_off += mbytes;
+    w->nrec = 0;
+    w->sig_n = 0;
+    w->start = 0;
+}
+
+static void col_append_chunk(void *p, const int16_t *samples, int64_t n){
+    col_w_t *w = (col_w_t *)p;
+    grow((void **)&w->sig, &w->sig_cap, w->sig_n + n, sizeof(int16_t));
+    memcpy(w->sig + w->sig_n, samples, n*sizeof(int16_t));
+    w->sig_n += n;
+}
+
+static int64_t col_append_read(void *p, const wmeta_t *m, const int16_t *samples, int64_t n){
+    col_w_t *w = (col_w_t *)p;
+    col_append_chunk(w, samples, n);
+    if(w->nrec == w->cap){
+        w->cap = w->cap ? w->cap*2 : 1024;
+        w->chan = (int32_t *)realloc(w->chan, w->cap*sizeof(int32_t));
+        MALLOC_CHK(w->chan);
+        w->read_number = (int32_t *)realloc(w->read_number, w->cap*sizeof(int32_t));
+        MALLOC_CHK(w->read_number);
+        w->len = (int64_t *)realloc(w->len, w->cap*sizeof(int64_t));
+        MALLOC_CHK(w->len);
+    }
+    int64_t len = w->sig_n - w->start;
+    w->chan[w->nrec] = m->chan;
+    w->read_number[w->nrec] = m->read_number;
+    w->len[w->nrec] = len;
+    w->nrec++;
+    w->start = w->sig_n;
+    if(w->sig_n*sizeof(int16_t) >= COL_BATCH_BYTES){
+        col_write_batch(w);
+    }
+    return len*sizeof(int16_t) + COL_ROW_BYTES;
+}
+
+static void col_flush(void *p){
+    col_write_batch((col_w_t *)p);
+}
+
+static void col_close(void *p){
+    col_w_t *w = (col_w_t *)p;
+    col_write_batch(w);
+    close(w->data);
+    close(w->meta);
+    free(w->chan);
+    free(w->read_number);
+    free(w->len);
+    free(w->sig);
+    free(w->mbuf);
+    free(w);
+}
+
+typedef struct{
+    int data;
+    int meta;
+    int dir;
+    int64_t meta_off; //next batch in the metadata table
+
+    col_hdr_t hdr; //current batch
+    int64_t cap;
+    void *cols; //its metadata columns
+    int32_t *chan;
+    int32_t *read_number;
+    int64_t *len;
+    int64_t i; //next record of the batch
+    int64_t at; //its first sample in the block
+
+    int loaded; //the signal block of the batch has been read
+    int16_t *sig;
+    int64_t sig_cap;
+} col_r_t;
+
+static void *col_ropen(const wloc_t *loc){
+    col_r_t *r = (col_r_t *)calloc(1, sizeof(col_r_t));
+    MALLOC_CHK(r);
+    r->data = open_file(loc->path, ".col", O_RDONLY);
+    r->meta = open_file(loc->path, ".meta", O_RDONLY);
+    r->dir = loc->dir;
+    return r;
+}
+
+//load the metadata of the next batch once the current one is used up
+static int col_batch(col_r_t *r){
+    if(r->i < r->hdr.nrec){
+        return 0;
+    }
+    if(pread_all(r->meta, &r->hdr, sizeof(r->hdr), r->meta_off) < 0 || r->hdr.nrec <= 0){
+        return -1;
+    }
+    int64_t n = r->hdr.nrec;
+    grow(&r->cols, &r->cap, n*COL_ROW_BYTES, 1);
+    if(pread_all(r->meta, r->cols, n*COL_ROW_BYTES, r->meta_off + sizeof(r->hdr)) < 0){
+        return -1;
+    }
+    dir_account(r->dir, 0, sizeof(r->hdr) + n*COL_ROW_BYTES);
+    r->meta_off += sizeof(r->hdr) + n*COL_ROW_BYTES;
+    r->chan = (int32_t *)r->cols;
+    r->read_number = r->chan + n;
+    r->len = (int64_t *)(r->read_number + n);
+    r->i = 0;
+    r->at = 0;
+    r->loaded = 0;
+    return 0;
+}
+
+static int64_t col_rnext(void *p, const int16_t **samples, int64_t *n){
+    col_r_t *r = (col_r_t *)p;
+    if(col_batch(r) < 0){
+        return -1;
+    }
+    if(!r->loaded){ //the whole block in a single read
+        int64_t total = 0;
+        for(int64_t k=0; k<r->hdr.nrec; k++){
+            total += r->len[k];
+        }
+        grow((void **)&r->sig, &r->sig_cap, total, sizeof(int16_t));
+        if(pread_all(r->data, r->sig, total*sizeof(int16_t), r->hdr.block) < 0){
+            return -1;
+        }
+        dir_account(r->dir, 0, total*sizeof(int16_t));
+        r->loaded = 1;
+    }
+    *samples = r->sig + r->at;
+    *n = r->len[r->i];
+    r->at += r->len[r->i];
+    r->i++;
+    return *n*sizeof(int16_t) + COL_ROW_BYTES;
+}
+
+static void col_rskip(void *p, int64_t file_bytes){
+    col_r_t *r = (col_r_t *)p;
+    if(col_batch(r) < 0){
+        ERROR("%s","Error reading columnar metadata!");
+        exit(EXIT_FAILURE);
+    }
+    r->at += r->len[r->i];
+    r->i++;
+}
+
+static void col_rclose(void *p){
+    col_r_t *r = (col_r_t *)p;
+    close(r->data);
+    close(r->meta);
+    free(r->cols);
+    free(r->sig);
+    free(r);
+}
+
+const writer_ops_t col_writer = {
+    "columnar", 0,
+    col_open, col_append_chunk, col_append_read, col_flush, col_close, NULL,
+    col_ropen, col_rnext, col_rskip, col_rclose,
+};
@@ -0,0 +1,57 @@
+/* @file writer.h
+**
+** output backends: how the reads of an output stream are laid out on disk and read back
+** @@
+******************************************************************************/
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stdint.h>
+#include "slowion.h"
+
+//where an output lives, given to a backend when it is opened for writing or reading
+typedef struct{
+    pos_t *pos;
+    int mypos;
+    int type; //direct (0) or converted (1) reads
+    int dir; //directory index, for I/O accounting
+    char path[4096]; //path without an extension, for backends that keep a fixed set of files per output
+} wloc_t;
+
+//what a read carries besides its signal
+typedef struct{
+    int32_t chan;
+    int32_t read_number;
+} wmeta_t;
+
+//a backend. Writing and reading of an output happen in different threads, each with its own state
+typedef struct{
+    const char *name;
+    //1 if the backend assembles each read from its chunks before writing it. An output that keeps the chunks anyway
+    //(for the --ring-mb ring) then hands it the read whole instead
+    int assembles;
+
+    void *(*open)(const wloc_t *loc);
+    //part of the signal of the next read, in order
+    void (*append_chunk)(void *w, const int16_t *samples, int64_t n);
+    //complete the next read: the chunks appended so far followed by samples. Returns the bytes the record takes in the output
+    int64_t (*append_read)(void *w, const wmeta_t *m, const int16_t *samples, int64_t n);
+    //make everything appended so far visible to the reader
+    void (*flush)(void *w);
+    void (*close)(void *w);
+    //spare fraction of the last chunk period, for backends that adapt (NULL if not)
+    void (*spare)(void *w, double spare);
+
+    void *(*ropen)(const wloc_t *loc);
+    //the next record, valid until the next call. Returns the bytes it takes in the output, or -1 on error
+    int64_t (*rnext)(void *r, const int16_t **samples, int64_t *n);
+    //step over the next record, already obtained elsewhere
+    void (*rskip)(void *r, int64_t file_bytes);
+    void (*rclose)(void *r);
+} writer_ops_t;
+
+extern const writer_ops_t raw_writer;
+extern const writer_ops_t col_writer;
+
+#endif
@@ -0,0 +1,164 @@
+#!/bin/sh
+# end-to-end tests, run from the repository root with make test
+
+SLOWION=${SLOWION:-./slowION}
+BENCH=${BENCH:-build/bench}
+TMP=${TMP:-test/tmp}
+mkdir -p "$TMP"
+
+die() {
+    echo "FAILED: $1"
+    exit 1
+}
+
+# a short run of 2 positions; every read must be read back with its checksum verified
+# usage: full_run NAME [slowION options]. The output is left in $TMP/NAME for further checks
+full_run() {
+    name=$1
+    shift
+    dir=$TMP/$name
+    log=$TMP/$name.log
+    rm -rf "$dir" "$log"
+    mkdir -p "$TMP"
+    $SLOWION -p 2 -c 200 -T 4 --chunk-ms 500 -d "$dir" "$@" > "$log" 2>&1 || die "$name: exited with an error, see $log"
+    n=$(grep -c "total samples \([0-9]*\), pseudobasecalled samples \1$" "$log")
+    [ "$n" -eq 2 ] || die "$name: not every sample was read back, see $log"
+    n=$(grep -c "checksums verified [1-9][0-9]* reads, 0 mismatches" "$log")
+    [ "$n" -eq 2 ] || die "$name: checksums were not verified on every position, see $log"
+}
+
+# every segment must be indexed and listed in the manifest
+# usage: check_segments NAME
+check_segments() {
+    dir=$TMP/$1
+    n=$(ls "$dir"/pos*.seg*.blow5 | wc -l)
+    [ "$(grep -vc '^#' "$dir/manifest.tsv")" -eq "$n" ] || die "$1: manifest.tsv does not list every segment"
+    for f in $(grep -v '^#' "$dir/manifest.tsv" | cut -f1); do
+        [ -f "$f.idx" ] || die "$1: $f has no index"
+    done
+}
+
+# kill a run while long reads are in flight, then recover its intermediate files
+# usage: interrupted_recover NAME [slowION options]
+interrupted_recover() {
+    name=$1
+    shift
+    dir=$TMP/$name
+    log=$TMP/$name
+    rm -rf "$dir" "$log".*.log
+    mkdir -p "$TMP"
+    # reads of ~8 chunks of 100 ms at 4000 bases/s, many complete in the first second, before conversion starts at 1.1 s
+    timeout -s KILL 1 $SLOWION -p 1 -c 200 -T 60 --chunk-ms 100 -r 3000 -b 4000 -d "$dir" "$@" > "$log.run.log" 2>&1
+    ls "$dir"/pos0/*.iblow5 > /dev/null 2>&1 || die "$name: the interrupted run left no intermediate files"
+    $SLOWION recover -d "$dir" -t 4 > "$log.recover.log" 2>&1 || die "$name: recover exited with an error, see $log.recover.log"
+    grep -q "checksum mismatch" "$log.recover.log" && die "$name: recover reported checksum mismatches, see $log.recover.log"
+    grep -q "recovered 0 reads" "$log.recover.log" && die "$name: recover converted no reads, see $log.recover.log"
+    # truncated files are left in place, so a second recover finds work again and must not touch the first output
+    size=$(wc -c < "$dir/recovered_pos0.blow5")
+    $SLOWION recover -d "$dir" -t 4 > "$log.recover2.log" 2>&1 || die "$name: second recover exited with an error, see $log.recover2.log"
+    [ "$(wc -c < "$dir/recovered_pos0.blow5")" -eq "$size" ] || die "$name: second recover overwrote recovered_pos0.blow5"
+    echo "PASSED: $name"
+}
+
+# sub-second chunk periods
+full_run subsecond --chunk-ms 100 -T 3
+echo "PASSED: subsecond"
+
+# channels spread over time slots of the chunk period
+full_run stagger --stagger 4
+echo "PASSED: stagger"
+
+# read length distributions. Empirical lengths are short enough for reads to complete within the run
+full_run rlen_lognormal --rlen-dist lognormal
+echo "PASSED: rlen_lognormal"
+printf "300 3\n800 1\n" > "$TMP/rlen.txt"
+full_run rlen_empirical --rlen-dist empirical --rlen-file "$TMP/rlen.txt"
+echo "PASSED: rlen_empirical"
+
+# partial occupancy, pores dying within seconds and mux scans replacing them
+full_run pores --occupancy 0.8 --pore-halflife 0.001 --mux-scan 2
+echo "PASSED: pores"
+
+# stream to a receiver over a Unix socket and read back from where it writes
+rm -rf "$TMP/recv" "$TMP/sink.sock"
+$SLOWION recv -s "unix:$TMP/sink.sock" -d "$TMP/recv" -n 4 > "$TMP/recv.log" 2>&1 &
+recv=$!
+sleep 1
+full_run sink --sink "unix:$TMP/sink.sock" --sink-dir "$TMP/recv"
+wait $recv || die "sink: the receiver exited with an error, see $TMP/recv.log"
+echo "PASSED: sink"
+
+# segments by records, also from worker processes, and by time
+full_run segments --seg-reads 5 --procs 2
+check_segments segments
+echo "PASSED: segments"
+full_run segments_time --seg-time 1
+check_segments segments_time
+echo "PASSED: segments_time"
+
+# all positions in one shared file, with its index built from the reservations
+full_run shared --shared 1
+[ -s "$TMP/shared/shared0.blow5.idx.tsv" ] || die "shared: no index of the shared file"
+echo "PASSED: shared"
+
+# read-back through the shared-memory ring
+full_run ring --ring-mb 4
+[ "$(grep -c "read-back from ring [1-9]" "$TMP/ring.log")" -eq 2 ] || die "ring: reads were not taken from the ring, see $TMP/ring.log"
+echo "PASSED: ring"
+
+full_run procs --procs 2
+echo "PASSED: procs"
+
+# well within what storage can take, so backpressure must never leave normal
+full_run backpressure --backpressure -c 512 -T 10 --chunk-ms 200
+grep -q "backpressure 0 level changes" "$TMP/backpressure.log" || die "backpressure: changed level without storage pressure, see $TMP/backpressure.log"
+echo "PASSED: backpressure"
+
+# compression chosen per segment from the writer's spare time
+full_run adapt --adapt-press --seg-time 1
+check_segments adapt
+echo "PASSED: adapt"
+
+interrupted_recover recover
+interrupted_recover recover_no_checksum --no-checksum
+
+# stage spans of every thread, from worker processes too
+full_run trace --trace "$TMP/trace.json" --procs 2
+[ "$(grep -c "spans written" "$TMP/trace.log")" -eq 2 ] || die "trace: not every worker wrote its spans, see $TMP/trace.log"
+grep -q '"ph":"X"' "$TMP/trace.json" || die "trace: no spans in $TMP/trace.json"
+echo "PASSED: trace"
+
+# the microbenchmarks at the smallest scale, through every backend
+if [ -x "$BENCH" ]; then
+    $BENCH 1 > "$TMP/bench.log" 2>&1 || die "bench: exited with an error, see $TMP/bench.log"
+    echo "PASSED: bench"
+else
+    echo "SKIPPED: bench, $BENCH not built"
+fi
+
+# output formats other than BLOW5, also with the ring
+full_run format_raw --format raw
+echo "PASSED: format_raw"
+full_run format_columnar --format columnar --ring-mb 4
+echo "PASSED: format_columnar"
+
+# memory-mapped output with small windows, so that the run maps, preallocates and retires many of them
+full_run mmap --mmap-mb 0.05
+echo "PASSED: mmap"
+full_run mmap_procs --mmap-mb 0.05 --procs 2
+echo "PASSED: mmap_procs"
+
+# intermediate files unlinked in batches by the reclaim thread
+full_run reclaim --reclaim-batch 4
+[ "$(grep -c "reclaim: [1-9][0-9]* unlinks" "$TMP/reclaim.log")" -eq 1 ] || die "reclaim: no unlinks reported, see $TMP/reclaim.log"
+ls "$TMP"/reclaim/pos*/*.iblow5 > /dev/null 2>&1 && die "reclaim: intermediate files were left behind"
+echo "PASSED: reclaim"
+
+# page-cache hints, and reading back only what was evicted from the page cache
+full_run fadvise --fadvise 0.2
+echo "PASSED: fadvise"
+full_run cold_read --cold-read
+echo "PASSED: cold_read"
+
+rm -rf "$TMP"
+echo "all tests passed"